@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-abr-defs.h : adaptive bitrate strategies (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_ABR_DEFS_H__
+#define __SMTH_ABR_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-abr-defs.h
+ * \brief  Adaptive bitrate strategies (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-common-defs.h>
+#include <smth.h>
+
+/** The throughput needed to pick a bitrate, as a multiple of it */
+#define ABR_DEFAULT_HEADROOM      1.25
+/** The buffer target when the read-ahead window is unbounded, in s */
+#define ABR_DEFAULT_TARGET        30.
+/** The default reservoir, as a share of the buffer target */
+#define ABR_DEFAULT_RESERVOIR     0.35
+/** The smallest buffer target, in fragments */
+#define ABR_MIN_TARGET_FRAGMENTS  2.
+
+static void getparams(const SMTH_abrstate *state, const SMTH_abrparams *params,
+	SMTH_abrparams *out);
+static uint32_t fitbitrate(const SMTH_abrstate *state, double throughput,
+	double headroom);
+static uint32_t bolabitrate(const SMTH_abrstate *state,
+	const SMTH_abrparams *params);
+
+#endif /* __SMTH_ABR_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
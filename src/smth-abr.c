@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-abr.c : adaptive bitrate strategies
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-abr.c
+ * \brief  Adaptive bitrate strategies.
+ * \author Stefano Sanfilippo
+ */
+
+#include <math.h>
+
+#include <smth-abr-defs.h>
+
+/**
+ * \brief Picks the highest bitrate the throughput allows, with some headroom.
+ *
+ * Until something is downloaded, the highest bitrate is picked.
+ *
+ * \param state  What is known of the stream.
+ * \param params A \c SMTH_abrparams, or \c NULL.
+ * \return       The bitrate of the next fragment.
+ */
+uint32_t SMTH_throughputabr(const SMTH_abrstate *state, void *params)
+{
+	SMTH_abrparams p;
+
+	if (!state->throughput) return state->bitrates[state->bitratesno - 1];
+
+	getparams(state, params, &p);
+	return fitbitrate(state, state->throughput, p.headroom);
+}
+
+/**
+ * \brief Picks the bitrate from the buffer level alone, as in BOLA.
+ *
+ * The lowest bitrate is picked while the buffer is below the reservoir, the
+ * highest one once it reaches the target, and something in between
+ * otherwise, trading the quality of the fragment against the risk of a
+ * rebuffer. If the buffer level is unknown, \c SMTH_throughputabr is used.
+ *
+ * \param state  What is known of the stream.
+ * \param params A \c SMTH_abrparams, or \c NULL.
+ * \return       The bitrate of the next fragment.
+ */
+uint32_t SMTH_bufferabr(const SMTH_abrstate *state, void *params)
+{
+	SMTH_abrparams p;
+
+	if (state->buffer < 0) return SMTH_throughputabr(state, params);
+
+	getparams(state, params, &p);
+	return bolabitrate(state, &p);
+}
+
+/**
+ * \brief Picks the bitrate from the buffer level, within what the throughput
+ *        allows.
+ *
+ * The bitrate chosen by \c SMTH_bufferabr is lowered to the one the smoothed
+ * throughput allows, and raised to the one a pessimistic throughput allows,
+ * so that a low buffer does not waste a good network, nor a full buffer
+ * starts a download the network cannot keep up with. It starts from the
+ * lowest bitrate. If the buffer level is unknown, \c SMTH_throughputabr is
+ * used.
+ *
+ * \param state  What is known of the stream.
+ * \param params A \c SMTH_abrparams, or \c NULL.
+ * \return       The bitrate of the next fragment.
+ */
+uint32_t SMTH_hybridabr(const SMTH_abrstate *state, void *params)
+{
+	SMTH_abrparams p;
+	uint32_t bitrate, safe, fast;
+
+	if (state->buffer < 0) return SMTH_throughputabr(state, params);
+
+	getparams(state, params, &p);
+
+	bitrate = bolabitrate(state, &p);
+	safe = fitbitrate(state, state->safethroughput, p.headroom);
+	fast = state->throughput?
+		fitbitrate(state, state->throughput, p.headroom):
+		state->bitrates[state->bitratesno - 1];
+
+	if (bitrate < safe) bitrate = safe;
+	if (bitrate > fast) bitrate = fast;
+
+	return bitrate;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief        Fills in the parameters of the built-in strategies, replacing
+ *               what is unset with the defaults.
+ *
+ * \param state  What is known of the stream.
+ * \param params The parameters given by the user, or \c NULL.
+ * \param out    The parameters to be used.
+ */
+static void getparams(const SMTH_abrstate *state, const SMTH_abrparams *params,
+	SMTH_abrparams *out)
+{
+	double shortest = ABR_MIN_TARGET_FRAGMENTS * state->duration;
+
+	if (params) *out = *params;
+	else out->headroom = out->reservoir = out->target = 0;
+
+	if (out->headroom <= 0) out->headroom = ABR_DEFAULT_HEADROOM;
+
+	if (out->target <= 0)
+		out->target = state->capacity?
+			state->capacity - state->duration: ABR_DEFAULT_TARGET;
+	if (out->target < shortest) out->target = shortest;
+
+	if (out->reservoir <= 0 || out->reservoir >= out->target)
+		out->reservoir = ABR_DEFAULT_RESERVOIR * out->target;
+}
+
+/**
+ * \brief            Picks the highest bitrate a throughput allows.
+ *
+ * \param state      What is known of the stream.
+ * \param throughput The throughput, in bit/s.
+ * \param headroom   How many times the bitrate the throughput must be.
+ * \return           The highest bitrate allowed, or the lowest one if none is.
+ */
+static uint32_t fitbitrate(const SMTH_abrstate *state, double throughput,
+	double headroom)
+{
+	size_t i;
+
+	for (i = state->bitratesno - 1; i > 0; --i)
+		if (state->bitrates[i] * headroom <= throughput) break;
+
+	return state->bitrates[i];
+}
+
+/**
+ * \brief        Picks a bitrate from the buffer level, as in BOLA.
+ *
+ * Each bitrate is scored by its utility (the logarithm of its ratio to the
+ * lowest one) against the buffer level, per bit to be downloaded: the best
+ * score wins. The weights are chosen so that the lowest bitrate wins up to
+ * \c SMTH_abrparams::reservoir, and the highest one from
+ * \c SMTH_abrparams::target on.
+ *
+ * \param state  What is known of the stream, with a known buffer level.
+ * \param params The parameters to be used, none unset.
+ * \return       The bitrate of the next fragment.
+ */
+static uint32_t bolabitrate(const SMTH_abrstate *state,
+	const SMTH_abrparams *params)
+{
+	size_t i, best = 0;
+	double lowest = state->bitrates[0];
+	double top = log(state->bitrates[state->bitratesno - 1] / lowest) + 1.;
+	double gamma, weight, score, bestscore = -INFINITY;
+
+	if (top <= 1.) return state->bitrates[0]; /* a single bitrate */
+
+	gamma = (top - 1.) / (params->target / params->reservoir - 1.);
+	weight = params->reservoir / gamma;
+
+	for (i = 0; i < state->bitratesno; ++i)
+	{
+		double utility = log(state->bitrates[i] / lowest) + 1.;
+
+		score = (weight * (utility + gamma) - state->buffer) /
+			state->bitrates[i];
+		if (score > bestscore)
+		{   bestscore = score;
+			best = i;
+		}
+	}
+
+	return state->bitrates[best];
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
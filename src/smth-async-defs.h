@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-async-defs.h : asynchronous handles dispatcher (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_ASYNC_DEFS_H__
+#define __SMTH_ASYNC_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-async-defs.h
+ * \brief  Asynchronous handles dispatcher (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <pthread.h>
+#include <curl/multi.h>
+#include <smth-async.h>
+#include <smth-live.h>
+
+/** The longest time the dispatcher sleeps if nothing happens, in ms */
+#define ASYNC_MAX_WAIT 1000
+
+/** \brief Holds the state of the dispatcher thread.
+ *
+ *  A single curl multi handle, driven by the dispatcher only, runs the
+ *  transfers of every asynchronous handle. Other threads talk to it through
+ *  the queues below, and wake it up with \c curl_multi_wakeup.
+ */
+typedef struct
+{
+	/** The multi handle shared by all asynchronous handles */
+	CURLM *multi;
+	/** The dispatcher thread */
+	pthread_t thread;
+	/** The outcome of the dispatcher start */
+	error_t status;
+	/** The handles started, linked by \c Handle::nextstarted. Used by the
+	 *  dispatcher thread only. */
+	Handle *started;
+	/** Protects the fields below */
+	pthread_mutex_t lock;
+	/** Signaled when the dispatcher withdraws an handle */
+	pthread_cond_t withdrawn;
+	/** Handles to be started, linked by \c Handle::nextin */
+	Handle *incoming;
+	/** Handles to be dropped, linked by \c Handle::nextout */
+	Handle *outgoing;
+} Dispatcher;
+
+static void startdispatcher(void);
+static void *dispatch(void *data);
+static void withdraw(Handle *h);
+static void endtransfer(CURLM *multi, CURLMsg *msg);
+static void manifestloaded(Handle *h);
+static void feedstream(StreamHandle *s);
+static void notifyeos(StreamHandle *s);
+static void notifyerror(Handle *h, int stream, error_t error);
+
+#endif /* __SMTH_ASYNC_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
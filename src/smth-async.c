@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-async.c : asynchronous handles dispatcher
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-async.c
+ * \brief  Asynchronous handles dispatcher.
+ * \author Stefano Sanfilippo
+ */
+
+#include <stdlib.h>
+
+#include <smth-async-defs.h>
+
+/** The dispatcher, started by the first asynchronous handle */
+static Dispatcher dispatcher;
+/** Guards the start of the dispatcher */
+static pthread_once_t dispatcheronce = PTHREAD_ONCE_INIT;
+
+/**
+ * \brief Hands a new asynchronous handle to the dispatcher, which will load
+ *        its Manifest and then feed its streams.
+ *
+ * The dispatcher thread is started on the first call.
+ *
+ * \param handle The handle, whose \c Handle::url and \c Handle::callbacks
+ *               must be already set.
+ * \return       \c FETCHER_SUCCESS or \c ASYNC_NO_DISPATCHER
+ */
+error_t SMTH_submithandle(Handle *handle)
+{
+	pthread_once(&dispatcheronce, startdispatcher);
+	if (dispatcher.status) return dispatcher.status;
+
+	pthread_mutex_lock(&dispatcher.lock);
+	handle->nextin = dispatcher.incoming;
+	dispatcher.incoming = handle;
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	curl_multi_wakeup(dispatcher.multi);
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Takes an asynchronous handle back from the dispatcher, so that no
+ *        more callbacks will be issued.
+ *
+ * From any thread but the dispatcher, the call waits until the dispatcher is
+ * done with the handle. From a callback, it can't: the dispatcher will dispose
+ * of the handle itself, as soon as the callback returns.
+ *
+ * \param handle The handle to be withdrawn.
+ * \return       \c true if the handle is to be disposed of by the caller,
+ *               \c false if the dispatcher will do it.
+ */
+bool SMTH_withdrawhandle(Handle *handle)
+{
+	bool fromcallback = pthread_equal(pthread_self(), dispatcher.thread);
+
+	if (fromcallback)
+	{   handle->closing = true;
+		handle->orphan = true;
+	}
+
+	pthread_mutex_lock(&dispatcher.lock);
+	handle->nextout = dispatcher.outgoing;
+	dispatcher.outgoing = handle;
+
+	if (!fromcallback)
+	{   curl_multi_wakeup(dispatcher.multi);
+		while (!handle->withdrawn)
+			pthread_cond_wait(&dispatcher.withdrawn, &dispatcher.lock);
+	}
+	pthread_mutex_unlock(&dispatcher.lock);
+
+	return !fromcallback;
+}
+
+/**
+ * \brief Starts the download of the Manifest of an asynchronous handle on
+ *        its \c Handle::multi
+ *
+ * \param h The handle to be started.
+ * \return  \c FETCHER_SUCCESS or an error code from \c SMTH_startmanifest
+ */
+error_t SMTH_starthandle(Handle *h)
+{
+	h->manifestload.userdata = h;
+
+	return SMTH_startmanifest(&h->manifestload, h->multi, h->url, h->params,
+		&h->manifest, &h->refresher.update);
+}
+
+/**
+ * \brief Aborts whatever an asynchronous handle is downloading. No more
+ *        callbacks will be issued.
+ *
+ * To be called by the thread driving \c Handle::multi only.
+ *
+ * \param h The handle to be stopped.
+ */
+void SMTH_stophandle(Handle *h)
+{
+	count_t i;
+
+	h->closing = true;
+
+	SMTH_abortmanifest(&h->manifestload, h->multi);
+
+	for (i = 0; i < h->streamsno; ++i)
+		if (h->streams[i]->fetcher.handle)
+			SMTH_disposefetcher(&h->streams[i]->fetcher);
+}
+
+/**
+ * \brief Turns the transfers finished on a multi handle into callbacks.
+ *
+ * \param multi The multi handle, carrying transfers of asynchronous handles
+ *              only.
+ */
+void SMTH_dispatchmessages(CURLM *multi)
+{
+	CURLMsg *msg;
+	int queue;
+
+	while ((msg = curl_multi_info_read(multi, &queue)))
+		endtransfer(multi, msg);
+}
+
+/**
+ * \brief Tells how long until a failed transfer of an asynchronous handle is
+ *        retried, its live Manifest is refreshed, or a resumed stream is fed
+ *        \sa SMTH_fetcherdelay
+ *
+ * \param h The handle.
+ * \return  The delay in ms, or -1 if nothing is waiting to be retried.
+ */
+long SMTH_retrydelay(Handle *h)
+{
+	long delay, shortest = SMTH_refreshdelay(h);
+	count_t i;
+
+	for (i = 0; i < h->streamsno; ++i)
+	{
+		StreamHandle *s = h->streams[i];
+		if (s->over || !s->fetcher.handle) continue;
+
+		if (__atomic_load_n(&s->resumed, __ATOMIC_ACQUIRE)) return 0;
+
+		delay = SMTH_fetcherdelay(&s->fetcher);
+		if (delay >= 0 && (shortest < 0 || delay < shortest)) shortest = delay;
+	}
+
+	return shortest;
+}
+
+/**
+ * \brief Retries the failed transfers of an asynchronous handle whose time
+ *        has come, and feeds the streams resumed by \c SMTH_ackfragment, as
+ *        nothing else would wake them up. Its live Manifest is refreshed when
+ *        due.
+ *
+ * To be called by the thread driving \c Handle::multi only.
+ *
+ * \param h The handle.
+ */
+void SMTH_retryhandle(Handle *h)
+{
+	error_t error;
+	count_t i;
+
+	error = SMTH_refreshhandle(h);
+	if (error) SMTH_error(error, stderr);
+
+	for (i = 0; i < h->streamsno && !h->closing; ++i)
+	{
+		StreamHandle *s = h->streams[i];
+		if (s->over || !s->fetcher.handle) continue;
+
+		bool resumed = __atomic_exchange_n(&s->resumed, false,
+			__ATOMIC_ACQUIRE);
+		if (resumed || !SMTH_fetcherdelay(&s->fetcher)) feedstream(s);
+	}
+}
+
+/**
+ * \brief Wakes up the thread driving an asynchronous handle, for it to feed
+ *        the streams resumed. An external handle is fed by the next
+ *        \c SMTH_process instead, as told by \c SMTH_gettimeout
+ *
+ * It may be called from any thread.
+ *
+ * \param h The handle.
+ */
+void SMTH_wakehandle(Handle *h)
+{
+	if (!h->external) curl_multi_wakeup(dispatcher.multi);
+}
+
+/**
+ * \brief Tells whether a stream of an asynchronous handle is paused, waiting
+ *        for its fragments to be acknowledged \sa SMTH_ackfragment
+ *
+ * \param h The handle.
+ * \return  \c true if any stream is paused.
+ */
+bool SMTH_pausedhandle(Handle *h)
+{
+	bool paused = false;
+	count_t i;
+
+	for (i = 0; i < h->streamsno && !paused; ++i)
+	{
+		StreamHandle *s = h->streams[i];
+
+		pthread_mutex_lock(&s->lock);
+		paused = s->paused;
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return paused;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Creates the shared multi handle and starts the dispatcher thread.
+ *        To be called through \c pthread_once only.
+ */
+static void startdispatcher(void)
+{
+	pthread_mutex_init(&dispatcher.lock, NULL);
+	pthread_cond_init(&dispatcher.withdrawn, NULL);
+
+	if (!SMTH_startcurl() || !(dispatcher.multi = curl_multi_init()))
+	{   dispatcher.status = ASYNC_NO_DISPATCHER;
+		return;
+	}
+
+	if (pthread_create(&dispatcher.thread, NULL, dispatch, NULL))
+	{   curl_multi_cleanup(dispatcher.multi);
+		dispatcher.status = ASYNC_NO_DISPATCHER;
+		return;
+	}
+
+	pthread_detach(dispatcher.thread);
+}
+
+/**
+ * \brief The dispatcher thread: drives the shared multi handle, and turns
+ *        finished transfers into callbacks. It runs until the process exits.
+ *
+ * \param data Unused.
+ */
+static void *dispatch(void *data)
+{
+	Handle *h, *next;
+	error_t error;
+	int running;
+
+	(void) data;
+
+	while (true)
+	{
+		pthread_mutex_lock(&dispatcher.lock);
+		Handle *incoming = dispatcher.incoming;
+		Handle *outgoing = dispatcher.outgoing;
+		dispatcher.incoming = dispatcher.outgoing = NULL;
+		pthread_mutex_unlock(&dispatcher.lock);
+
+		/* handles opened and closed at once are started, then stopped */
+		for (h = incoming; h; h = next)
+		{   next = h->nextin;
+			h->multi = dispatcher.multi;
+			error = SMTH_starthandle(h);
+			if (error) notifyerror(h, -1, error);
+			h->nextstarted = dispatcher.started;
+			dispatcher.started = h;
+		}
+		for (h = outgoing; h; h = next)
+		{   next = h->nextout;
+			withdraw(h);
+		}
+
+		curl_multi_perform(dispatcher.multi, &running);
+		SMTH_dispatchmessages(dispatcher.multi);
+
+		/* failed transfers are retried on time, even if nothing happens */
+		long wait = ASYNC_MAX_WAIT;
+		for (h = dispatcher.started; h; h = h->nextstarted)
+		{   SMTH_retryhandle(h);
+			long delay = SMTH_retrydelay(h);
+			if (delay >= 0 && delay < wait) wait = delay;
+		}
+
+		curl_multi_poll(dispatcher.multi, NULL, 0, wait, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Drops an handle taken back by \c SMTH_withdrawhandle, giving it to
+ *        the waiting caller (or disposing of it, if it was orphaned).
+ *
+ * \param h The handle to be withdrawn.
+ */
+static void withdraw(Handle *h)
+{
+	Handle **link;
+
+	for (link = &dispatcher.started; *link; link = &(*link)->nextstarted)
+		if (*link == h)
+		{   *link = h->nextstarted;
+			break;
+		}
+
+	SMTH_stophandle(h);
+
+	if (h->orphan)
+	{   SMTH_disposehandle(h);
+		return;
+	}
+
+	pthread_mutex_lock(&dispatcher.lock);
+	h->withdrawn = true;
+	pthread_cond_broadcast(&dispatcher.withdrawn);
+	pthread_mutex_unlock(&dispatcher.lock);
+}
+
+/**
+ * \brief Handles a message from the multi handle of asynchronous handles.
+ *
+ * \param multi The multi handle.
+ * \param msg   The message.
+ */
+static void endtransfer(CURLM *multi, CURLMsg *msg)
+{
+	Transfer *t = SMTH_endtransfer(multi, msg);
+
+	if (!t) return;
+
+	if (!t->fetcher)
+	{   manifestloaded(t->userdata);
+		return;
+	}
+
+	StreamHandle *s = t->fetcher->userdata;
+	if (!s->owner->closing) feedstream(s);
+}
+
+/**
+ * \brief Parses the Manifest of an handle, once downloaded, and starts
+ *        feeding its streams.
+ *
+ * \param h The handle whose Manifest was downloaded.
+ */
+static void manifestloaded(Handle *h)
+{
+	error_t error;
+	count_t i;
+
+	if (h->closing)
+	{   SMTH_abortmanifest(&h->manifestload, h->multi);
+		return;
+	}
+
+	/* a refresh of a live presentation */
+	if (h->streamsno)
+	{   SMTH_refreshed(h);
+		for (i = 0; i < h->streamsno && !h->closing; ++i)
+			if (!h->streams[i]->over) feedstream(h->streams[i]);
+		return;
+	}
+
+	error = SMTH_takemanifest(&h->manifestload);
+	if (!error) error = SMTH_openstreams(h, h->url, h->params, h->multi);
+
+	if (error)
+	{   notifyerror(h, -1, error);
+		return;
+	}
+
+	if (h->callbacks.on_manifest)
+		h->callbacks.on_manifest(h, h->userdata);
+
+	for (i = 0; i < h->streamsno && !h->closing; ++i)
+	{
+		StreamHandle *s = h->streams[i];
+
+		if (s->over) notifyeos(s); /* nothing to download */
+		else feedstream(s);
+	}
+}
+
+/**
+ * \brief Delivers the fragments of a stream that are ready, in order, and
+ *        keeps its transfers going, as long as its read-ahead window is not
+ *        full.
+ *
+ * \param s The stream to be fed.
+ */
+static void feedstream(StreamHandle *s)
+{
+	Handle *h = s->owner;
+	error_t error;
+
+	/* the timeline grows only here, as the dispatcher reads it */
+	pthread_mutex_lock(&s->lock);
+	error = SMTH_takechunks(s);
+	pthread_mutex_unlock(&s->lock);
+
+	if (error)
+	{   s->over = true;
+		notifyerror(h, s->number, error);
+		return;
+	}
+
+	while (!s->over && !h->closing)
+	{
+		SharedFragment *f = NULL;
+
+		error = SMTH_pollchunk(&s->fetcher, s->index);
+		if (error == FETCHER_PENDING) return;
+		/* the chunk keeps its slot until the stream is resumed */
+		if (!error && SMTH_pausestream(s)) return;
+		if (!error) error = SMTH_loadfragment(&s->fetcher, s->index, false, &f);
+
+		if (error == FETCHER_NO_CHUNK)
+		{   /* a live stream waits for the refresher */
+			if (!s->live) notifyeos(s);
+			return;
+		}
+		else if (error)
+		{   s->over = true;
+			notifyerror(h, s->number, error);
+			return;
+		}
+
+		s->index++;
+
+		if (!f) continue; /* broken chunk */
+
+		/* the next chunks may be requested without refreshing the Manifest */
+		pthread_mutex_lock(&s->lock);
+		error = SMTH_lookahead(s, &f->fragment);
+		pthread_mutex_unlock(&s->lock);
+		if (error) SMTH_error(error, stderr);
+
+		/* nothing is delivered, hence nothing will be acknowledged */
+		if (!h->callbacks.on_fragment)
+		{   SMTH_releasefragment(&f->view);
+			continue;
+		}
+
+		if (!SMTH_holdfragment(s, f))
+		{   SMTH_releasefragment(&f->view);
+			s->over = true;
+			notifyerror(h, s->number, SMTH_NO_MEMORY);
+			return;
+		}
+
+		h->callbacks.on_fragment(h, s->number, &f->view, h->userdata);
+		SMTH_releasefragment(&f->view);
+	}
+}
+
+/**
+ * \brief Marks a stream as over, and issues \c SMTH_callbacks::on_eos
+ *
+ * \param s The stream that is over.
+ */
+static void notifyeos(StreamHandle *s)
+{
+	Handle *h = s->owner;
+
+	s->over = true;
+
+	pthread_mutex_lock(&s->readlock);
+	s->EOS = true;
+	pthread_mutex_unlock(&s->readlock);
+
+	if (h->callbacks.on_eos) h->callbacks.on_eos(h, s->number, h->userdata);
+}
+
+/**
+ * \brief Issues \c SMTH_callbacks::on_error
+ *
+ * \param h      The handle to be notified.
+ * \param stream The index of the stream, or \c -1 for the whole handle.
+ * \param error  The error code.
+ */
+static void notifyerror(Handle *h, int stream, error_t error)
+{
+	if (h->callbacks.on_error)
+		h->callbacks.on_error(h, stream, error, h->userdata);
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
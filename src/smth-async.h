@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-async.h : asynchronous handles dispatcher (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_ASYNC_H__
+#define __SMTH_ASYNC_H__
+
+/**
+ * \internal
+ * \file   smth-async.h
+ * \brief  Asynchronous handles dispatcher (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-common-defs.h>
+#include <smth-defs.h>
+
+/** Could not start the dispatcher of asynchronous handles */
+#define ASYNC_NO_DISPATCHER (-44)
+
+error_t SMTH_submithandle(Handle *handle);
+bool SMTH_withdrawhandle(Handle *handle);
+error_t SMTH_starthandle(Handle *h);
+void SMTH_stophandle(Handle *h);
+void SMTH_dispatchmessages(CURLM *multi);
+long SMTH_retrydelay(Handle *h);
+void SMTH_retryhandle(Handle *h);
+void SMTH_wakehandle(Handle *h);
+bool SMTH_pausedhandle(Handle *h);
+
+#endif /* __SMTH_ASYNC_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
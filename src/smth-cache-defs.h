@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-cache-defs.h : persistent fragment cache (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_CACHE_DEFS_H__
+#define __SMTH_CACHE_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-cache-defs.h
+ * \brief  Persistent fragment cache (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-cache.h>
+
+/** The bytes stored before evicting, unless otherwise set: 256MiB */
+#define CACHE_DEFAULT_BUDGET   (256ULL << 20)
+/** The name of the index journal, in the cache directory */
+#define CACHE_INDEX_FILE       "index"
+/** The name of the file locked by the processes using the cache directory */
+#define CACHE_LOCK_FILE        "lock"
+/** The prefix of the files being written */
+#define CACHE_TEMP_PREFIX      "tmp."
+/** The first bytes of the index journal, changed with its format */
+#define CACHE_INDEX_MAGIC      "SMTHIDX1"
+/** The length of \c CACHE_INDEX_MAGIC */
+#define CACHE_MAGIC_LENGTH     8
+/** The least number of slots of \c Cache::entries */
+#define CACHE_MIN_SLOTS        64
+/** The index is compacted once it holds this many records per chunk */
+#define CACHE_COMPACT_RATIO    4
+/** The offset basis of the FNV-1a hash of chunk keys */
+#define CACHE_HASH_BASIS       14695981039346656037ULL
+/** The prime of the FNV-1a hash of chunk keys */
+#define CACHE_HASH_PRIME       1099511628211ULL
+/** Files left half written by a crashed process are removed after this many
+ *  seconds */
+#define CACHE_STALE_TEMP       3600
+
+static Cache *opencache(const char *dir, length_t budget);
+static void closecache(Cache *c);
+static bool lockcache(Cache *c);
+static void unlockcache(Cache *c);
+static bool openindex(Cache *c);
+static bool syncindex(Cache *c);
+static void appendrecord(Cache *c, const CacheEntry *e);
+static void compactindex(Cache *c);
+static CacheEntry *findentry(Cache *c, cachekey_t key);
+static bool putentry(Cache *c, cachekey_t key, uint64_t size, uint64_t used);
+static void dropentry(Cache *c, CacheEntry *e);
+static bool growtable(Cache *c);
+static void evict(Cache *c, cachekey_t keep);
+static void chunkname(Cache *c, cachekey_t key, char *path);
+static void cleantemp(Cache *c);
+static uint64_t now(void);
+
+#endif /* __SMTH_CACHE_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
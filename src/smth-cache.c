@@ -0,0 +1,704 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-cache.c : persistent fragment cache
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-cache.c
+ * \brief  Persistent fragment cache.
+ * \author Stefano Sanfilippo
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <smth-cache-defs.h>
+
+/** Protects \c defaultcache and \c defaultbudget */
+static pthread_mutex_t defaultlock = PTHREAD_MUTEX_INITIALIZER;
+/** The cache of the handles opened from now on, or \c NULL */
+static Cache *defaultcache = NULL;
+/** The budget of the caches opened from now on */
+static length_t defaultbudget = CACHE_DEFAULT_BUDGET;
+
+/**
+ * \brief Sets the cache directory of the handles opened from now on. Handles
+ *        already open keep the cache they have.
+ *
+ * The directory is created, if it does not exist.
+ *
+ * \param dir The cache directory, or \c NULL to disable the cache.
+ * \return    CACHE_SUCCESS or CACHE_NO_DIR: the cache is then disabled.
+ */
+error_t SMTH_setcachedir(const char *dir)
+{
+	Cache *c = NULL, *old;
+	error_t error = CACHE_SUCCESS;
+
+	pthread_mutex_lock(&defaultlock);
+	if (dir && !(c = opencache(dir, defaultbudget))) error = CACHE_NO_DIR;
+	old = defaultcache;
+	defaultcache = c;
+	pthread_mutex_unlock(&defaultlock);
+
+	if (old) SMTH_releasecache(old);
+
+	return error;
+}
+
+/**
+ * \brief Sets how many bytes the cache may hold, before the least recently
+ *        used chunks are evicted.
+ *
+ * It applies to the current cache as well, from the next chunk stored.
+ *
+ * \param budget The budget in bytes, 0 = unlimited.
+ */
+void SMTH_setcachebudget(length_t budget)
+{
+	pthread_mutex_lock(&defaultlock);
+	defaultbudget = budget;
+	if (defaultcache)
+	{   pthread_mutex_lock(&defaultcache->lock);
+		defaultcache->budget = budget;
+		pthread_mutex_unlock(&defaultcache->lock);
+	}
+	pthread_mutex_unlock(&defaultlock);
+}
+
+/**
+ * \brief Gives the cache of the handles being opened.
+ *
+ * \return The cache, to be released with \c SMTH_releasecache, or \c NULL if
+ *         there is none.
+ */
+Cache *SMTH_defaultcache(void)
+{
+	Cache *c;
+
+	pthread_mutex_lock(&defaultlock);
+	c = defaultcache;
+	if (c)
+	{   pthread_mutex_lock(&c->lock);
+		c->refs++;
+		pthread_mutex_unlock(&c->lock);
+	}
+	pthread_mutex_unlock(&defaultlock);
+
+	return c;
+}
+
+/**
+ * \brief Gives back a cache taken with \c SMTH_defaultcache, closing it once
+ *        nobody uses it anymore.
+ *
+ * \param c The cache.
+ */
+void SMTH_releasecache(Cache *c)
+{
+	bool last;
+
+	pthread_mutex_lock(&c->lock);
+	last = !--c->refs;
+	pthread_mutex_unlock(&c->lock);
+
+	if (last) closecache(c);
+}
+
+/**
+ * \brief Tells the key of a chunk, which is the same for every process
+ *        downloading it.
+ *
+ * \param base    The url of the presentation.
+ * \param pattern The \c Stream::url pattern of the chunk.
+ * \param bitrate The bitrate of the track.
+ * \param time    The \c Chunk::time
+ * \return        The key, never 0.
+ */
+cachekey_t SMTH_cachekey(const char *base, const char *pattern,
+	bitrate_t bitrate, tick_t time)
+{
+	cachekey_t key = CACHE_HASH_BASIS;
+	uint64_t numbers[] = { bitrate, time };
+	const char *c;
+	count_t i;
+
+	/* FNV-1a, terminators included, so that fields do not run together */
+	c = base;
+	do key = (key ^ (unsigned char) *c) * CACHE_HASH_PRIME; while (*c++);
+	c = pattern;
+	do key = (key ^ (unsigned char) *c) * CACHE_HASH_PRIME; while (*c++);
+	for (i = 0; i < sizeof (numbers); ++i)
+		key = (key ^ ((numbers[i / 8] >> (8 * (i % 8))) & 0xff)) *
+			CACHE_HASH_PRIME;
+
+	return key? key: 1;
+}
+
+/**
+ * \brief Opens a chunk stored in the cache, and marks it as just used.
+ *
+ * \param c   The cache.
+ * \param key The key of the chunk.
+ * \return    A read only stream with the chunk, or \c NULL if it is not
+ *            cached.
+ */
+FILE *SMTH_cachelookup(Cache *c, cachekey_t key)
+{
+	char path[CACHE_MAX_PATH];
+	FILE *input = NULL;
+	CacheEntry *e;
+
+	if (!lockcache(c)) return NULL;
+
+	e = findentry(c, key);
+	if (e)
+	{
+		chunkname(c, key, path);
+		input = fopen(path, "r");
+		if (input)
+		{   e->used = now();
+			appendrecord(c, e);
+		}
+		else
+		{   /* removed from outside: forget it */
+			CacheEntry gone = { key, 0, now() };
+			dropentry(c, e);
+			appendrecord(c, &gone);
+		}
+	}
+
+	unlockcache(c);
+
+	return input;
+}
+
+/**
+ * \brief Creates a file in the cache directory, to write a chunk to. Until it
+ *        is committed, other processes will not see it.
+ *
+ * \param c    The cache.
+ * \param path A buffer at least \c CACHE_MAX_PATH bytes long, filled with the
+ *             name of the file.
+ * \return     The file, open for writing, or \c NULL.
+ */
+FILE *SMTH_cachecreate(Cache *c, char *path)
+{
+	FILE *output;
+	int fd;
+
+	snprintf(path, CACHE_MAX_PATH, "%s/" CACHE_TEMP_PREFIX "XXXXXX", c->dir);
+
+	fd = mkstemp(path);
+	if (fd < 0) return NULL;
+
+	output = fdopen(fd, "w");
+	if (!output)
+	{   close(fd);
+		unlink(path);
+	}
+
+	return output;
+}
+
+/**
+ * \brief Stores a chunk written to a file created by \c SMTH_cachecreate,
+ *        evicting the least recently used ones to make room.
+ *
+ * The file is renamed at once, so that readers see it whole, or not at all.
+ * It is removed on failure.
+ *
+ * \param c    The cache.
+ * \param path The name of the file, which must be closed.
+ * \param key  The key of the chunk.
+ * \param size The size of the chunk.
+ * \return     CACHE_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_cachecommit(Cache *c, const char *path, cachekey_t key,
+	length_t size)
+{
+	char name[CACHE_MAX_PATH];
+	error_t error = CACHE_SUCCESS;
+
+	if (!size || !lockcache(c))
+	{   unlink(path);
+		return CACHE_NO_FILE;
+	}
+
+	chunkname(c, key, name);
+
+	if (rename(path, name))
+	{   unlink(path);
+		error = CACHE_NO_FILE;
+	}
+	else if (!putentry(c, key, size, now()))
+	{   unlink(name);
+		error = CACHE_NO_MEMORY;
+	}
+	else
+	{   appendrecord(c, findentry(c, key));
+		evict(c, key);
+	}
+
+	if (c->records > CACHE_COMPACT_RATIO * c->entriesno + CACHE_MIN_SLOTS)
+		compactindex(c);
+
+	unlockcache(c);
+
+	return error;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Opens a cache directory, creating it if needed, and loads its index.
+ *
+ * \param dir    The directory.
+ * \param budget The bytes that may be stored, 0 = unlimited.
+ * \return       The cache, with a single reference, or \c NULL.
+ */
+static Cache *opencache(const char *dir, length_t budget)
+{
+	char path[CACHE_MAX_PATH];
+
+	/* room for the longest name of a file in the directory */
+	if (strlen(dir) + 32 > CACHE_MAX_PATH) return NULL;
+
+	Cache *c = calloc(1, sizeof (Cache));
+	if (!c) return NULL;
+
+	c->lockfd = c->indexfd = -1;
+	c->budget = budget;
+	c->refs = 1;
+	pthread_mutex_init(&c->lock, NULL);
+
+	c->dir = strdup(dir);
+	if (!c->dir || (mkdir(dir, 0755) && errno != EEXIST)) goto failed;
+
+	snprintf(path, CACHE_MAX_PATH, "%s/" CACHE_LOCK_FILE, dir);
+	c->lockfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (c->lockfd < 0) goto failed;
+
+	if (!lockcache(c)) goto failed;
+	cleantemp(c);
+	unlockcache(c);
+
+	return c;
+
+failed:
+	closecache(c);
+	return NULL;
+}
+
+/**
+ * \brief Closes a cache. What it stored is left for the next time.
+ *
+ * \param c The cache.
+ */
+static void closecache(Cache *c)
+{
+	if (c->indexfd >= 0) close(c->indexfd);
+	if (c->lockfd >= 0) close(c->lockfd);
+	pthread_mutex_destroy(&c->lock);
+	free(c->entries);
+	free(c->dir);
+	free(c);
+}
+
+/**
+ * \brief Takes a cache for the calling thread, against other threads and
+ *        processes, and loads what others stored meanwhile.
+ *
+ * \param c The cache.
+ * \return  \c true if the cache was taken, and must be released with
+ *          \c unlockcache, \c false otherwise.
+ */
+static bool lockcache(Cache *c)
+{
+	int result;
+
+	pthread_mutex_lock(&c->lock);
+
+	while ((result = flock(c->lockfd, LOCK_EX)) && errno == EINTR);
+
+	if (result || !syncindex(c))
+	{   if (!result) flock(c->lockfd, LOCK_UN);
+		pthread_mutex_unlock(&c->lock);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief Releases a cache taken with \c lockcache
+ *
+ * \param c The cache.
+ */
+static void unlockcache(Cache *c)
+{
+	flock(c->lockfd, LOCK_UN);
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * \brief Opens the index journal, creating it if needed, and forgets what was
+ *        loaded, so that it is loaded anew.
+ *
+ * A journal of another format is emptied.
+ *
+ * \param c The cache, locked.
+ * \return  \c true on success, \c false otherwise.
+ */
+static bool openindex(Cache *c)
+{
+	char path[CACHE_MAX_PATH], magic[CACHE_MAGIC_LENGTH];
+	struct stat st;
+
+	if (c->indexfd >= 0) close(c->indexfd);
+
+	snprintf(path, CACHE_MAX_PATH, "%s/" CACHE_INDEX_FILE, c->dir);
+	c->indexfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (c->indexfd < 0 || fstat(c->indexfd, &st)) return false;
+
+	if (pread(c->indexfd, magic, CACHE_MAGIC_LENGTH, 0) != CACHE_MAGIC_LENGTH ||
+		memcmp(magic, CACHE_INDEX_MAGIC, CACHE_MAGIC_LENGTH))
+	{   if (ftruncate(c->indexfd, 0) || write(c->indexfd, CACHE_INDEX_MAGIC,
+			CACHE_MAGIC_LENGTH) != CACHE_MAGIC_LENGTH) return false;
+	}
+
+	c->inode = st.st_ino;
+	c->synced = CACHE_MAGIC_LENGTH;
+	c->records = 0;
+	c->entriesno = 0;
+	c->bytes = 0;
+	if (c->entries) memset(c->entries, 0x00, c->slots * sizeof (CacheEntry));
+
+	return true;
+}
+
+/**
+ * \brief Loads the records appended to the index journal since the last time,
+ *        or the whole journal if it was replaced.
+ *
+ * \param c The cache, locked.
+ * \return  \c true on success, \c false otherwise.
+ */
+static bool syncindex(Cache *c)
+{
+	char path[CACHE_MAX_PATH];
+	struct stat st;
+	count_t i, recordsno;
+
+	snprintf(path, CACHE_MAX_PATH, "%s/" CACHE_INDEX_FILE, c->dir);
+
+	/* another process compacted the journal, or it is the first time */
+	if (c->indexfd < 0 || stat(path, &st) || st.st_ino != c->inode ||
+		st.st_size < c->synced)
+	{   if (!openindex(c) || fstat(c->indexfd, &st)) return false;
+	}
+
+	if (st.st_size == c->synced) return true;
+
+	length_t length = st.st_size - c->synced;
+	CacheEntry *records = malloc(length);
+	if (!records) return false;
+
+	ssize_t got = pread(c->indexfd, records, length, c->synced);
+	recordsno = got > 0? got / sizeof (CacheEntry): 0;
+
+	for (i = 0; i < recordsno; ++i)
+	{
+		CacheEntry *e = &records[i];
+		if (e->size) putentry(c, e->key, e->size, e->used);
+		else if ((e = findentry(c, e->key))) dropentry(c, e);
+	}
+	free(records);
+
+	c->synced += recordsno * sizeof (CacheEntry);
+	c->records += recordsno;
+
+	/* a record was torn by a crash: the journal is written anew */
+	if (c->synced < st.st_size) compactindex(c);
+
+	return true;
+}
+
+/**
+ * \brief Appends a record to the index journal.
+ *
+ * \param c The cache, locked.
+ * \param e The record.
+ */
+static void appendrecord(Cache *c, const CacheEntry *e)
+{
+	if (write(c->indexfd, e, sizeof (CacheEntry)) != sizeof (CacheEntry))
+		return; /* a torn record is noticed by the next sync */
+
+	c->synced += sizeof (CacheEntry);
+	c->records++;
+}
+
+/**
+ * \brief Writes the index journal anew, with one record per chunk stored,
+ *        and replaces the old one at once.
+ *
+ * \param c The cache, locked.
+ */
+static void compactindex(Cache *c)
+{
+	char path[CACHE_MAX_PATH], temp[CACHE_MAX_PATH];
+	length_t length = CACHE_MAGIC_LENGTH + c->entriesno * sizeof (CacheEntry);
+	struct stat st;
+	count_t i, j = 0;
+	int fd;
+
+	byte_t *buffer = malloc(length);
+	if (!buffer) return;
+
+	memcpy(buffer, CACHE_INDEX_MAGIC, CACHE_MAGIC_LENGTH);
+	CacheEntry *records = (CacheEntry*) &buffer[CACHE_MAGIC_LENGTH];
+	for (i = 0; i < c->slots; ++i)
+		if (c->entries[i].key) records[j++] = c->entries[i];
+
+	snprintf(path, CACHE_MAX_PATH, "%s/" CACHE_INDEX_FILE, c->dir);
+	snprintf(temp, CACHE_MAX_PATH, "%s/" CACHE_TEMP_PREFIX "XXXXXX", c->dir);
+
+	fd = mkstemp(temp);
+	if (fd >= 0 && write(fd, buffer, length) == (ssize_t) length &&
+		!fchmod(fd, 0644) && !rename(temp, path))
+	{
+		close(c->indexfd);
+		c->indexfd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+		if (c->indexfd >= 0 && !fstat(c->indexfd, &st)) c->inode = st.st_ino;
+		c->synced = length;
+		c->records = c->entriesno;
+	}
+	else if (fd >= 0) unlink(temp);
+
+	if (fd >= 0) close(fd);
+	free(buffer);
+}
+
+/**
+ * \brief Looks for a chunk in the table of a cache.
+ *
+ * \param c   The cache.
+ * \param key The key of the chunk.
+ * \return    Its entry, or \c NULL if it is not stored.
+ */
+static CacheEntry *findentry(Cache *c, cachekey_t key)
+{
+	count_t i, mask = c->slots - 1;
+
+	if (!c->slots) return NULL;
+
+	for (i = key & mask; c->entries[i].key; i = (i + 1) & mask)
+		if (c->entries[i].key == key) return &c->entries[i];
+
+	return NULL;
+}
+
+/**
+ * \brief Adds a chunk to the table of a cache, or updates it.
+ *
+ * \param c    The cache.
+ * \param key  The key of the chunk.
+ * \param size Its size.
+ * \param used When it was last used.
+ * \return     \c false if there was not memory enough, \c true otherwise.
+ */
+static bool putentry(Cache *c, cachekey_t key, uint64_t size, uint64_t used)
+{
+	count_t i, mask;
+	CacheEntry *e = findentry(c, key);
+
+	if (e)
+	{   c->bytes += size - e->size;
+		e->size = size;
+		e->used = used;
+		return true;
+	}
+
+	/* at most 3/4 full, so that probes stay short */
+	if (4 * (c->entriesno + 1) > 3 * c->slots && !growtable(c)) return false;
+
+	mask = c->slots - 1;
+	for (i = key & mask; c->entries[i].key; i = (i + 1) & mask);
+
+	c->entries[i].key = key;
+	c->entries[i].size = size;
+	c->entries[i].used = used;
+	c->entriesno++;
+	c->bytes += size;
+
+	return true;
+}
+
+/**
+ * \brief Removes a chunk from the table of a cache, moving back the chunks
+ *        probed after it, so that they may still be found.
+ *
+ * \param c The cache.
+ * \param e The entry of the chunk.
+ */
+static void dropentry(Cache *c, CacheEntry *e)
+{
+	count_t mask = c->slots - 1;
+	count_t hole = e - c->entries, i = hole;
+
+	c->bytes -= e->size;
+	c->entriesno--;
+
+	for (i = (i + 1) & mask; c->entries[i].key; i = (i + 1) & mask)
+	{
+		count_t home = c->entries[i].key & mask;
+
+		/* it stays if its home lies cyclically in (hole, i] */
+		if (hole <= i? (hole < home && home <= i): (hole < home || home <= i))
+			continue;
+
+		c->entries[hole] = c->entries[i];
+		hole = i;
+	}
+
+	c->entries[hole].key = 0;
+}
+
+/**
+ * \brief Doubles the slots of the table of a cache.
+ *
+ * \param c The cache.
+ * \return  \c false if there was not memory enough, \c true otherwise.
+ */
+static bool growtable(Cache *c)
+{
+	CacheEntry *old = c->entries;
+	count_t i, oldslots = c->slots;
+
+	count_t slots = oldslots? 2 * oldslots: CACHE_MIN_SLOTS;
+	CacheEntry *entries = calloc(slots, sizeof (CacheEntry));
+	if (!entries) return false;
+
+	c->entries = entries;
+	c->slots = slots;
+	c->entriesno = 0;
+	c->bytes = 0;
+
+	for (i = 0; i < oldslots; ++i)
+		if (old[i].key) putentry(c, old[i].key, old[i].size, old[i].used);
+
+	free(old);
+
+	return true;
+}
+
+/**
+ * \brief Removes the least recently used chunks, until the cache is within
+ *        its budget.
+ *
+ * \param c    The cache, locked.
+ * \param keep A chunk which must not be removed.
+ */
+static void evict(Cache *c, cachekey_t keep)
+{
+	char path[CACHE_MAX_PATH];
+	count_t i;
+
+	while (c->budget && c->bytes > c->budget)
+	{
+		CacheEntry *oldest = NULL;
+
+		for (i = 0; i < c->slots; ++i)
+		{   CacheEntry *e = &c->entries[i];
+			if (e->key && e->key != keep && (!oldest || e->used < oldest->used))
+				oldest = e;
+		}
+		if (!oldest) break;
+
+		CacheEntry gone = { oldest->key, 0, now() };
+		chunkname(c, oldest->key, path);
+		unlink(path); /* readers keep what they opened */
+		dropentry(c, oldest);
+		appendrecord(c, &gone);
+	}
+}
+
+/**
+ * \brief Builds the name of the file of a chunk.
+ *
+ * \param c    The cache.
+ * \param key  The key of the chunk.
+ * \param path A buffer at least \c CACHE_MAX_PATH bytes long.
+ */
+static void chunkname(Cache *c, cachekey_t key, char *path)
+{
+	snprintf(path, CACHE_MAX_PATH, "%s/%016" PRIx64, c->dir, key);
+}
+
+/**
+ * \brief Removes the files left half written by crashed processes.
+ *
+ * \param c The cache, locked.
+ */
+static void cleantemp(Cache *c)
+{
+	char path[CACHE_MAX_PATH];
+	struct dirent *file;
+	struct stat st;
+	time_t stale = time(NULL) - CACHE_STALE_TEMP;
+
+	DIR *dir = opendir(c->dir);
+	if (!dir) return;
+
+	while ((file = readdir(dir)))
+	{
+		if (strncmp(file->d_name, CACHE_TEMP_PREFIX,
+			strlen(CACHE_TEMP_PREFIX))) continue;
+
+		snprintf(path, CACHE_MAX_PATH, "%s/%s", c->dir, file->d_name);
+		if (!stat(path, &st) && st.st_mtime < stale) unlink(path);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * \brief Tells the time, comparable among processes.
+ *
+ * \return The \c CLOCK_REALTIME time, in us.
+ */
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-cache.h : persistent fragment cache (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_CACHE_H__
+#define __SMTH_CACHE_H__
+
+/**
+ * \internal
+ * \file   smth-cache.h
+ * \brief  Persistent fragment cache (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <smth-common-defs.h>
+
+/** Successful operation */
+#define CACHE_SUCCESS    ( 0)
+/** The cache directory could not be opened, nor created */
+#define CACHE_NO_DIR     (-50)
+/** A cache file could not be written */
+#define CACHE_NO_FILE    (-51)
+/** No memory left for the cache index */
+#define CACHE_NO_MEMORY  (-52)
+
+/** The longest path of a file in the cache directory */
+#define CACHE_MAX_PATH   1024
+
+/** Identifies a chunk in the cache, whatever process downloaded it */
+typedef uint64_t cachekey_t;
+
+/** \brief A chunk stored in the cache, as it is recorded in its index. */
+typedef struct
+{   /** Which chunk it is: 0 marks a free slot of \c Cache::entries */
+	cachekey_t key;
+	/** The size of its file, in bytes: 0 marks a removal in the index */
+	uint64_t size;
+	/** When it was last used, in \c CLOCK_REALTIME us */
+	uint64_t used;
+} CacheEntry;
+
+/** \brief A cache directory, shared by the fetchers of all handles and by
+ *         any other process using the same directory.
+ *
+ *  Each chunk is stored in a file named after its key, written under a
+ *  temporary name and renamed when complete. The index is a journal of
+ *  \c CacheEntry records, appended by every process under a lock on
+ *  \c CACHE_LOCK_FILE, and compacted now and then.
+ */
+typedef struct
+{
+	/** The cache directory */
+	char *dir;
+	/** The bytes that may be stored before evicting, 0 = unlimited */
+	length_t budget;
+	/** The bytes stored, as far as the index tells */
+	length_t bytes;
+	/** Serialises the processes using the directory */
+	int lockfd;
+	/** The index journal, opened for appending */
+	int indexfd;
+	/** The inode of \c indexfd: a compaction replaces the file */
+	ino_t inode;
+	/** The bytes of the index already loaded */
+	off_t synced;
+	/** The records appended to the index since it was compacted */
+	count_t records;
+	/** The chunks stored, as an open addressing table */
+	CacheEntry *entries;
+	/** The slots of \c entries, a power of 2 */
+	count_t slots;
+	/** The chunks in \c entries */
+	count_t entriesno;
+	/** The fetchers using the cache, plus one while it is the default */
+	count_t refs;
+	/** Serialises the threads using the cache */
+	pthread_mutex_t lock;
+} Cache;
+
+error_t SMTH_setcachedir(const char *dir);
+void SMTH_setcachebudget(length_t budget);
+Cache *SMTH_defaultcache(void);
+void SMTH_releasecache(Cache *c);
+cachekey_t SMTH_cachekey(const char *base, const char *pattern,
+	bitrate_t bitrate, tick_t time);
+FILE *SMTH_cachelookup(Cache *c, cachekey_t key);
+FILE *SMTH_cachecreate(Cache *c, char *path);
+error_t SMTH_cachecommit(Cache *c, const char *path, cachekey_t key,
+	length_t size);
+
+#endif /* __SMTH_CACHE_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -29,42 +29,190 @@
  * \date   11th July 2010
  */
 
+#include <pthread.h>
 #include <smth-fragment-parser.h>
 #include <smth-manifest-parser.h>
+#include <smth-http.h>
+#include <smth-poller.h>
+#include <smth-dynlist.h>
+#include <smth.h>
 
 /** Could not open a blocking file handle for the Manifest */
 #define SMTH_NO_FILE_HANDLE (-38)
 /** No more memory to allocate data */
 #define SMTH_NO_MEMORY      (-39)
+/** Could not start a read-ahead worker */
+#define SMTH_NO_WORKER      (-42)
 
 /** The maximum lenght admittable for a file name */
 #define SMTH_MAX_FILENAME_LENGHT 2048
 /** The string returned if a \c Stream has no name */
 #define SMTH_UNNAMED_STREAM      "(no name)"
 
+/** Default number of fragments read ahead of the cursor */
+#define SMTH_DEFAULT_READAHEAD_FRAGMENTS 4
+/** Default number of payload bytes read ahead of the cursor (0 = unlimited) */
+#define SMTH_DEFAULT_READAHEAD_BYTES     0
+
+/** \brief A parsed \c Fragment, shared between the library and its users.
+ *
+ *  The structure is reference counted, and it is disposed of when the last
+ *  reference is released.
+ */
+typedef struct
+{
+	/** The public view of the fragment. It MUST be the first field */
+	SMTH_fragment view;
+	/** The parsed fragment */
+	Fragment fragment;
+	/** Per-sample metadata, pointed by \c SMTH_fragment::samples */
+	SMTH_sample *samples;
+	/** Index of the fragment in \c Stream::chunks */
+	count_t chunk;
+	/** Number of references held. It must be accessed atomically. */
+	count_t refs;
+	/** Whether the payload is still being downloaded by the worker. It must
+	 *  be accessed atomically, and it is only cleared under the stream lock */
+	bool partial;
+	/** The payload bytes that may be read. While \c partial, it is protected
+	 *  by the stream lock. It is less than \c SMTH_fragment::size only if the
+	 *  download was cut short, and the missing tail was zeroed. */
+	length_t received;
+	/** The fragment kept in memory whose parsed data is borrowed, instead of
+	 *  being owned, or \c NULL. A reference to it is held. */
+	const SMTH_fragment *origin;
+	/** The key the fragment is kept in memory with, once it is complete, or 0
+	 *  if it is not to be kept \sa SMTH_memorystore */
+	cachekey_t key;
+} SharedFragment;
+
+/** \brief Holds the read status of a single \c Stream
+ *
+ *  Chunks are downloaded and parsed by a background worker, which keeps a
+ *  window of fragments ahead of the read cursor: \c SMTH_read just copies
+ *  from memory. Fields below \c lock are shared with the worker, while the
+ *  read cursor is protected by \c readlock. Streams share no state, so that
+ *  each one may be read by its own thread.
+ */
 typedef struct
 {
-	/** The active \c Fragment structure */
-	Fragment active;
-	/** Whether a new fragment needs to be parsed */
-	bool parsed;
-	/** Active \s Chunk index in \c Stream */
-	tick_t index;
-	/** Path to temporary dir. \c NULL terminated. */
-	char *cachedir;
+	/** The handle the stream belongs to */
+	struct Handle *owner;
+	/** The index of the stream in \c Handle::streams */
+	count_t number;
+
+	/** Serialises readers of the stream, protecting the fields below */
+	pthread_mutex_t readlock;
+	/** The fragment being read, or \c NULL */
+	SharedFragment *active;
 	/** Cursor position into the payload */
 	char* cursor;
 	/** Remaining payload bytes count */
 	size_t remaining;
+	/** Index of the next sample of \c active for \c SMTH_readsample */
+	count_t sample;
 	/** Whether the read is over */
 	bool EOS;
+
+	/** Downloads the chunks of the stream. Used by the worker only, or by the
+	 *  dispatcher for asynchronous handles. */
+	Fetcher fetcher;
+	/** The read-ahead worker */
+	pthread_t worker;
+	/** Whether \c StreamHandle::worker was started */
+	bool running;
+
+	/** Protects the fields below */
+	pthread_mutex_t lock;
+	/** Signaled when a fragment is queued, its payload grows or the worker
+	 *  is over */
+	pthread_cond_t filled;
+	/** Signaled when a fragment is dequeued or the window is changed */
+	pthread_cond_t drained;
+	/** The read-ahead queue, as a ring of \c queueslots pointers. For an
+	 *  asynchronous handle, the fragments delivered to the application and
+	 *  not yet acknowledged \sa SMTH_ackfragment */
+	SharedFragment **queue;
+	/** The number of allocated slots in \c queue */
+	count_t queueslots;
+	/** Position of the next fragment to be read in \c queue */
+	count_t queuefirst;
+	/** Number of queued fragments */
+	count_t queued;
+	/** Payload bytes of queued fragments */
+	length_t queuedbytes;
+	/** Media ticks of queued fragments, mirrored to the fetcher */
+	tick_t queuedticks;
+	/** Max number of queued fragments. 0 = unlimited */
+	count_t maxfragments;
+	/** Max number of queued payload bytes. 0 = unlimited */
+	length_t maxbytes;
+	/** Index of the next \c Chunk to be fetched */
+	count_t index;
+	/** Whether the worker will not queue anything else, until a seek */
+	bool over;
+	/** Whether the stream may still grow, being part of a live presentation:
+	 *  its reader then waits for the refresher when chunks are over */
+	bool live;
+	/** Whether the worker ran out of chunks, and waits for the refresher */
+	bool starved;
+	/** Chunks handed over by the refresher, to be appended to the \c Stream
+	 *  by its reader \sa SMTH_takechunks */
+	DynList fresh;
+	/** Incremented by each seek, to discard what was being fetched */
+	count_t seeks;
+	/** Whether the worker was asked to stop */
+	bool quit;
+	/** Whether the dispatcher stopped feeding an asynchronous stream, its
+	 *  window being full */
+	bool paused;
+	/** Set when a paused stream may be fed again, for the thread driving
+	 *  \c Handle::multi. It must be accessed atomically. */
+	bool resumed;
 } StreamHandle;
 
+/** \brief Keeps the timeline of a live presentation growing, refreshing its
+ *         Manifest from time to time.
+ *
+ *  The refresher of a synchronous handle is a thread, which hands the new
+ *  chunks over to the streams: their workers append them, as nobody else
+ *  reads \c Stream::chunks meanwhile. Asynchronous handles are refreshed by
+ *  the thread driving \c Handle::multi instead.
+ */
+typedef struct
+{
+	/** Makes refreshes incremental: the timeline known of each stream, and
+	 *  the validators of the last Manifest */
+	ManifestUpdate update;
+	/** The Manifest being downloaded, for an asynchronous handle */
+	Manifest manifest;
+	/** The delay between two refreshes, in ms */
+	long interval;
+	/** When the next refresh is due, on \c CLOCK_MONOTONIC */
+	struct timespec due;
+	/** Whether a refresh is due at \c due: it is not while one is running,
+	 *  and once the presentation is over */
+	bool scheduled;
+	/** The refresher thread of a synchronous handle */
+	pthread_t thread;
+	/** Whether \c Refresher::thread was started */
+	bool running;
+	/** Protects \c quit, and the schedule of the thread */
+	pthread_mutex_t lock;
+	/** Signaled to stop the thread */
+	pthread_cond_t wake;
+	/** Whether the thread was asked to stop */
+	bool quit;
+	/** Whether fragments announce those following them: the Manifest is then
+	 *  refreshed only to learn that the presentation is over */
+	bool lookahead;
+} Refresher;
+
 /** \brief Holds the pseudofile handle for a given stream
  *
  *  This is redeclared as an opaque \c pointer in the public header file.
  */
-typedef struct
+typedef struct Handle
 {
 	/** Manifest of the current Smooth Stream */
 	Manifest manifest;
@@ -76,9 +224,52 @@ typedef struct
 	char *url;
 	/** Transfer params (to regenerate manifest in a live stream) */
 	char *params;
+	/** Refreshes the Manifest of a live presentation */
+	Refresher refresher;
+
+	/** Whether the handle is fed by the dispatcher \sa SMTH_open_async */
+	bool async;
+	/** Whether the handle is driven by the caller's event loop instead
+	 *  \sa SMTH_open_external */
+	bool external;
+	/** The multi handle carrying the transfers of an asynchronous handle:
+	 *  the dispatcher's, or \c poller's for an external one. */
+	CURLM *multi;
+	/** Tracks the sockets of an external handle */
+	Poller poller;
+	/** Whether \c SMTH_process is running on an external handle */
+	bool processing;
+	/** The callbacks of an asynchronous handle */
+	SMTH_callbacks callbacks;
+	/** Opaque data passed to \c callbacks */
+	void *userdata;
+	/** The download slot of the Manifest of an asynchronous handle */
+	Transfer manifestload;
+	/** Whether the handle is being closed: no more callbacks may be issued.
+	 *  Used by the thread driving \c multi only. */
+	bool closing;
+	/** Whether \c SMTH_close left the disposal to the thread driving
+	 *  \c multi */
+	bool orphan;
+	/** Set by the dispatcher when it is done with the handle */
+	bool withdrawn;
+	/** The next handle in the queue of handles to be started */
+	struct Handle *nextin;
+	/** The next handle in the queue of handles to be dropped */
+	struct Handle *nextout;
+	/** The next handle started by the dispatcher */
+	struct Handle *nextstarted;
 
 } Handle;
 
+error_t SMTH_openstreams(Handle *handle, const char *url, const char *params,
+	CURLM *multi);
+error_t SMTH_loadfragment(Fetcher *f, count_t index, bool progressive,
+	SharedFragment **out);
+bool SMTH_holdfragment(StreamHandle *s, SharedFragment *f);
+bool SMTH_pausestream(StreamHandle *s);
+void SMTH_disposehandle(Handle *handle);
+
 #endif /* __SMTH_DEFS_H__ */
 
 /* vim: set ts=4 sw=4 tw=0: */
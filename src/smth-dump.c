@@ -171,6 +171,7 @@ void SMTH_dumpmanifest(Manifest *m, FILE *output)
 void SMTH_dumpfragment(Fragment *vc, FILE *output)
 {
 	int i;
+	count_t j;
 
 	fprintf(output, "\n%sDATA SUMMARY%s\n\n", shortbar, shortbar);
 	fprintf(output, "Fragment no.%d [%d bytes of data]\n", vc->index, vc->size);
@@ -178,6 +179,11 @@ void SMTH_dumpfragment(Fragment *vc, FILE *output)
 	fprintf(output, " +-duration: %llu\n", vc->duration);
 	fprintf(output, " +-first settings: 0x%08lx\n", vc->settings);
 
+	for (j = 0; j < vc->lookaheadno; j++)
+		fprintf(output, " +-next fragment: %llu [%llu ticks]\n",
+			(unsigned long long) vc->lookahead[j].time,
+			(unsigned long long) vc->lookahead[j].duration);
+
 	if (vc->armor.type != NONE)
 	{	fprintf(output, " +-armor\n");
 		fprintf(output, " | +-type: %d\n", vc->armor.type);
@@ -30,6 +30,11 @@
 #include <smth-manifest-parser.h>
 #include <smth-http.h>
 #include <smth-defs.h>
+#include <smth-async.h>
+#include <smth-live.h>
+#include <smth-poller.h>
+#include <smth-cache.h>
+#include <smth-snapshot.h>
 
 /**
  * \brief Prints a readable error message for each error code.
@@ -164,6 +169,19 @@ error_t SMTH_error(error_t code, FILE *output)
 			fputs("An appropriate url for chunk retrieval was not "
 				"specified.\n", output);
 			break;
+		case FETCHER_NO_CHUNK:
+			fputs("The requested chunk does not exist in the stream.\n", output);
+			break;
+		case FETCHER_INTERRUPTED:
+			fputs("The fetcher was interrupted while waiting.\n", output);
+			break;
+		case FETCHER_PENDING:
+			fputs("The chunk is still being downloaded.\n", output);
+			break;
+		case FETCHER_NOT_MODIFIED:
+			fputs("The manifest did not change since it was last "
+				"downloaded.\n", output);
+			break;
 		case SMTH_NO_FILE_HANDLE:
 			fputs("Could not open a blocking file handle for the Manifest.\n",
 				output);
@@ -171,6 +189,49 @@ error_t SMTH_error(error_t code, FILE *output)
 		case SMTH_NO_MEMORY:
 			fputs("No more memory to allocate data.\n", output);
 			break;
+		case SMTH_NO_WORKER:
+			fputs("Could not start a read-ahead worker.\n", output);
+			break;
+		case LIVE_NO_REFRESHER:
+			fputs("Could not start the refresher of a live stream.\n", output);
+			break;
+		case CACHE_NO_DIR:
+			fputs("Could not open the cache directory.\n", output);
+			break;
+		case CACHE_NO_FILE:
+			fputs("Could not write a file in the cache directory.\n", output);
+			break;
+		case CACHE_NO_MEMORY:
+			fputs("No more memory for the cache index.\n", output);
+			break;
+		case SNAPSHOT_NO_MEMORY:
+			fputs("No more memory to build a Manifest image.\n", output);
+			break;
+		case SNAPSHOT_IO_ERROR:
+			fputs("Could not write or map a Manifest image.\n", output);
+			break;
+		case SNAPSHOT_BAD_IMAGE:
+			fputs("A Manifest image is malformed, was written by another "
+				"build, or belongs to another url.\n", output);
+			break;
+		case SNAPSHOT_IS_LIVE:
+			fputs("The Manifest of a live presentation has no image.\n",
+				output);
+			break;
+		case ASYNC_NO_DISPATCHER:
+			fputs("Could not start the dispatcher of asynchronous handles.\n",
+				output);
+			break;
+		case POLLER_NO_MULTI:
+			fputs("Could not create the connections of an external handle.\n",
+				output);
+			break;
+		case POLLER_NO_EPOLL:
+			fputs("Could not create an epoll instance.\n", output);
+			break;
+		case POLLER_NO_WAIT:
+			fputs("Could not wait for the transfers sockets.\n", output);
+			break;
 		default:
 			fputs("Unknown error code.\n", output);
 			break;
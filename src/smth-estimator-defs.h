@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-estimator-defs.h : network throughput estimator (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_ESTIMATOR_DEFS_H__
+#define __SMTH_ESTIMATOR_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-estimator-defs.h
+ * \brief  Network throughput estimator (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-estimator.h>
+
+/** A sample lasting this long halves the weight of the past in the fast
+ *  average, in s */
+#define ESTIMATOR_FAST_HALFLIFE 2.
+/** A sample lasting this long halves the weight of the past in the slow
+ *  average, in s */
+#define ESTIMATOR_SLOW_HALFLIFE 8.
+/** Transfers shorter than this are too noisy to be sampled, in s */
+#define ESTIMATOR_MIN_DURATION  0.001
+/** Transfers smaller than this mostly measure latency, and are not sampled */
+#define ESTIMATOR_MIN_BYTES     16384
+
+static void updateload(Estimator *e, const struct timespec *now);
+static void addsample(Estimator *e, double throughput, double duration);
+static double elapsed(const struct timespec *from, const struct timespec *to);
+
+#endif /* __SMTH_ESTIMATOR_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
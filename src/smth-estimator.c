@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-estimator.c : network throughput estimator
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-estimator.c
+ * \brief  Network throughput estimator.
+ * \author Stefano Sanfilippo
+ */
+
+#include <string.h>
+
+#include <smth-estimator-defs.h>
+
+/**
+ * \brief   Prepares an \c Estimator with no samples.
+ * \param e The estimator to be initialised.
+ */
+void SMTH_initestimator(Estimator *e)
+{
+	memset(e, 0x00, sizeof (Estimator));
+	e->fastbias = e->slowbias = 1.;
+	clock_gettime(CLOCK_MONOTONIC, &e->updated);
+}
+
+/**
+ * \brief   Starts measuring a transfer.
+ *
+ * Each call must be matched by a call to \c SMTH_endmeasure.
+ *
+ * \param e The estimator.
+ * \param m The measure of the transfer.
+ */
+void SMTH_startmeasure(Estimator *e, Measure *m)
+{
+	clock_gettime(CLOCK_MONOTONIC, &m->start);
+	updateload(e, &m->start);
+	e->active++;
+	m->load = e->load;
+}
+
+/**
+ * \brief       Stops measuring a transfer, and samples its throughput.
+ *
+ * \param e     The estimator.
+ * \param m     The measure of the transfer.
+ * \param bytes The bytes received by the transfer, or \c 0 if it was aborted
+ *              and must not be sampled. Small transfers are not sampled
+ *              either \sa ESTIMATOR_MIN_BYTES
+ */
+void SMTH_endmeasure(Estimator *e, Measure *m, length_t bytes)
+{
+	struct timespec now;
+	double duration, overlap;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	updateload(e, &now);
+	e->active--;
+
+	duration = elapsed(&m->start, &now);
+	if (bytes < ESTIMATOR_MIN_BYTES || duration < ESTIMATOR_MIN_DURATION) return;
+
+	/* how many transfers were sharing the link, on average */
+	overlap = (e->load - m->load) / duration;
+	if (overlap < 1.) overlap = 1.;
+
+	addsample(e, 8. * bytes * overlap / duration, duration);
+}
+
+/**
+ * \brief   Estimates the throughput with the moving averages.
+ *
+ * The lower of the two averages is taken: the fast one reacts at once to a
+ * drop, while the slow one keeps a single lucky transfer from raising the
+ * estimate.
+ *
+ * \param e The estimator.
+ * \return  The estimated throughput in bit/s, or \c 0 if nothing was sampled.
+ */
+bitrate_t SMTH_ewmaestimate(const Estimator *e)
+{
+	double fast, slow;
+
+	if (!e->samplesno) return 0;
+
+	fast = e->fast / (1. - e->fastbias);
+	slow = e->slow / (1. - e->slowbias);
+
+	return (bitrate_t) (fast < slow? fast: slow);
+}
+
+/**
+ * \brief            Estimates the throughput as a percentile of the last
+ *                   \c ESTIMATOR_WINDOW samples.
+ *
+ * \param e          The estimator.
+ * \param percentile The percentile, from 0 (the lowest sample) to 100 (the
+ *                   highest one).
+ * \return           The estimated throughput in bit/s, or \c 0 if nothing was
+ *                   sampled.
+ */
+bitrate_t SMTH_percentileestimate(const Estimator *e, count_t percentile)
+{
+	double sorted[ESTIMATOR_WINDOW];
+	count_t i, j;
+
+	if (!e->samplesno) return 0;
+	if (percentile > 100) percentile = 100;
+
+	/* a tiny insertion sort */
+	for (i = 0; i < e->samplesno; ++i)
+	{
+		double sample = e->window[i];
+		for (j = i; j > 0 && sorted[j-1] > sample; --j) sorted[j] = sorted[j-1];
+		sorted[j] = sample;
+	}
+
+	return (bitrate_t) sorted[percentile * (e->samplesno - 1) / 100];
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief     Accounts for the time elapsed since the last update in
+ *            \c Estimator::load
+ *
+ * \param e   The estimator.
+ * \param now The current time.
+ */
+static void updateload(Estimator *e, const struct timespec *now)
+{
+	e->load += e->active * elapsed(&e->updated, now);
+	e->updated = *now;
+}
+
+/**
+ * \brief            Feeds a sample to the moving averages and to the window.
+ *
+ * The longer the sample, the more it weighs against the past.
+ *
+ * \param e          The estimator.
+ * \param throughput The sampled throughput, in bit/s
+ * \param duration   The time the sample took, in s
+ */
+static void addsample(Estimator *e, double throughput, double duration)
+{
+	double fastweight = ESTIMATOR_FAST_HALFLIFE /
+		(ESTIMATOR_FAST_HALFLIFE + duration);
+	double slowweight = ESTIMATOR_SLOW_HALFLIFE /
+		(ESTIMATOR_SLOW_HALFLIFE + duration);
+
+	e->fast = fastweight * e->fast + (1. - fastweight) * throughput;
+	e->fastbias *= fastweight;
+	e->slow = slowweight * e->slow + (1. - slowweight) * throughput;
+	e->slowbias *= slowweight;
+
+	e->window[e->next] = throughput;
+	e->next = (e->next + 1) % ESTIMATOR_WINDOW;
+	if (e->samplesno < ESTIMATOR_WINDOW) e->samplesno++;
+}
+
+/**
+ * \brief      Tells the seconds elapsed between two times.
+ *
+ * \param from The earlier time.
+ * \param to   The later time.
+ * \return     The elapsed seconds.
+ */
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-estimator.h : network throughput estimator (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_ESTIMATOR_H__
+#define __SMTH_ESTIMATOR_H__
+
+/**
+ * \internal
+ * \file   smth-estimator.h
+ * \brief  Network throughput estimator (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <time.h>
+#include <smth-common-defs.h>
+
+/** The number of throughput samples kept for percentile estimates */
+#define ESTIMATOR_WINDOW 20
+
+/** \brief Tracks a single transfer on behalf of an \c Estimator */
+typedef struct
+{
+	/** When the transfer started, on \c CLOCK_MONOTONIC */
+	struct timespec start;
+	/** \c Estimator::load when the transfer started */
+	double load;
+} Measure;
+
+/** \brief Estimates the throughput of the network from finished transfers.
+ *
+ *  Each transfer yields a sample, its bytes over its time, scaled by the
+ *  average number of transfers that were running at the same time: as they
+ *  shared the link, the link carried that many times what the transfer got.
+ *  Samples feed two exponentially weighted moving averages (a fast and a
+ *  slow one, the lower of which is taken) and a sliding window, from which
+ *  percentiles are taken.
+ *
+ *  An estimator is not thread safe: it belongs to whoever drives transfers.
+ */
+typedef struct
+{
+	/** The number of transfers being measured */
+	count_t active;
+	/** The time integral of \c active, in seconds */
+	double load;
+	/** When \c load was last updated */
+	struct timespec updated;
+	/** Fast moving average of the throughput, in bit/s */
+	double fast;
+	/** Slow moving average of the throughput, in bit/s */
+	double slow;
+	/** The share of \c fast still due to its zero start, to be compensated */
+	double fastbias;
+	/** The share of \c slow still due to its zero start, to be compensated */
+	double slowbias;
+	/** The last samples, in bit/s, as a ring */
+	double window[ESTIMATOR_WINDOW];
+	/** The number of samples in \c window */
+	count_t samplesno;
+	/** The slot of \c window for the next sample */
+	count_t next;
+} Estimator;
+
+void SMTH_initestimator(Estimator *e);
+void SMTH_startmeasure(Estimator *e, Measure *m);
+void SMTH_endmeasure(Estimator *e, Measure *m, length_t bytes);
+bitrate_t SMTH_ewmaestimate(const Estimator *e);
+bitrate_t SMTH_percentileestimate(const Estimator *e, count_t percentile);
+
+#endif /* __SMTH_ESTIMATOR_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -52,7 +52,11 @@ typedef struct
 	signedlength_t tsize; /**< size of the incoming block (total) */
 	DynList	extlist;      /**< Extension dynamic list */
 	BoxType type;	      /**< type of the incoming block	*/
-	FILE *stream;         /**< input stream */
+	const byte_t *buffer; /**< the bytes of the fragment */
+	length_t size;        /**< length of buffer */
+	length_t offset;      /**< the first byte of buffer not parsed yet */
+	byte_t *map;          /**< buffer, if it is a mapped file the payload may
+	                           be left in, or NULL */
 	Fragment *f;          /**< Fragment to be filled with extracted data. */ 
 } Box;
 
@@ -143,7 +147,18 @@ static const word_t BoxTypeID[] = { 0x6d6f6f66, /**< "moof" */
 static const word_t EncryptionTypeID[] = { 0x00000100,  /**< AES 128-bit CTR */
                		                       0x00000200}; /**< AES 128-bit CBC */
 
+/** The longest run of bytes allowed before the payload of a fragment */
+#define FRAGMENT_MAX_HEAD (1 << 20)
+/** The size of the (short) header of a Box */
+#define FRAGMENT_BOX_HEADER 8
+/** The first allocation made to read a fragment from a stream of unknown
+ *  size */
+#define FRAGMENT_READ_CHUNK (64 << 10)
+
+static error_t parseroot(Box *root);
 static error_t  parsebox(Box* root);
+static error_t parsehead(FragmentParser *p, length_t headsize);
+static bool headisready(FragmentParser *p, length_t *headsize);
 static error_t parsemoof(Box* root);
 static error_t parsemdat(Box* root);
 static error_t parsemfhd(Box* root);
@@ -158,6 +173,8 @@ static error_t parsetfrf(Box* root);
 static error_t  scanuuid(Box* root, signedlength_t boxsize);
 static bool isencrbox(Box* root);
 static bool readbox(void *dest, size_t size, Box* root);
+static bool skipbox(size_t size, Box* root);
+static byte_t *readstream(FILE *stream, length_t *size);
 
 /**
  * \brief If there are less than 8 bytes remaining in the Box, skips 4B:
@@ -170,7 +187,7 @@ static bool readbox(void *dest, size_t size, Box* root);
  */
 #define XXX_SKIP_4B_QUIRK \
 	if (boxsize < 9) \
-	{   fseek(root->stream, sizeof(word_t), SEEK_CUR); \
+	{   if (!skipbox(sizeof(word_t), root)) return FRAGMENT_IO_ERROR; \
 		boxsize -= sizeof(word_t); \
 	}
 
@@ -28,11 +28,16 @@
 #include <stdio.h>
 #include <endian.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <smth-fragment-defs.h>
 
 /**
  * \brief        Parses a fragment opened as FILE and fills all the 
  *               details in a Fragment structure.
+ *
+ * The stream is read whole, and then parsed as \c SMTH_parsefragment_mem does.
+ *
  * \param stream pointer to the stream from which to read the fragment.
  * \param f      pointer to the Fragment structure to be filled with data
  *               extracted from the stream.
@@ -40,55 +45,102 @@
  *               code.
  */
 error_t SMTH_parsefragment(Fragment *f, FILE *stream)
-{   Box root;
-	root.stream = stream;
-	root.f = f;
+{
+	length_t size;
 	error_t result;
 
 	memset(f, 0x00, sizeof (Fragment)); /* reset memory */
-	SMTH_preparelist(&root.extlist);
 
-//FIXME should work with `while`, but it does not... add multi box support...
-//	while (!feof(root.stream))
-	int i; for ( i = 0; i < 2; i++)
-	{   
-		result = parsebox(&root); //TODO aggiungere END_OF_FILE??
-		if (result == FRAGMENT_SUCCESS)
-		{
-			switch (root.type)
-			{	case MOOF: result = parsemoof(&root); break;
-				case MDAT: result = parsemdat(&root); break;
-				default: result = FRAGMENT_INAPPROPRIATE; break;
-			}
-			if (result != FRAGMENT_SUCCESS) break;
-		}
-		else break;
-	}
+	byte_t *buffer = readstream(stream, &size);
+	if (!buffer) return ferror(stream)? FRAGMENT_IO_ERROR: FRAGMENT_NO_MEMORY;
 
-	if (result != FRAGMENT_SUCCESS) 
-	{   SMTH_disposefragment(root.f);
-		return result;
-	}
+	result = SMTH_parsefragment_mem(f, buffer, size);
+	free(buffer);
 
-	/* if it is not EOF */
-	if (feof(stream))
-	{   SMTH_disposefragment(root.f);
-		return FRAGMENT_BIGGER_THAN_DECLARED;
-	}
+	return result;
+}
 
-	if (!SMTH_finalizelist(&root.extlist))
-	{   SMTH_disposefragment(root.f);
-		return FRAGMENT_NO_MEMORY;
-	}
+/**
+ * \brief        Parses a fragment held in memory and fills all the details in
+ *               a Fragment structure.
+ *
+ * Every field is read straight from the buffer, checking that it lies inside.
+ * The payload is copied: the buffer may be released as soon as the call
+ * returns.
+ *
+ * \param f      pointer to the Fragment structure to be filled with data
+ *               extracted from the buffer.
+ * \param buffer the bytes of the whole fragment.
+ * \param size   the length of \c buffer.
+ * \return       FRAGMENT_SUCCESS on successful parse, or an appropriate error
+ *               code.
+ */
+error_t SMTH_parsefragment_mem(Fragment *f, const byte_t *buffer,
+	length_t size)
+{   Box root;
+	root.buffer = buffer;
+	root.size = size;
+	root.offset = 0;
+	root.map = NULL;
+	root.f = f;
 
-	root.f->extensions = (Extension **) root.extlist.list;
+	memset(f, 0x00, sizeof (Fragment)); /* reset memory */
 
-	return FRAGMENT_SUCCESS;
+	return parseroot(&root);
+}
+
+/**
+ * \brief        Parses a fragment stored in a file, like
+ *               \c SMTH_parsefragment, mapping the file to memory instead of
+ *               reading it.
+ *
+ * The payload is not copied: \c Fragment::data points into the mapping, which
+ * is released by \c SMTH_disposefragment, and the stream may be closed as soon
+ * as the call returns. Streams which can't be mapped, such as pipes or empty
+ * files, are read as usual.
+ *
+ * \param stream pointer to the stream from which to read the fragment, at its
+ *               beginning.
+ * \param f      pointer to the Fragment structure to be filled with data
+ *               extracted from the stream.
+ * \return       FRAGMENT_SUCCESS on successful parse, or an appropriate error
+ *               code.
+ */
+error_t SMTH_mapfragment(Fragment *f, FILE *stream)
+{   Box root;
+	struct stat info;
+	void *map;
+
+	int fd = fileno(stream);
+	if (fd < 0 || fstat(fd, &info) || !S_ISREG(info.st_mode) || !info.st_size)
+		return SMTH_parsefragment(f, stream);
+
+	/* private and writable, so that the payload may be changed like an
+	 * allocated one */
+	map = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return SMTH_parsefragment(f, stream);
+
+	/* the metadata is read at once, and the payload just after */
+	madvise(map, info.st_size, MADV_SEQUENTIAL);
+	madvise(map, info.st_size, MADV_WILLNEED);
+
+	root.buffer = map;
+	root.size = info.st_size;
+	root.offset = 0;
+	root.map = map;
+	root.f = f;
+
+	memset(f, 0x00, sizeof (Fragment)); /* reset memory */
+	f->mapping = map; /* from now on, it goes with the fragment */
+	f->mappingsize = info.st_size;
+
+	return parseroot(&root);
 }
 
 /**
  * \brief    Disposes properly of a Fragment. These days, it only calls
- *           \c free() on the dinamically allocated fields, but programmers
+ *           \c free() on the dinamically allocated fields (and unmaps the
+ *           payload of a mapped fragment), but programmers
  *           are advised to use it instead of freeing memory by themselves,
  *           as the internal data structure may vary heavily in the future.
  * \param f  The fragment  to be destroyed.
@@ -105,19 +157,180 @@ void SMTH_disposefragment(Fragment *f)
 		}
 	}
 
-	if (f->data) free(f->data);
+	if (f->mapping) munmap(f->mapping, f->mappingsize);
+	else if (f->data) free(f->data);
 	if (f->samples) free(f->samples);
 	if (f->extensions) free(f->extensions);
 	if (f->armor.vectors) free(f->armor.vectors);
+	if (f->lookahead) free(f->lookahead);
 	/* destroy even the reference */
 	f->data = NULL;
+	f->mapping = NULL;
 	f->samples = NULL;
 	f->extensions = NULL;
 	f->armor.vectors = NULL;
+	f->lookahead = NULL;
+	f->lookaheadno = 0;
+}
+
+/**
+ * \brief   Prepares a \c FragmentParser to receive a new fragment.
+ * \param p The parser to be initialised.
+ */
+void SMTH_initparser(FragmentParser *p)
+{
+	memset(p, 0x00, sizeof (FragmentParser));
+	p->state = PARSER_HEAD;
+}
+
+/**
+ * \brief      Feeds the parser with the next bytes of a fragment.
+ *
+ * The bytes preceding the payload are buffered, until the whole MoofBox and
+ * the header of the MdatBox arrived: then the metadata is parsed at once with
+ * the usual Box parsers, \c Fragment::data is allocated and the parser moves
+ * to \c PARSER_PAYLOAD. Payload bytes are copied in place as they come, and
+ * anything beyond the declared MdatBox size is ignored.
+ *
+ * \param p    The parser to be fed.
+ * \param data The new bytes.
+ * \param size The number of bytes in \c data.
+ * \return     FRAGMENT_SUCCESS if the bytes were accepted, or the error which
+ *             made the parser fail (now or before).
+ */
+error_t SMTH_feedparser(FragmentParser *p, const byte_t *data, length_t size)
+{
+	length_t headsize;
+
+	if (p->state == PARSER_HEAD)
+	{
+		if (p->headsize + size > p->headslots)
+		{   length_t slots = p->headslots? p->headslots: FRAGMENT_BOX_HEADER;
+			while (slots < p->headsize + size) slots *= 2;
+			byte_t *tmp = realloc(p->head, slots);
+			if (!tmp)
+			{   p->error = FRAGMENT_NO_MEMORY;
+				p->state = PARSER_FAILED;
+				return p->error;
+			}
+			p->head = tmp;
+			p->headslots = slots;
+		}
+		memcpy(p->head + p->headsize, data, size);
+		p->headsize += size;
+
+		if (!headisready(p, &headsize))
+		{   if (p->headsize > FRAGMENT_MAX_HEAD)
+			{   p->error = FRAGMENT_OUT_OF_BOUNDS;
+				p->state = PARSER_FAILED;
+			}
+			return p->error;
+		}
+
+		p->error = parsehead(p, headsize);
+		if (p->error != FRAGMENT_SUCCESS)
+		{   p->state = PARSER_FAILED;
+			return p->error;
+		}
+		/* what followed the MdatBox header is already payload */
+		data = p->head + headsize;
+		size = p->headsize - headsize;
+		p->state = PARSER_PAYLOAD;
+	}
+
+	if (p->state == PARSER_PAYLOAD)
+	{
+		if (size > p->fragment.size - p->received)
+			size = p->fragment.size - p->received;
+		memcpy(p->fragment.data + p->received, data, size);
+		p->received += size;
+		if (p->received == p->fragment.size)
+		{   p->state = PARSER_DONE;
+			free(p->head);
+			p->head = NULL;
+		}
+	}
+
+	return p->error;
+}
+
+/**
+ * \brief     Hands the fragment being parsed over to the caller, who becomes
+ *            responsible of disposing of it.
+ *
+ * The parser must have reached \c PARSER_PAYLOAD: it goes on writing the
+ * payload into the adopted fragment, hence it must be kept alive (and fed)
+ * as long as the adopter expects more bytes.
+ *
+ * \param p   The parser.
+ * \param out The fragment to be filled with the parsed metadata.
+ */
+void SMTH_adoptfragment(FragmentParser *p, Fragment *out)
+{
+	*out = p->fragment;
+	p->adopted = true;
+}
+
+/**
+ * \brief   Disposes of a \c FragmentParser, and of its fragment unless it was
+ *          adopted.
+ * \param p The parser to be destroyed.
+ */
+void SMTH_disposeparser(FragmentParser *p)
+{
+	if (!p->adopted) SMTH_disposefragment(&p->fragment);
+	free(p->head);
+	p->head = NULL;
+	p->state = PARSER_FAILED;
 }
 
 /*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
 
+/**
+ * \brief      Parses the Boxes of a whole fragment, from a buffer set up by
+ *             \c SMTH_parsefragment_mem or \c SMTH_mapfragment.
+ * \param root The root Box, with the buffer and the cleared Fragment.
+ * \return     FRAGMENT_SUCCESS on successful parse, or an appropriate error
+ *             code.
+ */
+static error_t parseroot(Box *root)
+{
+	error_t result;
+
+	SMTH_preparelist(&root->extlist);
+
+//FIXME should work with `while`, but it does not... add multi box support...
+//	while (root->offset < root->size)
+	int i; for ( i = 0; i < 2; i++)
+	{   
+		result = parsebox(root); //TODO aggiungere END_OF_FILE??
+		if (result == FRAGMENT_SUCCESS)
+		{
+			switch (root->type)
+			{	case MOOF: result = parsemoof(root); break;
+				case MDAT: result = parsemdat(root); break;
+				default: result = FRAGMENT_INAPPROPRIATE; break;
+			}
+			if (result != FRAGMENT_SUCCESS) break;
+		}
+		else break;
+	}
+
+	if (result != FRAGMENT_SUCCESS) 
+	{   SMTH_disposefragment(root->f);
+		return result;
+	}
+
+	if (!SMTH_finalizelist(&root->extlist))
+	{   SMTH_disposefragment(root->f);
+		return FRAGMENT_NO_MEMORY;
+	}
+
+	root->f->extensions = (Extension **) root->extlist.list;
+
+	return FRAGMENT_SUCCESS;
+}
+
 /**
  * \brief        Sets target reading an appropriate number of bytes from stream.
  *
@@ -139,17 +352,76 @@ void SMTH_disposefragment(Fragment *f)
 	else target = 0;
 
 /**
- * \brief      Read size bytes from root->stream, and stores them into dest.
+ * \brief      Read size bytes from root->buffer, and stores them into dest.
  * \param dest Pointer to the destination buffer. Note that readbox will not
  *             check for buffer overflow.
- * \param size Number of bytes to read from the input stream
- * \param root Pointer to a box structure holding the stream pointer.
- * \return     true if no error was encountered, otherwise false
+ * \param size Number of bytes to read from the input buffer
+ * \param root Pointer to a box structure holding the buffer.
+ * \return     true if the bytes were inside the buffer, otherwise false
  */
 static bool readbox(void *dest, size_t size, Box* root)
 {
-	return !((fread(dest, sizeof (byte_t), size, root->stream) < (size*sizeof (byte_t))) &&
-	   (feof(root->stream) || ferror(root->stream)));
+	if (size > root->size - root->offset) return false;
+	memcpy(dest, root->buffer + root->offset, size);
+	root->offset += size;
+	return true;
+}
+
+/**
+ * \brief      Skips size bytes of root->buffer.
+ * \param size Number of bytes to skip
+ * \param root Pointer to a box structure holding the buffer.
+ * \return     true if the bytes were inside the buffer, otherwise false
+ */
+static bool skipbox(size_t size, Box* root)
+{
+	if (size > root->size - root->offset) return false;
+	root->offset += size;
+	return true;
+}
+
+/**
+ * \brief        Reads a stream whole into memory.
+ * \param stream The stream, read from where it is to its end.
+ * \param size   Set to the number of bytes read.
+ * \return       The bytes read, to be freed, or NULL on failure.
+ */
+static byte_t *readstream(FILE *stream, length_t *size)
+{
+	struct stat info;
+	length_t slots = FRAGMENT_READ_CHUNK, used = 0;
+	long offset = ftell(stream);
+
+	/* a file tells its size, and is read with a single call */
+	int fd = fileno(stream);
+	if (fd >= 0 && !fstat(fd, &info) && S_ISREG(info.st_mode) &&
+		offset >= 0 && info.st_size > offset)
+		slots = info.st_size - offset + 1;
+
+	byte_t *buffer = malloc(slots);
+	if (!buffer) return NULL;
+
+	while (true)
+	{
+		used += fread(buffer + used, sizeof (byte_t), slots - used, stream);
+		if (used < slots) break;
+
+		byte_t *tmp = realloc(buffer, 2 * slots);
+		if (!tmp)
+		{   free(buffer);
+			return NULL;
+		}
+		buffer = tmp;
+		slots *= 2;
+	}
+
+	if (ferror(stream))
+	{   free(buffer);
+		return NULL;
+	}
+
+	*size = used;
+	return buffer;
 }
 
 /**
@@ -188,10 +460,10 @@ static error_t scanuuid(Box* root, signedlength_t boxsize)
 }
 
 /**
- * \brief  prepares the first Box found on \c box->stream for parsing.
+ * \brief  prepares the first Box found on \c box->buffer for parsing.
  *
  * parsebox will fill box structure with the size and the type of the incoming
- * block and position the input stream to the first byte of box data.
+ * block and move the cursor to the first byte of box data.
  * A parsing function would receive its size and type with the box structure,
  * then it may call parsebox to identify children Boxes and so on.
  * Obviously, it cannot be called by the parsing function itself, as the caller
@@ -364,8 +636,8 @@ static error_t parsetfhd(Box* root)
 	GET_IF_FLAG_SET(singleword, TFHD_SAMPLE_DESCRIPTION_INDEX_PRESENT);
 	root->f->defaults.index = (count_t) be32toh(singleword);
 
-	GET_IF_FLAG_SET(doubleword, TFHD_DEFAULT_SAMPLE_DURATION_PRESENT);
-	root->f->defaults.duration = (tick_t) be64toh(doubleword);
+	GET_IF_FLAG_SET(singleword, TFHD_DEFAULT_SAMPLE_DURATION_PRESENT);
+	root->f->defaults.duration = (tick_t) be32toh(singleword);
 
 	GET_IF_FLAG_SET(singleword, TFHD_DEFAULT_SAMPLE_SIZE_PRESENT);
 	root->f->defaults.size = (bitrate_t) be32toh(singleword);
@@ -418,6 +690,8 @@ static error_t parsetrun(Box* root)
 		count_t i;
 		tmp = calloc(root->f->sampleno, sizeof (Sample));
 		if(!tmp) return FRAGMENT_NO_MEMORY;
+		/* from now on, it goes with the fragment, even if the box is cut */
+		root->f->samples = tmp;
 		for( i = 0; i < root->f->sampleno; i++)
 		{
 			GET_IF_FLAG_SET(singleword, TRUN_SAMPLE_DURATION_PRESENT);
@@ -429,16 +703,9 @@ static error_t parsetrun(Box* root)
 			GET_IF_FLAG_SET(singleword, TRUN_SAMPLE_COMPOSITION_TIME_OFFSET_PRESENT);
 			tmp[i].timeoffset = (bitrate_t) be32toh(singleword);
 		}
-		root->f->samples = tmp;
 	}
 
-	error_t result = scanuuid(root, boxsize);
-	if(result != FRAGMENT_SUCCESS)
-	{   free(tmp);
-		return result;
-	}
-
-	return FRAGMENT_SUCCESS;
+	return scanuuid(root, boxsize);
 }
 
 /**
@@ -454,7 +721,8 @@ static error_t parsetrun(Box* root)
 static error_t parsesdtp(Box* root)
 {
 	/* 4B flags = 0 + 1B * samplesno (simpleflags) */
-	fseek(root->stream, root->bsize, SEEK_CUR);
+	if (root->bsize < 0 || !skipbox(root->bsize, root))
+		return FRAGMENT_IO_ERROR;
 	return FRAGMENT_SUCCESS;
 }
 
@@ -475,12 +743,22 @@ static error_t parsesdtp(Box* root)
  */
 static error_t parsemdat(Box* root)
 {
-	byte_t *tmp = malloc(root->bsize);
-	if (!tmp) return FRAGMENT_NO_MEMORY;
-	if (!readbox(tmp, root->bsize, root))
-	{   free(tmp);
+	length_t offset = root->offset;
+
+	if (root->bsize < 0 || !skipbox(root->bsize, root))
 		return FRAGMENT_IO_ERROR;
+
+	if (root->map)
+	{   /* the payload is left where it is */
+		root->f->data = root->map + offset;
+		root->f->size = root->bsize;
+		return FRAGMENT_SUCCESS;
 	}
+
+	/* malloc(0) may well return NULL */
+	byte_t *tmp = malloc(root->bsize? root->bsize: 1);
+	if (!tmp) return FRAGMENT_NO_MEMORY;
+	memcpy(tmp, root->buffer + offset, root->bsize);
 	root->f->data = tmp;
 	root->f->size = root->bsize;
 	return FRAGMENT_SUCCESS;
@@ -527,6 +805,65 @@ static error_t parsetfxd(Box* root)
 									 * a child uuid box... */
 }
 
+/**
+ * \brief  TfrfBox (lookahead fragments) parser
+ *
+ * This field is found into a MoofBox of a live presentation, and announces
+ * the timestamp and duration of the fragments following this one, so that
+ * they may be requested before the Manifest is refreshed. It assumes that the
+ * signature has already been stripped by a call to parseuuid.
+ *
+ * \param root pointer to the Box structure to be parsed
+ * \return     FRAGMENT_SUCCESS on successful parse, or an appropriate error code.
+ */
+static error_t parsetfrf(Box* root)
+{
+	flags_t boxflags;
+	uint8_t count;
+	count_t i;
+	signedlength_t boxsize = root->bsize;
+
+	if (!getflags(&boxflags, root)) return FRAGMENT_IO_ERROR;
+	if (!readbox(&count, sizeof (count), root)) return FRAGMENT_IO_ERROR;
+	boxsize -= sizeof (boxflags) + sizeof (count);
+
+	Lookahead *tmp = calloc(count? count: 1, sizeof (Lookahead));
+	if (!tmp) return FRAGMENT_NO_MEMORY;
+
+	for (i = 0; i < count; ++i)
+	{
+		if (boxflags & TFRF_LONG_FIELDS_MASK)
+		{   tick_t time, duration;
+			if (!readbox(&time, sizeof (tick_t), root) ||
+				!readbox(&duration, sizeof (tick_t), root))
+			{   free(tmp);
+				return FRAGMENT_IO_ERROR;
+			}
+			tmp[i].time = (tick_t) be64toh(time);
+			tmp[i].duration = (tick_t) be64toh(duration);
+			boxsize -= 2*sizeof (tick_t);
+		}
+		else
+		{   flags_t time, duration;
+			if (!readbox(&time, sizeof (flags_t), root) ||
+				!readbox(&duration, sizeof (flags_t), root))
+			{   free(tmp);
+				return FRAGMENT_IO_ERROR;
+			}
+			tmp[i].time = (tick_t) be32toh(time);
+			tmp[i].duration = (tick_t) be32toh(duration);
+			boxsize -= 2*sizeof (flags_t);
+		}
+	}
+
+	/* a fragment carries a single TfrfBox: a later one wins */
+	free(root->f->lookahead);
+	root->f->lookahead = tmp;
+	root->f->lookaheadno = count;
+
+	return scanuuid(root, boxsize);
+}
+
 /**
  * \brief SampleEncryptionBox (content protection metadata) parser
  *
@@ -617,7 +954,7 @@ static error_t parseuuid(Box* root)
 	/* If it is a TfxdBox */
 	if (!memcmp(uuid, tfxduuid, sizeof (uuid_t))) return parsetfxd(root);
 	/* If it is a TfrfBox */
-//	if (!memcmp(uuid, tfrfuuid, sizeof (uuid_t))) return parsetfrf(root); FIXME
+	if (!memcmp(uuid, tfrfuuid, sizeof (uuid_t))) return parsetfrf(root);
 	/* If it is an ordinary UUIDBox   */
 	Extension *tmp = malloc(sizeof (Extension));
 	if (!tmp) return FRAGMENT_NO_MEMORY;
@@ -628,8 +965,8 @@ static error_t parseuuid(Box* root)
 		return FRAGMENT_IO_ERROR;
 	}
 	/* Data body */
-	byte_t *tmpdata = malloc(tmp->size);
-	if (!readbox(tmpdata, tmp->size, root))
+	byte_t *tmpdata = malloc(tmp->size? tmp->size: 1);
+	if (!tmpdata || !readbox(tmpdata, tmp->size, root))
 	{   free(tmp);
 		free(tmpdata);
 		return FRAGMENT_IO_ERROR;
@@ -647,4 +984,105 @@ static error_t parseuuid(Box* root)
 	return FRAGMENT_SUCCESS;
 }
 
+/**
+ * \brief          Tells whether the bytes buffered by the parser reach the
+ *                 beginning of the payload.
+ * \param p        The parser.
+ * \param headsize Set to the number of bytes preceding the payload.
+ * \return         true if the metadata may be parsed, false if more bytes are
+ *                 needed. A malformed Box size yields true, so that the
+ *                 Box parsers report the error.
+ */
+static bool headisready(FragmentParser *p, length_t *headsize)
+{
+	length_t offset = 0, boxsize, header;
+	shortlength_t shortsize;
+	word_t name;
+
+	while (p->headsize >= offset + FRAGMENT_BOX_HEADER)
+	{
+		memcpy(&shortsize, p->head + offset, sizeof (shortsize));
+		memcpy(&name, p->head + offset + sizeof (shortsize), sizeof (name));
+		header = FRAGMENT_BOX_HEADER;
+		boxsize = be32toh(shortsize);
+		if (boxsize == BOX_IS_HUGE)
+		{   header += sizeof (boxsize);
+			if (p->headsize < offset + header) return false;
+			memcpy(&boxsize, p->head + offset + FRAGMENT_BOX_HEADER,
+				sizeof (boxsize));
+			boxsize = be64toh(boxsize);
+		}
+		if (be32toh(name) == BoxTypeID[MDAT])
+		{   *headsize = offset + header;
+			return true;
+		}
+		if (boxsize < header || boxsize > FRAGMENT_MAX_HEAD)
+		{   *headsize = p->headsize;
+			return true;
+		}
+		/* the next Box header has not arrived yet */
+		if (boxsize > p->headsize - offset) return false;
+		offset += boxsize;
+	}
+
+	return false;
+}
+
+/**
+ * \brief          Parses the metadata buffered by a \c FragmentParser and
+ *                 allocates room for the payload.
+ * \param p        The parser.
+ * \param headsize The number of bytes preceding the payload.
+ * \return         FRAGMENT_SUCCESS on successful parse, or an appropriate
+ *                 error code.
+ */
+static error_t parsehead(FragmentParser *p, length_t headsize)
+{
+	Box root;
+	error_t result = FRAGMENT_SUCCESS;
+	bool mdat = false;
+
+	root.buffer = p->head;
+	root.size = headsize;
+	root.offset = 0;
+	root.map = NULL;
+	root.f = &p->fragment;
+
+	memset(root.f, 0x00, sizeof (Fragment));
+	SMTH_preparelist(&root.extlist);
+
+	while (!mdat && result == FRAGMENT_SUCCESS)
+	{
+		result = parsebox(&root);
+		if (result != FRAGMENT_SUCCESS) break;
+		switch (root.type)
+		{	case MOOF: result = parsemoof(&root); break;
+			case MDAT: mdat = true; break;
+			default: result = FRAGMENT_INAPPROPRIATE; break;
+		}
+	}
+
+	if (result == FRAGMENT_SUCCESS &&
+		(root.bsize < 0 || root.offset != headsize))
+		result = FRAGMENT_OUT_OF_BOUNDS;
+
+	if (result == FRAGMENT_SUCCESS)
+	{   /* malloc(0) may well return NULL */
+		root.f->data = malloc(root.bsize? root.bsize: 1);
+		if (!root.f->data || !SMTH_finalizelist(&root.extlist))
+			result = FRAGMENT_NO_MEMORY;
+	}
+
+	if (result != FRAGMENT_SUCCESS)
+	{   SMTH_disposelist(&root.extlist);
+		SMTH_disposefragment(root.f);
+		return result;
+	}
+
+	root.f->extensions = (Extension **) root.extlist.list;
+	root.f->size = root.bsize;
+
+	return FRAGMENT_SUCCESS;
+}
+
 /* vim: set ts=4 sw=4 tw=0: */
@@ -139,6 +139,16 @@ typedef struct
 	bitrate_t timeoffset;
 } Sample;
 
+/** \brief A fragment announced by the TfrfBox of a live fragment. */
+typedef struct
+{   /** The absolute timestamp of the announced fragment, in time scale
+	 *  increments for the track. */
+	tick_t time;
+	/** The duration of the announced fragment, in time scale increments for
+	 *  the track. */
+	tick_t duration;
+} Lookahead;
+
 /** \brief Will hold the parsed fragment data */
 typedef struct
 {   /** \brief An ordinal number for the Fragment in the Track timeline.
@@ -161,6 +171,11 @@ typedef struct
 	/** The total duration of all samples in the fragment, in time scale
 	 *  increments for the track. */
 	tick_t duration;
+	/** The fragments following this one in a live presentation, as announced
+	 *  by a TfrfBox, in order. Filled from the FragmentCount entries. */
+	Lookahead *lookahead;
+	/** The number of entries in \c lookahead */
+	count_t lookaheadno;
 	/** The encryption data for ciphered streams */
 	Encryption armor;
 	/** The default metadata for samples in the stream */
@@ -175,6 +190,11 @@ typedef struct
 	 *  by the values of the DefaultSampleSize and SampleSize fields
 	 *  in the TrunBox. */
 	byte_t *data;
+	/** The file mapped to memory \c data points into, or \c NULL if \c data
+	 *  was allocated \sa SMTH_mapfragment */
+	void *mapping;
+	/** The length of \c mapping */
+	length_t mappingsize;
 
         length_t data_offset;
 } Fragment;
@@ -198,6 +218,39 @@ typedef struct
 /** There are trailing bytes after a MdatBox that will not be parsed */
 #define FRAGMENT_BIGGER_THAN_DECLARED (-8)
 
+/** \brief The stage reached by a \c FragmentParser */
+typedef enum { PARSER_HEAD,    /**< waiting for the MoofBox to be complete */
+               PARSER_PAYLOAD, /**< metadata parsed, MdatBox arriving      */
+               PARSER_DONE,    /**< the whole fragment arrived             */
+               PARSER_FAILED   /**< the fragment is broken: see \c error   */
+             } ParserState;
+
+/** \brief Parses a fragment progressively, as its bytes arrive.
+ *
+ *  Only the bytes preceding the payload are buffered: the MdatBox body is
+ *  written straight into \c Fragment::data, allocated at once from its
+ *  declared size, so that samples may be used as soon as they arrive.
+ */
+typedef struct
+{   /** Where the parser is at */
+	ParserState state;
+	/** The fragment: metadata is valid from \c PARSER_PAYLOAD on, while the
+	 *  first \c received bytes of \c Fragment::data are. */
+	Fragment fragment;
+	/** The number of payload bytes arrived */
+	length_t received;
+	/** The bytes preceding the payload, until they are parsed */
+	byte_t *head;
+	/** The number of bytes in \c head */
+	length_t headsize;
+	/** The number of bytes allocated for \c head */
+	length_t headslots;
+	/** Whether \c fragment was taken over by \c SMTH_adoptfragment */
+	bool adopted;
+	/** Why the parser failed */
+	error_t error;
+} FragmentParser;
+
 /** Sample priority (first 2 bytes)	*/
 #define	SAMPLE_PRIORITY(S)		 ((unit_t)((S)&0xffff))
 /** Sample difference flag (bit 17)	*/
@@ -232,7 +285,14 @@ static inline void fillsampleflags(SampleSettings *s, flags_t settings)
 #endif
 
 error_t SMTH_parsefragment(Fragment *f, FILE *stream);
+error_t SMTH_parsefragment_mem(Fragment *f, const byte_t *buffer,
+	length_t size);
+error_t SMTH_mapfragment(Fragment *f, FILE *stream);
 void SMTH_disposefragment(Fragment *f);
+void SMTH_initparser(FragmentParser *p);
+error_t SMTH_feedparser(FragmentParser *p, const byte_t *data, length_t size);
+void SMTH_adoptfragment(FragmentParser *p, Fragment *out);
+void SMTH_disposeparser(FragmentParser *p);
 
 #endif /* __SMTH_FRAGMENT_PARSER__ */
 
@@ -29,68 +29,102 @@
  * \date   13th June 2010
  */
 
+#include <pthread.h>
 #include <curl/multi.h>
 #include <smth-http.h>
 #include <smth-manifest-parser.h>
+#include <smth-snapshot.h>
 
 /** The user agent string used by the fecther */
 #define FETCHER_USERAGENT             "libsmth/0"
 /** The template for the temp directory, one per \c Track */
 #define FETCHER_DIRECTOTY_TEMPLATE    "/tmp/smth.XXXXXX"
-/** The template directory for a manifest file. */
-#define FETCHER_MANIFEST_TEMPLATE     "/tmp/smth-manifest.XXXXXX"
 
-/** The number of simultaneous transfers allowed per \c Fetcher::handle */
-#define FETCHER_MAX_TRANSFERS         2L
 /** The maximum length for a filename */
 #define FETCHER_MAX_FILENAME_LENGTH   1024
+/** The longest \c ETag kept for conditional requests */
+#define FETCHER_MAX_ETAG_LENGTH       256
+/** The header of a conditional request, to be filled with the \c ETag */
+#define FETCHER_IF_NONE_MATCH         "If-None-Match: %s"
+/** Keys the image of a Manifest in the cache, along with its url */
+#define FETCHER_SNAPSHOT_PATTERN      "Manifest"
 /** The maximum length for a chunk url */
 #define FETCHER_MAX_URL_LENGTH        2048
-/** The maximum length of a replace format specifier */
-#define FETCHER_REPLACE_FORMAT_LENGTH 8
-/** The maximum ratio between bitrate and download speed */
-#define FETCHER_MAX_OVERHEAD_RATIO    1.5
-
-/** The placeholder for \c Chunk::time */
-#define FETCHER_START_TIME_PLACEHOLDER "{start time}"
-/** The placeholder for \c Track::bitrate */
-#define FETCHER_BITRATE_PLACEHOLDER    "{bitrate}"
+/** The initial size of \c Fetcher::urlbuffer */
+#define FETCHER_URL_BUFFER_SIZE       256
+/** The longest time a fetcher waits for its sockets at once, in ms */
+#define FETCHER_MAX_WAIT              1000L
+/** The wait before the first retry of a failed download, in ms */
+#define FETCHER_RETRY_DELAY           250L
+/** The longest wait before retrying a failed download, in ms */
+#define FETCHER_MAX_RETRY_DELAY       4000L
+/** The failed attempts after which a lower bitrate is tried, if nothing
+ *  of the chunk was stored yet */
+#define FETCHER_FALLBACK_ATTEMPTS     2
+/** How many times a chunk announced by a TfrfBox is asked again, every
+ *  \c FETCHER_RETRY_DELAY, before it is considered failed */
+#define FETCHER_ANNOUNCED_WAITS       40
+/** Weight of the last download in \c Fetcher::latency */
+#define FETCHER_LATENCY_WEIGHT        0.25
+/** Above this \c Fetcher::latency, adaptive fetchers add a transfer */
+#define FETCHER_LATENCY_BOUND         0.5
+/** Below this \c Fetcher::latency, adaptive fetchers drop a transfer */
+#define FETCHER_BANDWIDTH_BOUND       0.2
+/** The percentile of the throughput samples passed to strategies as
+ *  \c SMTH_abrstate::safethroughput */
+#define FETCHER_SAFE_PERCENTILE       20
+/** The ticks per second of \c Chunk times, unless otherwise known */
+#define FETCHER_DEFAULT_TIMESCALE     10000000
  
-/** \brief Holds the Curl multi handle and fetcher metadata. */
-typedef struct
-{
-	/** Handle to the active curl multi downloader. */
-	CURLM *handle;
-	/** Handle to the active \c Stream */
-	Stream *stream;
-	/** Maximal stream bitrate. 0 = unlimited */
-	bitrate_t maxbitrate;
-	/** Pointer to the next \c Chunk to handle */
-	Chunk *nextchunk;
-	/** Index of the last parsed \c Chunk */
-	count_t chunk_no;
-	/** Model from which to build the retrieve url */
-	url_t *urlmodel;
-	/** The local path to the cache directory */
-	chardata *cachedir;
-	/** The time the last download took */
-	bitrate_t downloadtime;
-
-} Fetcher;
+static void initcurl(void);
+static void sharetransport(CURL *handle);
+static void locktransport(CURL *handle, curl_lock_data data,
+	curl_lock_access access, void *userp);
+static void unlocktransport(CURL *handle, curl_lock_data data, void *userp);
 
-static error_t initfetcher(Fetcher *f);
-static error_t disposefetcher(Fetcher *f);
-static error_t resetfetcher(Fetcher *f);
 static error_t execfetcher(Fetcher *f);
-static error_t reinithandle(Fetcher *f);
+static error_t fillfetcher(Fetcher *f);
+static void adapttransfers(Fetcher *f, CURL *handle);
+static error_t reinithandle(Fetcher *f, Transfer *t);
+static error_t starttransfer(Fetcher *f, Transfer *t);
+static void failtransfer(Transfer *t, CURLcode result);
+static bool isdue(const struct timespec *when, long *delay);
+
+static Transfer *findtransfer(Fetcher *f, count_t index);
+static error_t waitchunk(Fetcher *f, count_t index, signedlength_t seen);
+static signedlength_t chunkprogress(Transfer *t);
+static void freetransfer(Fetcher *f, Transfer *t);
+static void chunkpath(Fetcher *f, count_t index, char *buffer);
+static error_t makecachedir(Fetcher *f);
+static size_t storechunk(char *data, size_t size, size_t nmemb, void *userp);
 
 static FILE *unembed(Stream *s);
+static CURL *manifesthandle(const char *url, const char *params,
+	ManifestParser *parser, ManifestUpdate *update);
+static size_t storemanifest(char *data, size_t size, size_t nmemb, void *userp);
+static size_t storevalidator(char *data, size_t size, size_t nmemb,
+	void *userp);
+static int cancelmanifest(void *userp, curl_off_t dltotal, curl_off_t dlnow,
+	curl_off_t ultotal, curl_off_t ulnow);
+static void keepresponse(CURL *handle, ManifestUpdate *update);
+static error_t takeresponse(ManifestParser *parser, ManifestUpdate *update);
+static void findsnapshot(const char *url, ManifestUpdate *update);
+static error_t takesnapshot(Manifest *m, ManifestUpdate *update,
+	error_t error);
+static void storesnapshot(Manifest *m, ManifestUpdate *update);
+static void dropsnapshot(ManifestUpdate *update);
 
 static bitrate_t getbitrate(Fetcher *f);
+static bitrate_t lowerbitrate(Fetcher *f, bitrate_t bitrate);
+
+static url_t *compileurl(Fetcher *f, Transfer *t);
+static bool appendurl(Fetcher *f, length_t *length, const char *text,
+	length_t size);
 
-static char *compileurl(Fetcher *f, char *buffer);
-static char *replace(char *buffer, size_t size, const char *source,
-	char *search, const char *format, void *replace);
+static cachekey_t chunkkey(Fetcher *f, Transfer *t);
+static bool readcopy(Fetcher *f, Transfer *t);
+static void keepcopy(Transfer *t);
+static void dropcopy(Transfer *t);
 
 #endif /* __SMTH_HTTP_DEFS__ */
 
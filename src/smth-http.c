@@ -26,13 +26,26 @@
  * \date   12th June 2010 ~ 7-11th Dicember 2010
  */
 
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 
 #include <smth-http-defs.h>
 
+/** Guards the initialisation of libcurl, which is not thread safe. */
+static pthread_once_t curlonce = PTHREAD_ONCE_INIT;
+/** The outcome of \c curl_global_init */
+static CURLcode curlstatus;
+/** Connections, DNS and TLS sessions shared by every transfer of the process,
+ *  or \c NULL if they could not be shared */
+static CURLSH *transport;
+/** Guard each kind of data in \c transport */
+static pthread_mutex_t transportlocks[CURL_LOCK_DATA_LAST];
+
 /**
  * \brief Fetch all the fragments referred by a \c Manifest::Stream field.
  *
@@ -50,385 +63,1863 @@
 char* SMTH_fetch(const char *url, Stream *stream, bitrate_t maxbitrate)
 {
 	Fetcher f;
-	int queue, running_no = -1;
-	error_t error;
-	CURLMsg *msg;
+	count_t i;
+	chardata *cachedir;
 
 	if (!stream) return NULL;
 
 	if (stream->isembedded) return unembed(stream);
 
-	if (!url) return NULL;
+	if (SMTH_initfetcher(&f, url, stream, maxbitrate, NULL)) return NULL;
 
-	f.maxbitrate = maxbitrate;
-	f.stream = stream;
-	f.urlmodel = malloc(snprintf(NULL, 0, "%s/%s", url, stream->url));
-	sprintf(f.urlmodel, "%s/%s", url, stream->url);
-
-	error = initfetcher(&f);
-	if (error) return NULL; //error;
+	/* the chunks are the very output */
+	SMTH_setspill(&f, true);
+	if (makecachedir(&f))
+	{   SMTH_disposefetcher(&f);
+		return NULL;
+	}
 
-	while (running_no)
+	for (i = 0; stream->chunks[i]; ++i)
 	{
-		/* Submit all transfers... */
-		while (CURLM_CALL_MULTI_PERFORM == curl_multi_perform(f.handle, &running_no));
-
-		if (running_no)
-		{   error = resetfetcher(&f);
-			if (error) goto end;
-		}
-
-		while ((msg = curl_multi_info_read(f.handle, &queue)))
-		{
-			if (msg->msg == CURLMSG_DONE)
-			{
-				FILE *file;
-				double time = 0.;
-
-				curl_easy_getinfo(msg->easy_handle, CURLINFO_SPEED_DOWNLOAD, &time);
-				f.downloadtime = (bitrate_t)(sizeof (byte_t) * time);
-				curl_easy_getinfo(msg->easy_handle, CURLOPT_PRIVATE, &file);
-/*				fclose(file); //XXX*/
-
-				curl_multi_remove_handle(f.handle, msg->easy_handle);
-				curl_easy_cleanup(msg->easy_handle);
-
-				reinithandle(&f);
-			}
-			else
-			{   error = FETCHER_TRANFER_FAILED;
-				goto end;
-			}
-		}
+		if (SMTH_fetchchunk(&f, i)) break;
+		/* leave the file where it is, just give the slot back */
+		findtransfer(&f, i)->state = TRANSFER_FREE;
 	}
 
-	error = FETCHER_SUCCESS; /* assigned only if everything went fine. */
+	cachedir = f.cachedir;
+	if (stream->chunks[i]) cachedir = NULL; /* something went wrong */
+	else f.cachedir = NULL; /* so that it will survive the fetcher */
 
-end:
-	disposefetcher(&f);
-	if (error) return NULL;
+	SMTH_disposefetcher(&f);
 
-	return f.cachedir;
+	return cachedir;
 }
 
 /**
- * \brief Fetches the manifest from a given url
+ * \brief Fetches the manifest from a given url, parsing it as it arrives.
+ *
+ * The Manifest is requested compressed, if the server is willing to: it is
+ * inflated and parsed piece by piece, while it is downloaded. If there is a
+ * cache directory, the first request of an on-demand Manifest is conditional
+ * on the image kept there, which is mapped instead of parsing the response.
  *
  * \param url    The url from which retrieve a manifest
  * \param params Any param necessary to invoke the url.
- * \return       A pointer to the manifest stream, or NULL
+ * \param m      The manifest to be filled. It is zeroed on failure.
+ * \param update Makes the download incremental, and keeps the validators
+ *               of the Manifest for the next one, or \c NULL
+ * \return       FETCHER_SUCCESS, FETCHER_NOT_MODIFIED if \c update is
+ *               current, or an appropriate (fetcher or manifest) error code.
  */
-FILE* SMTH_fetchmanifest(const char *url, const char *params)
+error_t SMTH_fetchmanifest(const char *url, const char *params, Manifest *m,
+	ManifestUpdate *update)
 {
 	CURL *handle;
-	CURLcode error;
-	char filename[] = FETCHER_MANIFEST_TEMPLATE;
-	char manifesturl[FETCHER_MAX_URL_LENGTH];
+	ManifestParser parser;
+	error_t error;
 
-	snprintf(manifesturl, FETCHER_MAX_FILENAME_LENGTH,  "%s/Manifest%c%s",
-		url, (params? '?': 0), params);
+	memset(m, 0x00, sizeof (Manifest));
+
+	if (!SMTH_startcurl()) return FECTHER_FAILED_INIT;
 
-	/* Open a temporary file */
-	FILE *output = tmpfile();
+	error = SMTH_initmanifestparser(&parser, m,
+		update? update->known: NULL, update? update->knownno: 0);
+	if (error) return error;
 
 	/* Build downloader */
-	if (!(handle = curl_easy_init())) return NULL;
+	if (!(handle = manifesthandle(url, params, &parser, update)))
+	{   SMTH_disposemanifestparser(&parser);
+		return FECTHER_NO_MEMORY;
+	}
 
-	/* Set the url from which to retrieve the chunk */
-	curl_easy_setopt(handle, CURLOPT_URL, manifesturl);
-	/* Write to the provided file handler */
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, output);
-	/* Use the default write function */
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
-	/* Some servers don't like requests without a user-agent field... */
-	curl_easy_setopt(handle, CURLOPT_USERAGENT, FETCHER_USERAGENT);
-	/* No headers written, only body. */
-	curl_easy_setopt(handle, CURLOPT_HEADER, 0L);
-	/* No verbose messages. */
-	curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
-	/* with old versions of libcurl: no progress meter */
-	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+	CURLcode result = curl_easy_perform(handle);
 
-	if (curl_easy_perform(handle))
-	{
-		curl_easy_cleanup(handle);
-		close(output);
-		return NULL;
+	if (result == CURLE_ABORTED_BY_CALLBACK && !parser.error)
+		error = FETCHER_INTERRUPTED;
+	else if (result)
+		error = parser.error? parser.error: FETCHER_TRANFER_FAILED;
+	else
+	{   if (update) keepresponse(handle, update);
+		error = takeresponse(&parser, update);
 	}
 
 	curl_easy_cleanup(handle);
+	SMTH_disposemanifestparser(&parser);
 
-	/* Rewind the output stream */
-	rewind(output);
-	return output;
+	return takesnapshot(m, update, error);
 }
 
-/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
-
-/** The number of opened handles. */
-static count_t handles = 0;
+/**
+ * \brief Disposes of what a \c ManifestUpdate holds.
+ *
+ * \param update The update to be disposed of. It may be disposed of twice.
+ */
+void SMTH_disposeupdate(ManifestUpdate *update)
+{
+	free(update->known);
+	free(update->etag);
+	free(update->newetag);
+	curl_slist_free_all(update->headers);
+	dropsnapshot(update);
+
+	update->known = NULL;
+	update->knownno = 0;
+	update->etag = update->newetag = NULL;
+	update->headers = NULL;
+}
 
 /**
  * \brief Properly initialises a \c Fetcher before use.
  *
- * \param f Pointer to the fetcher structure to be initialised.
- * \param m Pointer to the \c Stream from which to compile the Fetcher.
- * \return  FETCHER_SUCCESS or an appropriate error code.
+ * No transfer is started until the first call to \c SMTH_fetchchunk.
+ *
+ * \param f          Pointer to the fetcher structure to be initialised.
+ * \param url        The url from which to retrieve the chunks.
+ * \param stream     Pointer to the \c Stream from which to compile the Fetcher.
+ * \param maxbitrate Maximal stream bitrate. 0 = unlimited
+ * \return           FETCHER_SUCCESS or an appropriate error code.
  */
-static error_t initfetcher(Fetcher *f)
+error_t SMTH_initfetcher(Fetcher *f, const char *url, Stream *stream,
+	bitrate_t maxbitrate, CURLM *multi)
 {
 	count_t i;
 
-	f->chunk_no = 0; /* essential */
+	memset(f, 0x00, sizeof (Fetcher)); /* essential */
+
+	if (!url || !stream || !stream->url) return FECTHER_NO_URL;
+
+	f->maxbitrate = maxbitrate;
+	f->stream = stream;
 
-	if (!handles && curl_global_init(CURL_GLOBAL_ALL))
-		return FECTHER_FAILED_INIT; /* do it only once. */
+	f->baselength = strlen(url) + 1;
+	f->baseurl = malloc(f->baselength + 1); /* including a \0 sigil */
+	if (!f->baseurl) return FECTHER_NO_MEMORY;
+	sprintf(f->baseurl, "%s/", url);
 
-	f->handle = curl_multi_init();
-	if (!f->handle) return FECTHER_NO_MEMORY;
+	if (!SMTH_startcurl())
+	{   free(f->baseurl);
+		return FECTHER_FAILED_INIT;
+	}
+
+	f->ownhandle = !multi;
+	if (f->ownhandle && SMTH_initpoller(&f->poller, true))
+	{   free(f->baseurl);
+		return FECTHER_NO_MEMORY;
+	}
+	f->handle = multi? multi: f->poller.multi;
 
 	/* limit the total amount of connections this multi handle uses */
-	curl_multi_setopt(f->handle, CURLMOPT_MAXCONNECTS, FETCHER_MAX_TRANSFERS);
+	if (f->ownhandle)
+		curl_multi_setopt(f->handle, CURLMOPT_MAXCONNECTS, FETCHER_MAX_TRANSFERS);
 
-	/* Create a new temp dir */
-	char* template = strdup(FETCHER_DIRECTOTY_TEMPLATE);
-	f->cachedir = mkdtemp(template);
+	f->maxtransfers = FETCHER_DEFAULT_TRANSFERS;
+	f->transfersno = FETCHER_DEFAULT_TRANSFERS;
+	f->latency = (FETCHER_LATENCY_BOUND + FETCHER_BANDWIDTH_BOUND) / 2;
+	SMTH_initestimator(&f->estimator);
 
-	/* Build the fetcher */
 	for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
-	{	error_t error = reinithandle(f);
-		if (error) return error;
+	{   f->transfers[i].state = TRANSFER_FREE;
+		f->transfers[i].fetcher = f;
+	}
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Blocks until the \c Chunk with the given index has been downloaded.
+ *
+ * Transfers for the following chunks are kept running in the background, so
+ * that sequential calls will usually find their chunk already downloaded.
+ * If the requested chunk was not scheduled, the fetcher restarts from there.
+ * The wait may be cut short from another thread with \c SMTH_interruptfetcher.
+ * The fetcher must own its multi handle.
+ *
+ * \param f     The fetcher to be used.
+ * \param index The index of the \c Chunk in \c Stream::chunks, at most
+ *              the index of its \c NULL sigil.
+ * \return      FETCHER_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_fetchchunk(Fetcher *f, count_t index)
+{
+	if (!f->ownhandle) return FETCHER_NO_MULTIPLEX;
+
+	return waitchunk(f, index, INT64_MAX);
+}
+
+/**
+ * \brief Blocks until the \c Chunk with the given index has been downloaded,
+ *        or its parser got further than \c seen.
+ *
+ * It works like \c SMTH_fetchchunk, but it returns as soon as the chunk
+ * makes some progress: its metadata was parsed, if \c seen is negative, or
+ * more than \c seen payload bytes arrived. The payload is then available
+ * through \c SMTH_chunkparser. Spilled chunks only progress when complete.
+ *
+ * \param f     The fetcher to be used.
+ * \param index The index of the \c Chunk in \c Stream::chunks, at most
+ *              the index of its \c NULL sigil.
+ * \param seen  The payload bytes already seen by the caller, or -1.
+ * \return      FETCHER_SUCCESS if the download is over, FETCHER_PENDING if it
+ *              made some progress, or an appropriate error code.
+ */
+error_t SMTH_fetchprogress(Fetcher *f, count_t index, signedlength_t seen)
+{
+	if (!f->ownhandle) return FETCHER_NO_MULTIPLEX;
+
+	return waitchunk(f, index, seen);
+}
+
+/**
+ * \brief Tells whether the \c Chunk with the given index has been downloaded,
+ *        without blocking.
+ *
+ * The transfer of the chunk (and of the following ones) is started, if it was
+ * not yet. The curl multi handle is not driven here: that is up to
+ * \c SMTH_fetchchunk or, if it is shared, to its owner.
+ *
+ * \param f     The fetcher to be used.
+ * \param index The index of the \c Chunk in \c Stream::chunks, at most
+ *              the index of its \c NULL sigil.
+ * \return      FETCHER_SUCCESS if the chunk may be opened, FETCHER_PENDING if
+ *              it is still being downloaded, or an appropriate error code.
+ */
+error_t SMTH_pollchunk(Fetcher *f, count_t index)
+{
+	Transfer *t;
+	error_t error;
+	count_t i;
+
+	if (!f->stream->chunks[index]) return FETCHER_NO_CHUNK;
+
+	if (!findtransfer(f, index))
+	{   /* a seek: whatever is in flight is of no use */
+		for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
+			freetransfer(f, &f->transfers[i]);
+		f->chunk_no = index;
 	}
 
-	++handles;
+	error = fillfetcher(f);
+	if (error) return error;
+
+	t = findtransfer(f, index);
+	if (!t) return FETCHER_NO_CHUNK; /* no free slot: it should never happen */
 
-	f->downloadtime = 0;
+	if (t->state == TRANSFER_RUNNING || t->state == TRANSFER_WAITING)
+		return FETCHER_PENDING;
+
+	if (t->state == TRANSFER_FAILED)
+	{   freetransfer(f, t);
+		return FETCHER_TRANFER_FAILED;
+	}
 
 	return FETCHER_SUCCESS;
 }
 
 /**
- * \brief Extracts and writes to cache embedded data.
+ * \brief Opens a \c Chunk spilled to the cache dir by \c SMTH_fetchchunk,
+ *        and hands it over to the caller.
  *
- * \param s The Stream from which to extract data.
- * \return  Pointer to the file handle, or NULL.
+ * The cache file is unlinked, so that it will be removed as soon as the
+ * stream is closed, and its slot is used to fetch a new chunk. A chunk found
+ * in the persistent cache is opened from there, and left in place, whatever
+ * the slot was meant for. Chunks downloaded to memory are taken with
+ * \c SMTH_chunkparser instead.
+ *
+ * The copy of a downloaded chunk is not stored in the persistent cache
+ * until the caller tells it parsed, with \c SMTH_keepchunk.
+ *
+ * \param f      The fetcher that downloaded the chunk.
+ * \param index  The index of the \c Chunk in \c Stream::chunks
+ * \return       A read only stream with the chunk contents, or NULL.
  */
-static FILE *unembed(Stream *s)
+FILE* SMTH_openchunk(Fetcher *f, count_t index)
 {
-	int i;
-	for (i = 0; s->chunks[i]; ++i)
+	char filename[FETCHER_MAX_FILENAME_LENGTH];
+	FILE *input;
+
+	Transfer *t = findtransfer(f, index);
+	if (!t || t->state != TRANSFER_DONE || !t->spilled) return NULL;
+
+	if (t->hit)
+	{   input = t->hit; /* the cache keeps its file */
+		t->hit = NULL;
+	}
+	else
+	{   chunkpath(f, index, filename);
+		input = fopen(filename, "r");
+		unlink(filename); /* will be removed after fclose() */
+	}
+
+	SMTH_keepchunk(f, false); /* the last one was never told */
+	if (t->copied)
+	{   strcpy(f->pending, t->copyname);
+		f->pendingkey = chunkkey(f, t);
+		f->pendingsize = t->offset;
+		t->copied = false;
+	}
+
+	t->state = TRANSFER_FREE;
+	fillfetcher(f); /* keep the pipe full */
+
+	return input;
+}
+
+/**
+ * \brief Stores in the persistent cache the copy of the last \c Chunk
+ *        opened with \c SMTH_openchunk, or throws it away if it is broken.
+ *
+ * \param f      The fetcher that downloaded the chunk.
+ * \param parsed Whether the chunk was parsed successfully.
+ */
+void SMTH_keepchunk(Fetcher *f, bool parsed)
+{
+	if (!f->pendingkey) return;
+
+	if (parsed) SMTH_cachecommit(f->cache, f->pending, f->pendingkey,
+		f->pendingsize);
+	else unlink(f->pending);
+
+	f->pendingkey = 0;
+}
+
+/**
+ * \brief Hands over a \c Chunk found already parsed in memory, and frees its
+ *        slot to fetch a new chunk.
+ *
+ * \param f     The fetcher that looked the chunk up.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ * \return      The fragment, whose reference goes to the caller, or \c NULL if
+ *              the chunk was not found in memory.
+ */
+const SMTH_fragment *SMTH_sharedchunk(Fetcher *f, count_t index)
+{
+	const SMTH_fragment *fragment;
+
+	Transfer *t = findtransfer(f, index);
+	if (!t || t->state != TRANSFER_DONE || !t->shared) return NULL;
+
+	fragment = t->shared;
+	t->shared = NULL;
+
+	freetransfer(f, t);
+	fillfetcher(f); /* keep the pipe full */
+
+	return fragment;
+}
+
+/**
+ * \brief Tells the key of a scheduled \c Chunk, for the bitrate it is being
+ *        downloaded at \sa SMTH_cachekey
+ *
+ * \param f     The fetcher downloading the chunk.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ * \return      The key, or 0 if the chunk is not scheduled.
+ */
+cachekey_t SMTH_chunkkey(Fetcher *f, count_t index)
+{
+	Transfer *t = findtransfer(f, index);
+
+	return t? chunkkey(f, t): 0;
+}
+
+/**
+ * \brief Gives access to the parser of a \c Chunk being downloaded to memory.
+ *
+ * The parser is fed while the fetcher is driven, hence its fragment may be
+ * adopted as soon as it leaves \c PARSER_HEAD, and its payload read up to
+ * \c FragmentParser::received. The slot is held until \c SMTH_closechunk.
+ *
+ * \param f     The fetcher downloading the chunk.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ * \return      The parser, or NULL if the chunk is not scheduled or spilled.
+ */
+FragmentParser *SMTH_chunkparser(Fetcher *f, count_t index)
+{
+	Transfer *t = findtransfer(f, index);
+
+	if (!t || t->spilled || t->state == TRANSFER_FAILED) return NULL;
+
+	return &t->parser;
+}
+
+/**
+ * \brief Gives back the slot of a \c Chunk taken with \c SMTH_chunkparser,
+ *        aborting its download if it is still running.
+ *
+ * \param f     The fetcher downloading the chunk.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ */
+void SMTH_closechunk(Fetcher *f, count_t index)
+{
+	Transfer *t = findtransfer(f, index);
+
+	if (!t) return;
+
+	freetransfer(f, t);
+	fillfetcher(f); /* keep the pipe full */
+}
+
+/**
+ * \brief Makes any pending or following \c SMTH_fetchchunk return
+ *        \c FETCHER_INTERRUPTED as soon as possible.
+ *
+ * This is the only fetcher function that may be called from a thread other
+ * than the one using the fetcher.
+ *
+ * \param f The fetcher to be interrupted.
+ */
+void SMTH_interruptfetcher(Fetcher *f)
+{
+	__atomic_store_n(&f->interrupted, true, __ATOMIC_RELEASE);
+	if (f->ownhandle) SMTH_wakepoller(&f->poller);
+}
+
+/**
+ * \brief Clears the effect of \c SMTH_interruptfetcher.
+ *
+ * Transfers in flight are kept: they are dropped by the next
+ * \c SMTH_fetchchunk only if they are not needed anymore.
+ *
+ * \param f The fetcher to be resumed.
+ */
+void SMTH_resumefetcher(Fetcher *f)
+{
+	__atomic_store_n(&f->interrupted, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Sets how many chunks a fetcher downloads at once.
+ *
+ * In adaptive mode, the fetcher starts from its last choice, and then adds
+ * a transfer as long as downloads are dominated by the time to the first byte
+ * (i.e. the round trip), and drops one when they are dominated by the payload
+ * (i.e. the bandwidth is saturated). Transfers in flight are never aborted.
+ * It may be called from any thread.
+ *
+ * \param f         The fetcher.
+ * \param transfers The simultaneous transfers, at most
+ *                  \c FETCHER_MAX_TRANSFERS, or \c FETCHER_ADAPTIVE_TRANSFERS
+ */
+void SMTH_settransfers(Fetcher *f, count_t transfers)
+{
+	if (transfers > FETCHER_MAX_TRANSFERS) transfers = FETCHER_MAX_TRANSFERS;
+
+	__atomic_store_n(&f->maxtransfers, transfers, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Chooses whether the chunks downloaded from now on are kept in
+ *        memory, or spilled to the cache directory.
+ *
+ * Memory is the fastest way; spilling bounds the memory in use by large
+ * read-ahead windows. It may be called from any thread.
+ *
+ * \param f     The fetcher.
+ * \param spill Whether chunks are to be spilled.
+ */
+void SMTH_setspill(Fetcher *f, bool spill)
+{
+	__atomic_store_n(&f->spill, spill, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Makes a fetcher look for its chunks in a persistent cache before
+ *        downloading them, and store there those it downloads.
+ *
+ * To be called before the first chunk is requested.
+ *
+ * \param f     The fetcher.
+ * \param cache The cache, whose reference is taken over by the fetcher, or
+ *              \c NULL
+ */
+void SMTH_setcache(Fetcher *f, Cache *cache)
+{
+	SMTH_keepchunk(f, false); /* it belongs to the old cache */
+	if (f->cache) SMTH_releasecache(f->cache);
+	f->cache = cache;
+}
+
+/**
+ * \brief Sets the strategy choosing the bitrate of the chunks downloaded from
+ *        now on. It may be called from any thread.
+ *
+ * \param f   The fetcher.
+ * \param abr The strategy, which must outlive its use, or \c NULL for the
+ *            default one (\c SMTH_throughputabr with default parameters).
+ */
+void SMTH_setabr(Fetcher *f, const SMTH_abr *abr)
+{
+	__atomic_store_n(&f->abr, abr, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Tells the fetcher how much media its reader has yet to consume, for
+ *        buffer based strategies to choose the bitrate. Until it is called,
+ *        the buffer level is unknown. It may be called from any thread.
+ *
+ * \param f        The fetcher.
+ * \param buffered The media downloaded ahead of the reader, in ticks.
+ * \param window   The most chunks the reader lets be downloaded ahead, or 0
+ *                 if unbounded.
+ */
+void SMTH_setbuffer(Fetcher *f, tick_t buffered, count_t window)
+{
+	__atomic_store_n(&f->buffered, buffered, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->window, window, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->buffertracked, true, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Tells how long until a failed transfer of the fetcher is retried.
+ *
+ * Retries are started by \c SMTH_pollchunk: whoever drives a shared multi
+ * handle must poll again after this delay, even if nothing else happened.
+ *
+ * \param f The fetcher.
+ * \return  The delay in ms (0 if a retry is already due), or -1 if nothing
+ *          is waiting to be retried.
+ */
+long SMTH_fetcherdelay(Fetcher *f)
+{
+	long delay, shortest = -1;
+	count_t i;
+
+	for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
 	{
-		//TODO
+		Transfer *t = &f->transfers[i];
+		if (t->state != TRANSFER_WAITING) continue;
+
+		if (isdue(&t->retryat, &delay)) return 0;
+		if (shortest < 0 || delay < shortest) shortest = delay;
 	}
 
-	return NULL;
+	return shortest;
 }
 
 /**
  * \brief Properly disposes of a \c Fetcher.
  *
+ * Running transfers are aborted, and any chunk that was not handed over is
+ * removed, as is the cache directory, if empty.
+ *
  * \param f The fetcher to be disposed.
- * \return  FETCHER_SUCCESS or FETCHER_HANDLE_NOT_CLEANED if something bad happened.
  */
-static error_t disposefetcher(Fetcher *f)
+void SMTH_disposefetcher(Fetcher *f)
 {
-	if (f->handle && curl_multi_cleanup(f->handle))
-		return FETCHER_HANDLE_NOT_CLEANED;
+	count_t i;
 
-	//free(f->cachedir);
-	free(f->urlmodel);
+	for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
+		freetransfer(f, &f->transfers[i]);
 
-	--handles;
-	if (!handles) curl_global_cleanup();
+	if (f->ownhandle) SMTH_disposepoller(&f->poller);
+	f->handle = NULL;
 
-	return FETCHER_SUCCESS;
+	if (f->cachedir)
+	{   rmdir(f->cachedir); /* will delete empty cache dirs */
+		free(f->cachedir);
+		f->cachedir = NULL;
+	}
+
+	SMTH_setcache(f, NULL);
+
+	free(f->baseurl);
+	free(f->urlbuffer);
+	f->baseurl = f->urlbuffer = NULL;
 }
 
 /**
- * \brief Resets \c Fetcher internals.
+ * \brief Marks the slot of a finished transfer, as reported by
+ *        \c curl_multi_info_read, and disposes of its easy handle.
  *
- * \param f The fetcher to be resetted.
- * \return  FETCHER_SUCCESS or an appropriate error code.
+ * \param multi The multi handle the transfer was running on.
+ * \param msg   The message to be handled.
+ * \return      The slot of the transfer, or \c NULL if \c msg is not about a
+ *              finished transfer.
  */
-static error_t resetfetcher(Fetcher *f)
+Transfer *SMTH_endtransfer(CURLM *multi, CURLMsg *msg)
 {
-	long sleep_time;
-	int max_fd;
-	fd_set read, write, except;
-	struct timeval timeout;
+	Transfer *t;
+	curl_off_t bytes = 0;
 
-	FD_ZERO(&read); FD_ZERO(&write); FD_ZERO(&except);
+	if (msg->msg != CURLMSG_DONE) return NULL;
 
-	if (curl_multi_fdset(f->handle, &read, &write, &except, &max_fd))
-		return FETCHER_FAILED_FDSET;
+	curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &t);
 
-	if (curl_multi_timeout(f->handle, &sleep_time))
-		return FETCHER_CONNECTION_TIMEOUT;
-
-	if (sleep_time == -1) sleep_time = 100;
+	if (t->fetcher)
+	{   curl_easy_getinfo(msg->easy_handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+		SMTH_endmeasure(&t->fetcher->estimator, &t->measure, bytes);
+	}
+	else if (t->update && msg->data.result == CURLE_OK)
+		keepresponse(msg->easy_handle, t->update);
 
-	if (max_fd == -1)
-	{	sleep(sleep_time / 1000); /* on MS Windows, Sleep(sleep_time); */
+	if (msg->data.result == CURLE_OK)
+	{	if (t->fetcher) adapttransfers(t->fetcher, msg->easy_handle);
+		t->state = TRANSFER_DONE;
 	}
-	else
-	{	timeout.tv_sec = sleep_time / 1000;
-		timeout.tv_usec = (sleep_time % 1000) * 1000;
+	else if (t->fetcher) failtransfer(t, msg->data.result);
+	else t->state = TRANSFER_FAILED;
+
+	/* a retry goes on writing the copy */
+	if (t->copy && t->state == TRANSFER_DONE) keepcopy(t);
+	else if (t->copy && t->state == TRANSFER_FAILED) dropcopy(t);
 
-		if (0 > select(max_fd+1, &read, &write, &except, &timeout))
-			return FETCHER_NO_MULTIPLEX;
+	curl_multi_remove_handle(multi, msg->easy_handle);
+	curl_easy_cleanup(msg->easy_handle);
+	t->handle = NULL;
+
+	/* a retry goes on writing */
+	if (t->fetcher && t->output && t->state != TRANSFER_WAITING)
+	{   fclose(t->output);
+		t->output = NULL;
 	}
 
-	return FETCHER_SUCCESS;
+	return t;
 }
 
 /**
- * \brief Set an appropriate url and output file for each transfer.
+ * \brief Starts downloading a \c Manifest on a multi handle, without blocking.
  *
- * \param f The fetcher from which to retrieve urls and metadata.
- * \return  FETCHER_SUCCESS or an appropriate error code. 
+ * The multi handle is to be driven by the caller: the Manifest is parsed as it
+ * arrives, and when \c SMTH_endtransfer returns \c t, the parse may be
+ * completed with \c SMTH_takemanifest.
+ *
+ * \param t      The slot to be used. \c Transfer::userdata is left untouched.
+ * \param multi  The multi handle to run the transfer on.
+ * \param url    The url from which retrieve a manifest
+ * \param params Any param necessary to invoke the url.
+ * \param m      The manifest to be filled. It must stay valid until the slot
+ *               is given back.
+ * \param update Makes the download incremental, and keeps the validators
+ *               of the Manifest for the next one, or \c NULL. It must stay
+ *               valid until the slot is given back.
+ * \return       FETCHER_SUCCESS or an appropriate error code.
  */
-static error_t reinithandle(Fetcher *f)
+error_t SMTH_startmanifest(Transfer *t, CURLM *multi, const char *url,
+	const char *params, Manifest *m, ManifestUpdate *update)
 {
 	CURL *handle;
-	FILE *output;
-	char filename[FETCHER_MAX_FILENAME_LENGTH]; /* FIXME more efficient! */
-	char urlbuffer[FETCHER_MAX_URL_LENGTH];
-	char *chunkurl;
 
-	/* The chunk to be parsed right now */
-	f->nextchunk = f->stream->chunks[f->chunk_no];
-	/* Ops! chunks are over! Bye bye. */
-	if (!f->nextchunk) return FETCHER_SUCCESS;
-	/* Increase the index to dereference next chunk */
-	f->chunk_no++; /* FIXME turn to pointer operation */
-/*	Chunk *next = f->stream->chunks++; // will leak */
-/*	if (!next) return FETCHER_SUCCESS;*/
-/*	f->nextchunk = *next;*/
+	if (!SMTH_startcurl()) return FECTHER_FAILED_INIT;
 
-	chunkurl = compileurl(f, urlbuffer);
+	if (SMTH_initmanifestparser(&t->manifest, m,
+		update? update->known: NULL, update? update->knownno: 0))
+	{   return FECTHER_NO_MEMORY;
+	}
 
-	/* Build and open cache file */
-	snprintf(filename, FETCHER_MAX_FILENAME_LENGTH,  "%s/%lu",
-		f->cachedir, f->nextchunk->time);
-	output = fopen(filename, "wx"); /* FIXME with GLIBC */
-	if (!output) return FETCHER_NO_FILE;
+	if (!(handle = manifesthandle(url, params, &t->manifest, update)))
+	{   SMTH_disposemanifestparser(&t->manifest);
+		return FECTHER_NO_MEMORY;
+	}
 
-	/* Build downloader */
-	if (!(handle = curl_easy_init())) return FECTHER_NO_MEMORY;
-	/* Set the url from which to retrieve the chunk */
-	curl_easy_setopt(handle, CURLOPT_URL, chunkurl);
-	/* Write to the provided file handler */
-	curl_easy_setopt(handle, CURLOPT_WRITEDATA, output);
-	/* Use the default write function */
-	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
-	/* Store the file descriptor to close it later */
-	curl_easy_setopt(handle, CURLOPT_PRIVATE, (char*)output);
-	/* Some servers don't like requests without a user-agent field... */
-	curl_easy_setopt(handle, CURLOPT_USERAGENT, FETCHER_USERAGENT);
-	/* No headers written, only body. */
-	curl_easy_setopt(handle, CURLOPT_HEADER, 0L);
-	/* No verbose messages. */
-	curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
-	/* with old versions of libcurl: no progress meter */
-	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+	/* Store the slot, to mark it when the transfer is over */
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, (char*) t);
 
-	if (curl_multi_add_handle(f->handle, handle))
+	if (curl_multi_add_handle(multi, handle))
 	{   curl_easy_cleanup(handle);
+		SMTH_disposemanifestparser(&t->manifest);
 		return FECTHER_HANDLE_NOT_ADDED;
 	}
 
+	t->handle = handle;
+	t->output = NULL;
+	t->update = update;
+	t->fetcher = NULL;
+	t->state = TRANSFER_RUNNING;
+
 	return FETCHER_SUCCESS;
 }
 
 /**
- * \brief Compile a valid url to send a \c Chunk request
+ * \brief Completes the parse of a \c Manifest downloaded with
+ *        \c SMTH_startmanifest.
  *
- * \param buffer The char buffer to be filled with the new url.
- * \return       A pointer to the filled buffer.
+ * \param t The slot of the transfer, which is given back.
+ * \return  FETCHER_SUCCESS if the manifest was filled, or an appropriate
+ *          (fetcher or manifest) error code: the manifest is then zeroed.
+ *          FETCHER_NOT_MODIFIED means that \c Transfer::update is current.
  */
-static char *compileurl(Fetcher *f, char *buffer)
+error_t SMTH_takemanifest(Transfer *t)
 {
-	char temp[FETCHER_MAX_URL_LENGTH]; /* FIXME find something less painful */
+	error_t error = t->manifest.error;
+	Manifest *m = t->manifest.manifest;
+
+	if (t->state != TRANSFER_DONE)
+	{   SMTH_abortmanifest(t, NULL);
+		return error? error: FETCHER_TRANFER_FAILED;
+	}
 
-	replace(temp, FETCHER_MAX_URL_LENGTH, f->urlmodel,
-		FETCHER_START_TIME_PLACEHOLDER, "%lu", f->nextchunk->time);
-	replace(buffer, FETCHER_MAX_URL_LENGTH, temp,
-		FETCHER_BITRATE_PLACEHOLDER, "%u", getbitrate(f));
+	error = takeresponse(&t->manifest, t->update);
+	SMTH_disposemanifestparser(&t->manifest);
+	t->state = TRANSFER_FREE;
 
-	return buffer;
+	return takesnapshot(m, t->update, error);
 }
 
 /**
- * \brief Estimates the suitable bitrate, according to the network download speed.
+ * \brief Gives back the slot of a \c Manifest transfer, aborting it if needed.
  *
- * \param f The fetcher from which to get data
- * \return  A suitable bitrate.
+ * What was parsed of the manifest is thrown away, and the manifest is zeroed.
+ *
+ * \param t     The slot of the transfer.
+ * \param multi The multi handle the transfer is running on, if it is.
  */
-static bitrate_t getbitrate(Fetcher *f)
+void SMTH_abortmanifest(Transfer *t, CURLM *multi)
 {
-	int i;
-	bitrate_t rightone = 0;
-	Track **tracks = f->stream->tracks;
-
-	for (i = 0; tracks[i]; ++i)
-	{
-		bitrate_t br = tracks[i]->bitrate;
-
-		if ((br > rightone) && (!f->maxbitrate || (br <= f->maxbitrate))
-		&& (!f->downloadtime || !f->nextchunk->duration ||
-			(br <= (FETCHER_MAX_OVERHEAD_RATIO * f->nextchunk->duration /
-				f->stream->tick * f->downloadtime)))
-		)
-		{   rightone = br;
-		}
+	if (t->handle)
+	{   curl_multi_remove_handle(multi, t->handle);
+		curl_easy_cleanup(t->handle);
+		t->handle = NULL;
 	}
+	SMTH_disposemanifestparser(&t->manifest);
 
-	if (!rightone) /* If can't find any, pick the smallest */
+	t->state = TRANSFER_FREE;
+}
+
+/**
+ * \brief Makes sure that libcurl was initialised, exactly once per process.
+ *
+ * libcurl is never cleaned up, as other threads may be opening handles at any
+ * time: the resources are released when the process exits. The same goes for
+ * the transport shared by all transfers, so that streams and handles talking to
+ * the same origin reuse connections, DNS lookups and TLS sessions.
+ *
+ * \return \c true if libcurl may be used, \c false otherwise.
+ */
+bool SMTH_startcurl(void)
+{
+	pthread_once(&curlonce, initcurl);
+
+	return curlstatus == CURLE_OK;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Builds an easy handle to download a \c Manifest.
+ *
+ * A request made on behalf of a \c ManifestUpdate is conditional, if the
+ * validators of the previous Manifest are known, and it may be cancelled from
+ * another thread.
+ *
+ * \param url    The url from which retrieve a manifest
+ * \param params Any param necessary to invoke the url.
+ * \param parser The parser to feed the manifest to.
+ * \param update The update the request is made for, or \c NULL
+ * \return       The handle, or \c NULL if there was no memory.
+ */
+static CURL *manifesthandle(const char *url, const char *params,
+	ManifestParser *parser, ManifestUpdate *update)
+{
+	CURL *handle;
+	char manifesturl[FETCHER_MAX_URL_LENGTH];
+
+	snprintf(manifesturl, FETCHER_MAX_FILENAME_LENGTH,  "%s/Manifest%c%s",
+		url, (params? '?': 0), params);
+
+	/* Build downloader */
+	if (!(handle = curl_easy_init())) return NULL;
+
+	/* Set the url from which to retrieve the chunk */
+	curl_easy_setopt(handle, CURLOPT_URL, manifesturl);
+	/* Parse as it arrives */
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, parser);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, storemanifest);
+	/* XML is very compressible: accept whatever encoding curl can inflate */
+	curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "");
+	/* An error page is not a Manifest */
+	curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+	/* Some servers don't like requests without a user-agent field... */
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, FETCHER_USERAGENT);
+	/* No headers written, only body. */
+	curl_easy_setopt(handle, CURLOPT_HEADER, 0L);
+	/* No verbose messages. */
+	curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
+	/* with old versions of libcurl: no progress meter */
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+	/* Signals are process wide: never use them for timeouts */
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	/* Reuse whatever is open to the origin */
+	sharetransport(handle);
+
+	if (!update) return handle;
+
+	/* the headers of the previous request are not in use anymore */
+	curl_slist_free_all(update->headers);
+	update->headers = NULL;
+	free(update->newetag);
+	update->newetag = NULL;
+	update->newmodified = 0;
+	update->status = 0;
+
+	findsnapshot(manifesturl, update);
+
+	if (update->etag)
+	{   char header[FETCHER_MAX_ETAG_LENGTH + sizeof (FETCHER_IF_NONE_MATCH)];
+		snprintf(header, sizeof (header), FETCHER_IF_NONE_MATCH, update->etag);
+		update->headers = curl_slist_append(NULL, header);
+		if (!update->headers)
+		{   curl_easy_cleanup(handle);
+			return NULL;
+		}
+		curl_easy_setopt(handle, CURLOPT_HTTPHEADER, update->headers);
+	}
+	if (update->modified)
+	{   curl_easy_setopt(handle, CURLOPT_TIMECONDITION,
+			(long) CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(handle, CURLOPT_TIMEVALUE_LARGE, update->modified);
+	}
+
+	/* Collect the validators of the new Manifest */
+	curl_easy_setopt(handle, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, storevalidator);
+	curl_easy_setopt(handle, CURLOPT_HEADERDATA, update);
+	/* Let a blocking download be cancelled */
+	curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, cancelmanifest);
+	curl_easy_setopt(handle, CURLOPT_XFERINFODATA, update);
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+
+	return handle;
+}
+
+/**
+ * \brief Picks the \c ETag out of the headers of a Manifest response.
+ *
+ * \param data  The header line, not terminated.
+ * \param size  The size of each member.
+ * \param nmemb The number of members.
+ * \param userp The \c ManifestUpdate.
+ * \return      The bytes taken.
+ */
+static size_t storevalidator(char *data, size_t size, size_t nmemb,
+	void *userp)
+{
+	ManifestUpdate *update = userp;
+	size_t length = size * nmemb;
+	size_t skip = sizeof ("ETag:") - 1;
+
+	if (length <= skip || strncasecmp(data, "ETag:", skip)) return length;
+
+	/* trim blanks and the line terminator */
+	while (skip < length && isspace(data[skip])) skip++;
+	while (length > skip && isspace(data[length - 1])) length--;
+
+	if (length > skip && length - skip <= FETCHER_MAX_ETAG_LENGTH)
+	{   free(update->newetag);
+		update->newetag = strndup(&data[skip], length - skip);
+	}
+
+	return size * nmemb;
+}
+
+/**
+ * \brief Aborts a Manifest download whose \c ManifestUpdate was cancelled.
+ *
+ * \param userp The \c ManifestUpdate.
+ * \return      Nonzero to abort the transfer.
+ */
+static int cancelmanifest(void *userp, curl_off_t dltotal, curl_off_t dlnow,
+	curl_off_t ultotal, curl_off_t ulnow)
+{
+	ManifestUpdate *update = userp;
+
+	(void) dltotal;
+	(void) dlnow;
+	(void) ultotal;
+	(void) ulnow;
+
+	return __atomic_load_n(&update->cancelled, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Records how the server answered a Manifest request, before its easy
+ *        handle is disposed of.
+ *
+ * \param handle The easy handle of the finished request.
+ * \param update The update the request was made for.
+ */
+static void keepresponse(CURL *handle, ManifestUpdate *update)
+{
+	curl_off_t modified = -1;
+
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &update->status);
+	curl_easy_getinfo(handle, CURLINFO_FILETIME_T, &modified);
+	if (modified > 0) update->newmodified = modified;
+}
+
+/**
+ * \brief Completes the parse of a Manifest whose download succeeded, and keeps
+ *        its validators for the next update.
+ *
+ * \param parser The parser fed with the Manifest.
+ * \param update The update the request was made for, or \c NULL
+ * \return       FETCHER_SUCCESS, FETCHER_NOT_MODIFIED, or an appropriate
+ *               manifest error code.
+ */
+static error_t takeresponse(ManifestParser *parser, ManifestUpdate *update)
+{
+	if (update && update->status == 304) return FETCHER_NOT_MODIFIED;
+
+	error_t error = SMTH_endmanifest(parser);
+
+	/* only a Manifest which was parsed may be current */
+	if (!error && update)
+	{   free(update->etag);
+		update->etag = update->newetag;
+		update->newetag = NULL;
+		update->modified = update->newmodified;
+	}
+
+	return error;
+}
+
+/**
+ * \brief Looks for the image of a Manifest in the cache directory, before its
+ *        first request, which is then made conditional on the image \c ETag.
+ *
+ * \param url    The url of the Manifest.
+ * \param update The update the request is made for.
+ */
+static void findsnapshot(const char *url, ManifestUpdate *update)
+{
+	Cache *c;
+	FILE *input;
+	const char *etag;
+
+	/* only the first download of a Manifest may be replaced */
+	if (update->etag || update->known) return;
+
+	dropsnapshot(update);
+	if (!(c = SMTH_defaultcache())) return;
+
+	update->cache = c;
+	update->url = strdup(url);
+	if (!update->url)
+	{   dropsnapshot(update);
+		return;
+	}
+
+	input = SMTH_cachelookup(c, SMTH_cachekey(url, FETCHER_SNAPSHOT_PATTERN,
+		0, 0));
+	if (!input) return;
+
+	if (!SMTH_loadmanifest(&update->snapshot, url, &etag, input) && etag)
+		update->etag = strdup(etag);
+	fclose(input);
+
+	/* without a validator, the image can't be told current */
+	if (!update->etag) SMTH_disposemanifest(&update->snapshot);
+}
+
+/**
+ * \brief Takes the image of a Manifest if the server answered that it is
+ *        current, or stores the Manifest parsed in its place.
+ *
+ * \param m      The manifest filled by the download.
+ * \param update The update the request was made for, or \c NULL
+ * \param error  The outcome of the download.
+ * \return       The outcome of the download, FETCHER_SUCCESS if the image was
+ *               taken.
+ */
+static error_t takesnapshot(Manifest *m, ManifestUpdate *update,
+	error_t error)
+{
+	if (!update || !update->cache) return error;
+
+	if (error == FETCHER_NOT_MODIFIED && update->snapshot.image)
+	{   *m = update->snapshot;
+		memset(&update->snapshot, 0x00, sizeof (Manifest));
+		error = FETCHER_SUCCESS;
+	}
+	else if (!error && update->etag && !m->islive)
+		storesnapshot(m, update);
+
+	dropsnapshot(update);
+
+	return error;
+}
+
+/**
+ * \brief Writes the image of a Manifest to the cache directory, replacing any
+ *        older one.
+ *
+ * \param m      The Manifest just parsed.
+ * \param update The update it was downloaded for, with its \c ETag.
+ */
+static void storesnapshot(Manifest *m, ManifestUpdate *update)
+{
+	char path[CACHE_MAX_PATH];
+	FILE *output;
+	error_t error;
+	long size;
+
+	if (!(output = SMTH_cachecreate(update->cache, path))) return;
+
+	error = SMTH_savemanifest(m, update->url, update->etag, output);
+	size = ftell(output);
+
+	if (fclose(output) || error || size <= 0)
+	{   unlink(path);
+		return;
+	}
+
+	SMTH_cachecommit(update->cache, path, SMTH_cachekey(update->url,
+		FETCHER_SNAPSHOT_PATTERN, 0, 0), size);
+}
+
+/**
+ * \brief Disposes of the image of a Manifest held by an update, if any, and
+ *        of the cache it was looked for in.
+ *
+ * \param update The update.
+ */
+static void dropsnapshot(ManifestUpdate *update)
+{
+	SMTH_disposemanifest(&update->snapshot);
+	memset(&update->snapshot, 0x00, sizeof (Manifest));
+
+	if (update->cache) SMTH_releasecache(update->cache);
+	free(update->url);
+
+	update->cache = NULL;
+	update->url = NULL;
+}
+
+/**
+ * \brief Feeds what arrived of a \c Manifest (already inflated) to its parser.
+ *
+ * \param data  The received bytes.
+ * \param size  The size of each member.
+ * \param nmemb The number of members.
+ * \param userp The \c ManifestParser.
+ * \return      The bytes taken, less than given to abort the transfer if the
+ *              manifest is malformed.
+ */
+static size_t storemanifest(char *data, size_t size, size_t nmemb, void *userp)
+{
+	ManifestParser *parser = userp;
+
+	if (SMTH_feedmanifest(parser, data, size * nmemb)) return 0;
+
+	return size * nmemb;
+}
+
+/**
+ * \brief Initialises libcurl and the shared transport. To be called through
+ *        \c SMTH_startcurl only.
+ */
+static void initcurl(void)
+{
+	int i;
+
+	curlstatus = curl_global_init(CURL_GLOBAL_ALL);
+	if (curlstatus != CURLE_OK) return;
+
+	transport = curl_share_init();
+	if (!transport) return; /* every transfer will connect on its own */
+
+	for (i = 0; i < CURL_LOCK_DATA_LAST; ++i)
+		pthread_mutex_init(&transportlocks[i], NULL);
+
+	curl_share_setopt(transport, CURLSHOPT_LOCKFUNC, locktransport);
+	curl_share_setopt(transport, CURLSHOPT_UNLOCKFUNC, unlocktransport);
+	curl_share_setopt(transport, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(transport, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(transport, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+/**
+ * \brief Makes an easy handle use the shared transport, and HTTP/2 where the
+ *        server supports it, so that requests to the same origin are
+ *        multiplexed on a single connection.
+ *
+ * \c CURLOPT_PIPEWAIT is \e not set: a transfer waiting for a connection that
+ * is being set up by another multi handle would never be woken up.
+ *
+ * \param handle The handle to be set up.
+ */
+static void sharetransport(CURL *handle)
+{
+	curl_easy_setopt(handle, CURLOPT_SHARE, transport);
+	/* HTTP/2 is negotiated with ALPN over TLS, plain HTTP stays 1.1 */
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+}
+
+/**
+ * \brief \c CURLSHOPT_LOCKFUNC of the shared transport.
+ *
+ * \param handle Unused.
+ * \param data   The kind of data to be locked.
+ * \param access Unused: shared and exclusive accesses are serialised alike.
+ * \param userp  Unused.
+ */
+static void locktransport(CURL *handle, curl_lock_data data,
+	curl_lock_access access, void *userp)
+{
+	(void) handle;
+	(void) access;
+	(void) userp;
+
+	pthread_mutex_lock(&transportlocks[data]);
+}
+
+/**
+ * \brief \c CURLSHOPT_UNLOCKFUNC of the shared transport.
+ *
+ * \param handle Unused.
+ * \param data   The kind of data to be unlocked.
+ * \param userp  Unused.
+ */
+static void unlocktransport(CURL *handle, curl_lock_data data, void *userp)
+{
+	(void) handle;
+	(void) userp;
+
+	pthread_mutex_unlock(&transportlocks[data]);
+}
+
+
+/**
+ * \brief Extracts and writes to cache embedded data.
+ *
+ * \param s The Stream from which to extract data.
+ * \return  Pointer to the file handle, or NULL.
+ */
+static FILE *unembed(Stream *s)
+{
+	int i;
+	for (i = 0; s->chunks[i]; ++i)
 	{
-		rightone = tracks[0]; // assuming each one has at least tracks...
-		for (i = 0; tracks[i]; ++i)
+		//TODO
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Waits for some activity on the transfers, at most
+ *        \c FETCHER_MAX_WAIT ms, and collects the finished ones.
+ *
+ * \param f The fetcher to be run.
+ * \return  FETCHER_SUCCESS or an appropriate error code.
+ */
+static error_t execfetcher(Fetcher *f)
+{
+	int queue;
+	CURLMsg *msg;
+	long wait = SMTH_fetcherdelay(f);
+
+	/* wake up in time for the next retry */
+	if (wait < 0 || wait > FETCHER_MAX_WAIT) wait = FETCHER_MAX_WAIT;
+
+	if (SMTH_waitpoller(&f->poller, wait))
+		return FETCHER_NO_MULTIPLEX;
+
+	while ((msg = curl_multi_info_read(f->handle, &queue)))
+		SMTH_endtransfer(f->handle, msg);
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Starts a new transfer for each free slot, while there are chunks left,
+ *        and retries the failed ones whose time has come.
+ *
+ * \param f The fetcher to be filled.
+ * \return  FETCHER_SUCCESS or an appropriate error code.
+ */
+static error_t fillfetcher(Fetcher *f)
+{
+	count_t i, busy = 0;
+	count_t limit = __atomic_load_n(&f->maxtransfers, __ATOMIC_RELAXED);
+
+	if (limit == FETCHER_ADAPTIVE_TRANSFERS) limit = f->transfersno;
+
+	for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
+	{
+		Transfer *t = &f->transfers[i];
+		if (t->state != TRANSFER_FREE) busy++;
+
+		/* a failed download whose backoff is over */
+		if (t->state == TRANSFER_WAITING && isdue(&t->retryat, NULL))
+			t->state = starttransfer(f, t)? TRANSFER_FAILED: TRANSFER_RUNNING;
+	}
+
+	for (i = 0; i < FETCHER_MAX_TRANSFERS && busy < limit; ++i)
+	{
+		if (f->transfers[i].state != TRANSFER_FREE) continue;
+		/* Ops! chunks are over! Bye bye. */
+		if (!f->stream->chunks[f->chunk_no]) break;
+
+		error_t error = reinithandle(f, &f->transfers[i]);
+		if (error) return error;
+		busy++;
+	}
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Accounts for a finished download in \c Fetcher::latency, and steers
+ *        the simultaneous transfers of an adaptive fetcher accordingly.
+ *
+ * \param f      The fetcher.
+ * \param handle The curl handle of the finished download.
+ */
+static void adapttransfers(Fetcher *f, CURL *handle)
+{
+	double wait = 0., total = 0.;
+
+	curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME, &wait);
+	curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &total);
+	if (total <= 0.) return;
+
+	f->latency += FETCHER_LATENCY_WEIGHT * (wait / total - f->latency);
+
+	if (__atomic_load_n(&f->maxtransfers, __ATOMIC_RELAXED) !=
+		FETCHER_ADAPTIVE_TRANSFERS) return;
+
+	if (f->latency > FETCHER_LATENCY_BOUND &&
+		f->transfersno < FETCHER_MAX_TRANSFERS) f->transfersno++;
+	else if (f->latency < FETCHER_BANDWIDTH_BOUND && f->transfersno > 1)
+		f->transfersno--;
+}
+
+/**
+ * \brief Looks for the slot holding a given \c Chunk.
+ *
+ * \param f     The fetcher to be searched.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ * \return      The slot, or NULL if the chunk was never scheduled.
+ */
+static Transfer *findtransfer(Fetcher *f, count_t index)
+{
+	count_t i;
+
+	for (i = 0; i < FETCHER_MAX_TRANSFERS; ++i)
+	{
+		Transfer *t = &f->transfers[i];
+		if (t->state != TRANSFER_FREE && t->index == index) return t;
+	}
+
+	return NULL;
+}
+
+/**
+ * \brief Drives the fetcher until the \c Chunk with the given index has been
+ *        downloaded, or its parser got further than \c seen.
+ *
+ * \param f     The fetcher to be used. It must own its multi handle.
+ * \param index The index of the \c Chunk in \c Stream::chunks
+ * \param seen  The progress already seen by the caller \sa chunkprogress
+ * \return      FETCHER_SUCCESS, FETCHER_PENDING or an appropriate error code.
+ */
+static error_t waitchunk(Fetcher *f, count_t index, signedlength_t seen)
+{
+	error_t error;
+
+	while ((error = SMTH_pollchunk(f, index)) == FETCHER_PENDING)
+	{
+		if (chunkprogress(findtransfer(f, index)) > seen) return FETCHER_PENDING;
+
+		if (__atomic_load_n(&f->interrupted, __ATOMIC_ACQUIRE))
+			return FETCHER_INTERRUPTED;
+
+		error = execfetcher(f);
+		if (error) return error;
+	}
+
+	return error;
+}
+
+/**
+ * \brief Tells how far the parser of a running transfer got.
+ *
+ * \param t The transfer.
+ * \return  The payload bytes parsed, or -1 if the fragment metadata is not
+ *          available (yet, or at all for spilled and broken chunks).
+ */
+static signedlength_t chunkprogress(Transfer *t)
+{
+	if (t->spilled) return -1;
+
+	switch (t->parser.state)
+	{   case PARSER_PAYLOAD:
+		case PARSER_DONE: return (signedlength_t) t->parser.received;
+		default: return -1;
+	}
+}
+
+/**
+ * \brief Aborts a transfer, if any, removes its cache file and frees its slot.
+ *
+ * \param f The fetcher owning the slot.
+ * \param t The slot to be freed.
+ */
+static void freetransfer(Fetcher *f, Transfer *t)
+{
+	char filename[FETCHER_MAX_FILENAME_LENGTH];
+
+	if (t->state == TRANSFER_FREE) return;
+
+	if (t->handle)
+	{   curl_multi_remove_handle(f->handle, t->handle);
+		curl_easy_cleanup(t->handle);
+		t->handle = NULL;
+		SMTH_endmeasure(&f->estimator, &t->measure, 0);
+	}
+	if (t->output)
+	{   fclose(t->output);
+		t->output = NULL;
+	}
+	if (t->hit)
+	{   fclose(t->hit);
+		t->hit = NULL;
+	}
+	/* nothing was written to the cache dir */
+	else if (t->spilled)
+	{   chunkpath(f, t->index, filename);
+		unlink(filename);
+	}
+	if (t->shared)
+	{   SMTH_releasefragment(t->shared);
+		t->shared = NULL;
+	}
+	if (t->copy) dropcopy(t);
+	if (t->copied)
+	{   unlink(t->copyname);
+		t->copied = false;
+	}
+	if (!t->spilled) SMTH_disposeparser(&t->parser);
+
+	t->state = TRANSFER_FREE;
+}
+
+/**
+ * \brief Creates the cache directory of a fetcher, unless it exists.
+ *
+ * \param f The fetcher.
+ * \return  FETCHER_SUCCESS or FETCHER_NO_FILE
+ */
+static error_t makecachedir(Fetcher *f)
+{
+	if (f->cachedir) return FETCHER_SUCCESS;
+
+	char* template = strdup(FETCHER_DIRECTOTY_TEMPLATE);
+	f->cachedir = template? mkdtemp(template): NULL;
+	if (!f->cachedir)
+	{   free(template);
+		return FETCHER_NO_FILE;
+	}
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief \c CURLOPT_WRITEFUNCTION of chunks: feeds the data to the parser of
+ *        the transfer, or writes it to its cache file, and to its copy for
+ *        the persistent cache.
+ *
+ * A broken fragment does not abort the transfer, so that it is skipped as a
+ * whole once downloaded, like a broken spilled chunk. Bytes already stored by
+ * a previous attempt are thrown away.
+ *
+ * \param data   The data received.
+ * \param size   Always 1.
+ * \param nmemb  The number of bytes received.
+ * \param userp  The \c Transfer
+ * \return       The bytes stored: anything else aborts the transfer.
+ */
+static size_t storechunk(char *data, size_t size, size_t nmemb, void *userp)
+{
+	Transfer *t = userp;
+	length_t length = size * nmemb;
+	length_t skipped = length < t->skip? length: t->skip;
+
+	t->skip -= skipped;
+	data += skipped;
+	length -= skipped;
+
+	if (!t->spilled) SMTH_feedparser(&t->parser, (byte_t*) data, length);
+	else if (fwrite(data, 1, length, t->output) < length) return 0;
+
+	/* the cache is not worth failing the transfer */
+	if (t->copy && fwrite(data, 1, length, t->copy) < length) dropcopy(t);
+
+	t->offset += length;
+
+	return size * nmemb;
+}
+
+/**
+ * \brief Builds the path of the cache file of a \c Chunk.
+ *
+ * \param f      The fetcher holding the cache directory.
+ * \param index  The index of the \c Chunk in \c Stream::chunks
+ * \param buffer A buffer at least \c FETCHER_MAX_FILENAME_LENGTH bytes long.
+ */
+static void chunkpath(Fetcher *f, count_t index, char *buffer)
+{
+	snprintf(buffer, FETCHER_MAX_FILENAME_LENGTH,  "%s/%lu",
+		f->cachedir, f->stream->chunks[index]->time);
+}
+
+/**
+ * \brief Set an appropriate url and output file for the next transfer.
+ *
+ * \param f The fetcher from which to retrieve urls and metadata.
+ * \param t The free slot to be used for the transfer.
+ * \return  FETCHER_SUCCESS or an appropriate error code. 
+ */
+static error_t reinithandle(Fetcher *f, Transfer *t)
+{
+	FILE *output = NULL;
+	char filename[FETCHER_MAX_FILENAME_LENGTH];
+	bool spill = __atomic_load_n(&f->spill, __ATOMIC_RELAXED);
+	error_t error;
+
+	/* The chunk to be parsed right now */
+	f->nextchunk = f->stream->chunks[f->chunk_no];
+	/* Ops! chunks are over! Bye bye. */
+	if (!f->nextchunk) return FETCHER_SUCCESS;
+
+	t->index = f->chunk_no;
+	t->bitrate = getbitrate(f);
+	t->offset = 0;
+	t->norange = false;
+	t->attempts = 0;
+	t->waits = 0;
+
+	/* a chunk parsed by another handle is not even read */
+	t->shared = SMTH_memorylookup(chunkkey(f, t));
+	if (t->shared)
+	{   t->spilled = false;
+		SMTH_initparser(&t->parser);
+		t->state = TRANSFER_DONE;
+	}
+
+	/* a cached chunk is not downloaded at all */
+	if (t->shared || (f->cache && readcopy(f, t)))
+	{   f->chunk_no++;
+		return FETCHER_SUCCESS;
+	}
+
+	/* Build and open cache file, if asked to */
+	if (spill)
+	{   if (makecachedir(f)) return FETCHER_NO_FILE;
+		chunkpath(f, f->chunk_no, filename);
+		output = fopen(filename, "w");
+		if (!output) return FETCHER_NO_FILE;
+	}
+
+	t->output = output;
+	t->spilled = spill;
+	if (!spill) SMTH_initparser(&t->parser);
+
+	error = starttransfer(f, t);
+	if (error)
+	{   t->output = NULL;
+		if (output)
+		{   fclose(output);
+			unlink(filename);
+		}
+		return error;
+	}
+
+	if (f->cache) t->copy = SMTH_cachecreate(f->cache, t->copyname);
+	t->state = TRANSFER_RUNNING;
+
+	/* Increase the index to dereference next chunk */
+	f->chunk_no++;
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Starts downloading the \c Chunk of a slot, resuming whatever was
+ *        stored by previous attempts.
+ *
+ * \param f The fetcher owning the slot.
+ * \param t The slot, whose \c Transfer::state is left untouched.
+ * \return  FETCHER_SUCCESS or an appropriate error code.
+ */
+static error_t starttransfer(Fetcher *f, Transfer *t)
+{
+	CURL *handle;
+	url_t *url = compileurl(f, t);
+
+	/* Build downloader */
+	if (!url || !(handle = curl_easy_init())) return FECTHER_NO_MEMORY;
+
+	/* Set the url from which to retrieve the chunk (curl keeps a copy) */
+	curl_easy_setopt(handle, CURLOPT_URL, url);
+	/* Write to memory, or to the cache file */
+	curl_easy_setopt(handle, CURLOPT_WRITEDATA, t);
+	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, storechunk);
+	/* Ask only for what is missing, unless the server can't tell */
+	if (t->offset && !t->norange)
+		curl_easy_setopt(handle, CURLOPT_RESUME_FROM_LARGE,
+			(curl_off_t) t->offset);
+	t->skip = t->norange? t->offset: 0;
+	/* HTTP errors must fail the transfer, so that it will be retried */
+	curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+	/* Store the slot, to mark it when the transfer is over */
+	curl_easy_setopt(handle, CURLOPT_PRIVATE, (char*) t);
+	/* Some servers don't like requests without a user-agent field... */
+	curl_easy_setopt(handle, CURLOPT_USERAGENT, FETCHER_USERAGENT);
+	/* No headers written, only body. */
+	curl_easy_setopt(handle, CURLOPT_HEADER, 0L);
+	/* No verbose messages. */
+	curl_easy_setopt(handle, CURLOPT_VERBOSE, 0L);
+	/* with old versions of libcurl: no progress meter */
+	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 1L);
+	/* Signals are process wide: never use them for timeouts */
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	/* Reuse whatever is open to the origin */
+	sharetransport(handle);
+
+	if (curl_multi_add_handle(f->handle, handle))
+	{   curl_easy_cleanup(handle);
+		return FECTHER_HANDLE_NOT_ADDED;
+	}
+
+	t->handle = handle;
+	SMTH_startmeasure(&f->estimator, &t->measure);
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Schedules a failed \c Chunk download to be retried, with an
+ *        exponential backoff, or gives it up after \c FETCHER_MAX_ATTEMPTS.
+ *
+ * What was stored is kept, so that the next attempt may resume from there.
+ * If nothing was, after \c FETCHER_FALLBACK_ATTEMPTS the chunk is asked at
+ * a lower bitrate. A chunk announced by a TfrfBox, that the server refuses,
+ * is rather waited for, up to \c FETCHER_ANNOUNCED_WAITS times.
+ *
+ * \param t      The slot of the failed download.
+ * \param result The outcome of the download.
+ */
+static void failtransfer(Transfer *t, CURLcode result)
+{
+	long delay;
+
+	/* a chunk announced by a live fragment may not be published yet */
+	if (result == CURLE_HTTP_RETURNED_ERROR && !t->offset &&
+		t->fetcher->stream->chunks[t->index]->announced &&
+		t->waits < FETCHER_ANNOUNCED_WAITS)
+	{   t->waits++;
+		delay = FETCHER_RETRY_DELAY;
+	}
+	else
+	{
+		if (++t->attempts >= FETCHER_MAX_ATTEMPTS)
+		{   t->state = TRANSFER_FAILED;
+			return;
+		}
+
+		/* the server answered the whole chunk to a Range request */
+		if (result == CURLE_RANGE_ERROR) t->norange = true;
+
+		if (!t->offset && t->attempts >= FETCHER_FALLBACK_ATTEMPTS)
+			t->bitrate = lowerbitrate(t->fetcher, t->bitrate);
+
+		delay = FETCHER_RETRY_DELAY << (t->attempts - 1);
+		if (delay > FETCHER_MAX_RETRY_DELAY) delay = FETCHER_MAX_RETRY_DELAY;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t->retryat);
+	t->retryat.tv_sec += delay / 1000;
+	t->retryat.tv_nsec += (delay % 1000) * 1000000L;
+	if (t->retryat.tv_nsec >= 1000000000L)
+	{   t->retryat.tv_sec++;
+		t->retryat.tv_nsec -= 1000000000L;
+	}
+
+	t->state = TRANSFER_WAITING;
+}
+
+/**
+ * \brief Tells whether a given time has come.
+ *
+ * \param when  The time, on \c CLOCK_MONOTONIC
+ * \param delay If not \c NULL, set to the ms left, when it has not come yet.
+ * \return      true if \c when is past.
+ */
+static bool isdue(const struct timespec *when, long *delay)
+{
+	struct timespec now;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (when->tv_sec - now.tv_sec) * 1000L +
+		(when->tv_nsec - now.tv_nsec) / 1000000L;
+
+	if (left <= 0) return true;
+
+	if (delay) *delay = left;
+	return false;
+}
+
+/**
+ * \brief Compile a valid url to send a \c Chunk request
+ *
+ * The url is built in a single pass over the \c Stream::urltokens parsed with
+ * the Manifest, into \c Fetcher::urlbuffer.
+ *
+ * \param f      The fetcher holding the base url.
+ * \param t      The slot holding the \c Chunk index and the bitrate.
+ * \return       \c Fetcher::urlbuffer, valid until the next call, or \c NULL
+ *               if there was not memory enough.
+ */
+static url_t *compileurl(Fetcher *f, Transfer *t)
+{
+	const UrlToken *token;
+	length_t length = 0;
+	char number[24];
+	count_t i, j;
+
+	if (!appendurl(f, &length, f->baseurl, f->baselength)) return NULL;
+
+	for (token = f->stream->urltokens; token->type != URL_END; ++token)
+	{
+		Track **tracks = f->stream->tracks;
+		bool ok = true;
+
+		switch (token->type)
 		{
-			bitrate_t br = tracks[i]->bitrate;
-			if (br < rightone) rightone = br;
+			case URL_LITERAL:
+				ok = appendurl(f, &length, token->text, token->length);
+				break;
+			case URL_BITRATE:
+				ok = appendurl(f, &length, number,
+					sprintf(number, "%u", t->bitrate));
+				break;
+			case URL_START_TIME:
+				ok = appendurl(f, &length, number, sprintf(number, "%llu",
+					(unsigned long long) f->stream->chunks[t->index]->time));
+				break;
+			case URL_CUSTOM_ATTRIBUTES:
+				for (i = 0; tracks[i] && tracks[i]->bitrate != t->bitrate; ++i);
+				if (!tracks[i] || !tracks[i]->attributes) break;
+				for (j = 0; ok && tracks[i]->attributes[j]; j += 2)
+				{
+					chardata *key = tracks[i]->attributes[j];
+					chardata *value = tracks[i]->attributes[j+1];
+
+					ok = (!j || appendurl(f, &length, ",", 1)) &&
+						appendurl(f, &length, key, strlen(key)) &&
+						appendurl(f, &length, "=", 1) &&
+						appendurl(f, &length, value, strlen(value));
+				}
+				break;
+			default:
+				break;
 		}
+		if (!ok) return NULL;
+	}
+
+	f->urlbuffer[length] = '\0';
+
+	return f->urlbuffer;
+}
+
+/**
+ * \brief Appends some text to \c Fetcher::urlbuffer, growing it if needed.
+ *
+ * A byte more is always kept free, for the \c \0 sigil.
+ *
+ * \param f      The fetcher.
+ * \param length The length of the url so far, to be updated.
+ * \param text   The text to be appended.
+ * \param size   The length of \c text.
+ * \return       \c false if the buffer could not be grown, \c true otherwise.
+ */
+static bool appendurl(Fetcher *f, length_t *length, const char *text,
+	length_t size)
+{
+	if (*length + size >= f->urlbuffersize)
+	{
+		length_t newsize = f->urlbuffersize? f->urlbuffersize:
+			FETCHER_URL_BUFFER_SIZE;
+		url_t *buffer;
+
+		while (*length + size >= newsize) newsize *= 2;
+		if (!(buffer = realloc(f->urlbuffer, newsize))) return false;
+
+		f->urlbuffer = buffer;
+		f->urlbuffersize = newsize;
+	}
+
+	memcpy(f->urlbuffer + *length, text, size);
+	*length += size;
+
+	return true;
+}
+
+/**
+ * \brief Asks the strategy of the fetcher for the bitrate of the next chunk.
+ *
+ * The strategy gets the bitrates not above \c Fetcher::maxbitrate (or just
+ * the lowest one, if none is), the throughput estimates and the buffer level
+ * kept by \c SMTH_setbuffer. What it returns is rounded down to one of them.
+ *
+ * \param f The fetcher from which to get data
+ * \return  A suitable bitrate.
+ */
+static bitrate_t getbitrate(Fetcher *f)
+{
+	count_t i, j, tracksno;
+	Track **tracks = f->stream->tracks;
+	const SMTH_abr *abr = __atomic_load_n(&f->abr, __ATOMIC_ACQUIRE);
+	tick_t timescale = f->timescale? f->timescale: FETCHER_DEFAULT_TIMESCALE;
+	SMTH_abrstate state;
+	bitrate_t chosen;
+
+	for (tracksno = 0; tracks[tracksno]; ++tracksno);
+
+	bitrate_t ladder[tracksno + 1];
+
+	/* the allowed bitrates, sorted by insertion */
+	for (i = 0, state.bitratesno = 0; i < tracksno; ++i)
+	{
+		bitrate_t br = tracks[i]->bitrate;
+
+		if (f->maxbitrate && br > f->maxbitrate) continue;
+		for (j = state.bitratesno; j > 0 && ladder[j-1] > br; --j)
+			ladder[j] = ladder[j-1];
+		ladder[j] = br;
+		state.bitratesno++;
+	}
+
+	if (!state.bitratesno) /* If can't find any, pick the smallest */
+	{
+		ladder[0] = tracks[0]->bitrate; // assuming each one has at least tracks...
+		for (i = 0; i < tracksno; ++i)
+			if (tracks[i]->bitrate < ladder[0]) ladder[0] = tracks[i]->bitrate;
+		state.bitratesno = 1;
+	}
+
+	state.bitrates = ladder;
+	state.previous = f->lastbitrate;
+	state.throughput = SMTH_ewmaestimate(&f->estimator);
+	state.safethroughput = SMTH_percentileestimate(&f->estimator,
+		FETCHER_SAFE_PERCENTILE);
+	state.duration = f->nextchunk && f->nextchunk->duration?
+		(double) f->nextchunk->duration / timescale: 0;
 
-		f->maxbitrate = rightone; /* so that this won't happen again */
+	if (__atomic_load_n(&f->buffertracked, __ATOMIC_RELAXED))
+	{
+		state.buffer = (double)
+			__atomic_load_n(&f->buffered, __ATOMIC_RELAXED) / timescale;
+		state.capacity = state.duration *
+			__atomic_load_n(&f->window, __ATOMIC_RELAXED);
+	}
+	else
+	{   state.buffer = -1;
+		state.capacity = 0;
 	}
 
-/*	fprintf(stderr, "%dkbps (%.2lf%% overhead ratio)\n", rightone / 1000,*/
-/*		100. * f->nextchunk->duration / f->stream->tick * f->downloadtime /rightone);*/
+	chosen = abr? abr->choose(&state, abr->userdata):
+		SMTH_throughputabr(&state, NULL);
+
+	/* round down to the ladder */
+	for (i = state.bitratesno - 1; i > 0 && ladder[i] > chosen; --i);
+
+	return f->lastbitrate = ladder[i];
+}
+
+/**
+ * \brief Picks the next bitrate below a given one, to fall back to.
+ *
+ * \param f       The fetcher from which to get the tracks.
+ * \param bitrate The bitrate that failed.
+ * \return        The highest bitrate below \c bitrate, or \c bitrate itself
+ *                if it is the lowest.
+ */
+static bitrate_t lowerbitrate(Fetcher *f, bitrate_t bitrate)
+{
+	int i;
+	bitrate_t lower = 0;
+	Track **tracks = f->stream->tracks;
+
+	for (i = 0; tracks[i]; ++i)
+	{
+		bitrate_t br = tracks[i]->bitrate;
+		if (br < bitrate && br > lower) lower = br;
+	}
+
+	return lower? lower: bitrate;
+}
+
+/**
+ * \brief Computes the key of the \c Chunk of a slot in the persistent cache.
+ *
+ * \param f The fetcher owning the slot.
+ * \param t The slot.
+ * \return  The key, for the bitrate of the slot.
+ */
+static cachekey_t chunkkey(Fetcher *f, Transfer *t)
+{
+	return SMTH_cachekey(f->baseurl, f->stream->url, t->bitrate,
+		f->stream->chunks[t->index]->time);
+}
+
+/**
+ * \brief Looks for the \c Chunk of a slot in the persistent cache, and if it
+ *        is there, completes the slot with it.
+ *
+ * The slot is then spilled, even if the chunk was to be downloaded to memory,
+ * so that its file is mapped rather than read \sa SMTH_mapfragment
+ *
+ * \param f The fetcher owning the slot.
+ * \param t The slot, whose chunk and bitrate are set.
+ * \return  \c true if the chunk was found, \c false otherwise.
+ */
+static bool readcopy(Fetcher *f, Transfer *t)
+{
+	FILE *input = SMTH_cachelookup(f->cache, chunkkey(f, t));
+	if (!input) return false;
+
+	t->spilled = true;
+	t->hit = input;
+	t->state = TRANSFER_DONE;
+
+	return true;
+}
+
+/**
+ * \brief Stores the copy of a downloaded \c Chunk in the persistent cache,
+ *        unless it is broken.
+ *
+ * A spilled chunk was not parsed yet: its copy is kept aside, and stored by
+ * \c SMTH_keepchunk only if it parses once opened.
+ *
+ * \param t The slot of the chunk.
+ */
+static void keepcopy(Transfer *t)
+{
+	bool written = !fclose(t->copy);
+
+	t->copy = NULL;
 
-	return rightone;
+	if (!written || (!t->spilled && t->parser.state != PARSER_DONE))
+		unlink(t->copyname);
+	else if (t->spilled) t->copied = true;
+	else SMTH_cachecommit(t->fetcher->cache, t->copyname,
+		chunkkey(t->fetcher, t), t->offset);
 }
 
 /**
- * \brief Replace a string with another
+ * \brief Throws away the copy of a \c Chunk for the persistent cache.
  *
- * \warning For the sake of speed, this will copy only the first
- *          \c FETCHER_REPLACE_FORMAT_LENGTH characters.
- * \param  buffer  the buffer to fill
- * \param  source  the string to process
- * \param  search  the token to find
- * \param  the printf token for the replacing tag (e.g. "%lu" or "%d")
- * \param  replace the token to replace
- * \return pointer to the string buffer
+ * \param t The slot of the chunk.
  */
-static
-char *replace(char *buffer, size_t size, const char *source, char *search,
-	const char *format, void *replace)
+static void dropcopy(Transfer *t)
 {
-	char *position;
-	char specs[FETCHER_REPLACE_FORMAT_LENGTH+1];
-	/* if no match, just say hello */
-	if (!(position = strstr(source, search))) return strcpy(buffer, source);
-	/* compile format string */
-	snprintf(specs, FETCHER_REPLACE_FORMAT_LENGTH, "%s%%s", format);
-	/* replace */
-	strncpy(buffer, source, position-source);  
-	buffer[position-source] = 0;
-	snprintf(buffer+(position-source), size, specs,
-		replace, position+strlen(search));
-	return buffer;
+	fclose(t->copy);
+	unlink(t->copyname);
+	t->copy = NULL;
 }
 
 /* vim: set ts=4 sw=4 tw=0: */
@@ -29,8 +29,15 @@
  * \date   12th-13th June 2010 ~ 6 Dic 2010
  */
 
+#include <curl/multi.h>
 #include <smth-common-defs.h>
+#include <smth.h>
 #include <smth-manifest-parser.h>
+#include <smth-fragment-parser.h>
+#include <smth-poller.h>
+#include <smth-estimator.h>
+#include <smth-cache.h>
+#include <smth-memcache.h>
 
 /** Everything is ok. */
 #define FETCHER_SUCCESS                (0)
@@ -58,10 +65,204 @@
 #define FETCHER_NO_FILE                (-36)
 /** An appropriate url for \c Chunk retrieval was not specified */
 #define FECTHER_NO_URL                 (-37)
+/** The requested \c Chunk does not exist in the \c Stream */
+#define FETCHER_NO_CHUNK               (-40)
+/** The fetcher was interrupted by another thread while waiting */
+#define FETCHER_INTERRUPTED            (-41)
+/** The requested \c Chunk is still being downloaded */
+#define FETCHER_PENDING                (-43)
+/** The \c Manifest did not change since it was last downloaded */
+#define FETCHER_NOT_MODIFIED           (-48)
 
 /** Automatic quality setup */
 #define FETCHER_QUALITY_AUTO           (0)
 
+/** The most simultaneous transfers per \c Fetcher (its download slots) */
+#define FETCHER_MAX_TRANSFERS          16L
+/** The simultaneous transfers per \c Fetcher, unless otherwise set */
+#define FETCHER_DEFAULT_TRANSFERS      2L
+/** Lets the fetcher choose its simultaneous transfers \sa SMTH_settransfers */
+#define FETCHER_ADAPTIVE_TRANSFERS     0L
+/** The most attempts made to download a \c Chunk */
+#define FETCHER_MAX_ATTEMPTS           5
+
+/** \brief The state of a \c Transfer slot */
+typedef enum { TRANSFER_FREE,    /**< the slot may be reused                 */
+               TRANSFER_RUNNING, /**< the chunk is being downloaded          */
+               TRANSFER_DONE,    /**< the chunk is waiting to be taken       */
+               TRANSFER_WAITING, /**< the download failed, and will be retried
+                                      at \c Transfer::retryat              */
+               TRANSFER_FAILED   /**< the download did not succeed           */
+             } TransferState;
+
+/** \brief Makes a new download of a \c Manifest incremental: the request is
+ *         conditional, and the chunks already known are skipped.
+ */
+typedef struct
+{
+	/** The end of the timeline already known of each stream, in its ticks,
+	 *  or \c NULL \sa SMTH_initmanifestparser */
+	tick_t *known;
+	/** The number of streams in \c known */
+	count_t knownno;
+	/** The \c ETag of the last Manifest taken, or \c NULL */
+	char *etag;
+	/** The \c Last-Modified time of the last Manifest taken, 0 if unknown */
+	curl_off_t modified;
+	/** The \c ETag of the response being received, or \c NULL */
+	char *newetag;
+	/** The \c Last-Modified time of the response being received */
+	curl_off_t newmodified;
+	/** The HTTP status of the last response */
+	long status;
+	/** The headers of the request in flight */
+	struct curl_slist *headers;
+	/** Set from another thread to abort a blocking download.
+	 *  It must be accessed atomically. */
+	bool cancelled;
+	/** The cache directory the Manifest image is kept in, from the first
+	 *  request until its response is taken, or \c NULL */
+	Cache *cache;
+	/** The url of the Manifest, while \c cache is set */
+	char *url;
+	/** The image found in \c cache, taken if the server answers that its
+	 *  \c ETag is current \sa SMTH_loadmanifest */
+	Manifest snapshot;
+} ManifestUpdate;
+
+/** \brief Holds a single \c Chunk (or \c Manifest) download. */
+typedef struct
+{
+	/** Curl easy handle, only while \c TRANSFER_RUNNING */
+	CURL *handle;
+	/** The cache file the chunk is written to, only while running */
+	FILE *output;
+	/** Whether the chunk goes to the cache dir, instead of \c parser */
+	bool spilled;
+	/** Parses the chunk as it arrives, unless spilled */
+	FragmentParser parser;
+	/** Parses a \c Manifest as it arrives, for a Manifest transfer */
+	ManifestParser manifest;
+	/** Makes a Manifest transfer incremental, or \c NULL */
+	ManifestUpdate *update;
+	/** The body bytes stored so far, through all attempts */
+	length_t offset;
+	/** The body bytes to be thrown away, when resending what was stored */
+	length_t skip;
+	/** The copy of the chunk written to \c Fetcher::cache, or \c NULL */
+	FILE *copy;
+	/** The temporary name of \c copy, until the chunk is complete */
+	char copyname[CACHE_MAX_PATH];
+	/** Whether \c copyname holds a whole spilled chunk, to be handed over by
+	 *  \c SMTH_openchunk and stored only once it parses */
+	bool copied;
+	/** The chunk found in \c Fetcher::cache, which makes the slot spilled,
+	 *  until it is handed over by \c SMTH_openchunk */
+	FILE *hit;
+	/** The chunk found already parsed in memory, until it is handed over by
+	 *  \c SMTH_sharedchunk */
+	const SMTH_fragment *shared;
+	/** Whether the server ignored a \c Range request for the chunk */
+	bool norange;
+	/** The number of failed attempts */
+	count_t attempts;
+	/** The times an announced chunk was not published yet */
+	count_t waits;
+	/** When a \c TRANSFER_WAITING slot is to be retried (\c CLOCK_MONOTONIC) */
+	struct timespec retryat;
+	/** The bitrate of the \c Track being downloaded */
+	bitrate_t bitrate;
+	/** Measures the running attempt, for \c Fetcher::estimator */
+	Measure measure;
+	/** Index of the downloaded \c Chunk in \c Stream::chunks */
+	count_t index;
+	/** Where the transfer is at */
+	TransferState state;
+	/** The fetcher owning the slot, or \c NULL for a \c Manifest */
+	struct Fetcher *fetcher;
+	/** Opaque data of the \c Manifest requester */
+	void *userdata;
+} Transfer;
+
+/** \brief Holds the Curl multi handle and fetcher metadata. */
+typedef struct Fetcher
+{
+	/** Handle to the active curl multi downloader. */
+	CURLM *handle;
+	/** Whether \c Fetcher::handle was created by the fetcher itself, or
+	 *  it is shared with other fetchers (and driven by someone else) */
+	bool ownhandle;
+	/** Tracks the sockets of \c Fetcher::handle, when it is owned */
+	Poller poller;
+	/** Opaque data of the fetcher user */
+	void *userdata;
+	/** Handle to the active \c Stream */
+	Stream *stream;
+	/** Maximal stream bitrate. 0 = unlimited */
+	bitrate_t maxbitrate;
+	/** Pointer to the next \c Chunk to handle */
+	Chunk *nextchunk;
+	/** Index of the next \c Chunk to be requested */
+	count_t chunk_no;
+	/** The url of the Manifest, with a trailing slash: chunk urls are built
+	 *  appending \c Stream::urltokens to it */
+	url_t *baseurl;
+	/** The length of \c baseurl */
+	length_t baselength;
+	/** Holds the url of the last chunk requested, grown as needed */
+	url_t *urlbuffer;
+	/** The allocated size of \c urlbuffer */
+	length_t urlbuffersize;
+	/** The local path to the cache directory, created on the first spill */
+	chardata *cachedir;
+	/** Whether chunks are downloaded to the cache directory, instead of
+	 *  memory. It must be accessed atomically. */
+	bool spill;
+	/** Keeps the chunks downloaded across handles and processes, or \c NULL.
+	 *  \sa SMTH_setcache */
+	Cache *cache;
+	/** The copy of the last spilled chunk opened, until \c SMTH_keepchunk
+	 *  stores it in \c cache or throws it away */
+	char pending[CACHE_MAX_PATH];
+	/** The key of \c pending, 0 when there is none */
+	cachekey_t pendingkey;
+	/** The size of \c pending */
+	length_t pendingsize;
+	/** Estimates the throughput from the chunks downloaded */
+	Estimator estimator;
+	/** Chooses the bitrate of each chunk, or \c NULL for the default one.
+	 *  It must be accessed atomically. */
+	const SMTH_abr *abr;
+	/** The bitrate chosen for the last chunk, 0 if none was */
+	bitrate_t lastbitrate;
+	/** Ticks per second of the \c Chunk times, 0 if unknown. Set by the
+	 *  owner of the fetcher. */
+	tick_t timescale;
+	/** Media ticks downloaded ahead of the reader, \sa SMTH_setbuffer.
+	 *  It must be accessed atomically. */
+	tick_t buffered;
+	/** Chunks the reader lets be downloaded ahead, 0 if unbounded.
+	 *  It must be accessed atomically. */
+	count_t window;
+	/** Whether \c buffered is kept by the owner of the fetcher.
+	 *  It must be accessed atomically. */
+	bool buffertracked;
+	/** Download slots, each one holding at most a \c Chunk */
+	Transfer transfers[FETCHER_MAX_TRANSFERS];
+	/** The simultaneous transfers requested, or \c FETCHER_ADAPTIVE_TRANSFERS
+	 *  It must be accessed atomically. */
+	count_t maxtransfers;
+	/** The simultaneous transfers chosen in adaptive mode */
+	count_t transfersno;
+	/** Moving average of the share of a download spent waiting for its first
+	 *  byte: near 1 when latency bound, near 0 when bandwidth bound */
+	double latency;
+	/** Set by \c SMTH_interruptfetcher to stop a blocking wait.
+	 *  It must be accessed atomically. */
+	bool interrupted;
+
+} Fetcher;
+
 #if 0
 /** \brief Holds metadata for fetched streams */
 typedef struct
@@ -75,8 +276,40 @@ typedef struct
 } FetchedStream
 #endif
 
+bool SMTH_startcurl(void);
+
 char* SMTH_fetch(const char *url, Stream *stream, bitrate_t maxbitrate);
-FILE* SMTH_fetchmanifest(const char *url, const char *params);
+error_t SMTH_fetchmanifest(const char *url, const char *params, Manifest *m,
+	ManifestUpdate *update);
+void SMTH_disposeupdate(ManifestUpdate *update);
+
+error_t SMTH_initfetcher(Fetcher *f, const char *url, Stream *stream,
+	bitrate_t maxbitrate, CURLM *multi);
+error_t SMTH_fetchchunk(Fetcher *f, count_t index);
+error_t SMTH_fetchprogress(Fetcher *f, count_t index, signedlength_t seen);
+error_t SMTH_pollchunk(Fetcher *f, count_t index);
+FILE* SMTH_openchunk(Fetcher *f, count_t index);
+void SMTH_keepchunk(Fetcher *f, bool parsed);
+const SMTH_fragment *SMTH_sharedchunk(Fetcher *f, count_t index);
+cachekey_t SMTH_chunkkey(Fetcher *f, count_t index);
+FragmentParser *SMTH_chunkparser(Fetcher *f, count_t index);
+void SMTH_closechunk(Fetcher *f, count_t index);
+void SMTH_interruptfetcher(Fetcher *f);
+void SMTH_resumefetcher(Fetcher *f);
+void SMTH_settransfers(Fetcher *f, count_t transfers);
+void SMTH_setspill(Fetcher *f, bool spill);
+void SMTH_setcache(Fetcher *f, Cache *cache);
+void SMTH_setabr(Fetcher *f, const SMTH_abr *abr);
+void SMTH_setbuffer(Fetcher *f, tick_t buffered, count_t window);
+long SMTH_fetcherdelay(Fetcher *f);
+void SMTH_disposefetcher(Fetcher *f);
+
+Transfer *SMTH_endtransfer(CURLM *multi, CURLMsg *msg);
+
+error_t SMTH_startmanifest(Transfer *t, CURLM *multi, const char *url,
+	const char *params, Manifest *m, ManifestUpdate *update);
+error_t SMTH_takemanifest(Transfer *t);
+void SMTH_abortmanifest(Transfer *t, CURLM *multi);
 
 #endif /* __SMTH_HTTP_H__ */
 
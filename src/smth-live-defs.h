@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-live-defs.h : live manifest refresher (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_LIVE_DEFS_H__
+#define __SMTH_LIVE_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-live-defs.h
+ * \brief  Live manifest refresher (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <pthread.h>
+#include <smth-live.h>
+
+/** The delay between two refreshes, until a fragment duration is known,
+ *  in ms */
+#define LIVE_DEFAULT_INTERVAL  2000L
+/** The shortest delay between two refreshes, in ms */
+#define LIVE_MIN_INTERVAL       500L
+/** The longest delay between two refreshes, in ms */
+#define LIVE_MAX_INTERVAL     10000L
+/** The ticks per second of \c Chunk times, unless otherwise known */
+#define LIVE_DEFAULT_TIMESCALE 10000000
+
+static void *refresh(void *data);
+static bool handout(Handle *h, Manifest *m);
+static long chunkinterval(Handle *h, count_t stream, const Chunk *chunk);
+static void schedule(Refresher *r);
+static long untildue(const struct timespec *due);
+static tick_t timelineend(const Stream *stream);
+
+#endif /* __SMTH_LIVE_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
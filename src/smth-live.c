@@ -0,0 +1,484 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-live.c : live manifest refresher
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-live.c
+ * \brief  Live manifest refresher.
+ * \author Stefano Sanfilippo
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <smth-live-defs.h>
+
+/**
+ * \brief Starts refreshing the Manifest of a live handle, once its streams
+ *        were opened. Nothing is done for on-demand presentations.
+ *
+ * A synchronous handle gets its own refresher thread. An asynchronous one is
+ * refreshed by the thread driving \c Handle::multi \sa SMTH_refreshhandle
+ *
+ * \param h The handle, whose \c Handle::url is set.
+ * \return  FETCHER_SUCCESS, SMTH_NO_MEMORY or LIVE_NO_REFRESHER
+ */
+error_t SMTH_startrefresher(Handle *h)
+{
+	Refresher *r = &h->refresher;
+	pthread_condattr_t attr;
+	count_t i;
+
+	if (!h->manifest.islive || !h->url) return FETCHER_SUCCESS;
+
+	r->update.known = calloc(h->streamsno, sizeof (tick_t));
+	if (!r->update.known) return SMTH_NO_MEMORY;
+	r->update.knownno = h->streamsno;
+
+	/* the workers are running, and grow the timeline under their lock */
+	for (i = 0; i < h->streamsno; ++i)
+	{
+		Stream *stream = h->manifest.streams[i];
+		StreamHandle *s = h->streams[i];
+		long interval = 0;
+
+		pthread_mutex_lock(&s->lock);
+		if (stream->chunksno)
+		{   Chunk *last = stream->chunks[stream->chunksno - 1];
+			r->update.known[i] = last->time + last->duration;
+			interval = chunkinterval(h, i, last);
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		if (interval && (!r->interval || interval < r->interval))
+			r->interval = interval;
+	}
+
+	schedule(r);
+
+	if (h->multi) return FETCHER_SUCCESS; /* its driver will refresh it */
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (pthread_create(&r->thread, NULL, refresh, h))
+	{   pthread_cond_destroy(&r->wake);
+		pthread_mutex_destroy(&r->lock);
+		r->scheduled = false;
+		return LIVE_NO_REFRESHER;
+	}
+	r->running = true;
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Stops refreshing the Manifest of a handle, and disposes of what the
+ *        refresher holds.
+ *
+ * A refresh in flight on the \c Handle::multi of an asynchronous handle must
+ * have been aborted already \sa SMTH_stophandle
+ *
+ * \param h The handle.
+ */
+void SMTH_stoprefresher(Handle *h)
+{
+	Refresher *r = &h->refresher;
+
+	if (r->running)
+	{
+		pthread_mutex_lock(&r->lock);
+		r->quit = true;
+		__atomic_store_n(&r->update.cancelled, true, __ATOMIC_RELAXED);
+		pthread_cond_signal(&r->wake);
+		pthread_mutex_unlock(&r->lock);
+
+		pthread_join(r->thread, NULL);
+		pthread_cond_destroy(&r->wake);
+		pthread_mutex_destroy(&r->lock);
+		r->running = false;
+	}
+
+	r->scheduled = false;
+	SMTH_disposemanifest(&r->manifest);
+	SMTH_disposeupdate(&r->update);
+}
+
+/**
+ * \brief Tells how long until the Manifest of an asynchronous handle is to be
+ *        refreshed.
+ *
+ * \param h The handle.
+ * \return  The delay in ms, or -1 if no refresh is scheduled.
+ */
+long SMTH_refreshdelay(Handle *h)
+{
+	Refresher *r = &h->refresher;
+
+	if (!h->multi || !r->scheduled) return -1;
+
+	return untildue(&r->due);
+}
+
+/**
+ * \brief Starts refreshing the Manifest of an asynchronous handle on its
+ *        \c Handle::manifestload slot, if it is time to.
+ *
+ * To be called by the thread driving \c Handle::multi only. When the transfer
+ * is over, it is to be completed with \c SMTH_refreshed.
+ *
+ * \param h The handle.
+ * \return  FETCHER_SUCCESS or an error code from \c SMTH_startmanifest: the
+ *          refresh is then tried again later.
+ */
+error_t SMTH_refreshhandle(Handle *h)
+{
+	Refresher *r = &h->refresher;
+	error_t error;
+
+	if (SMTH_refreshdelay(h) || h->closing) return FETCHER_SUCCESS;
+
+	r->scheduled = false;
+	h->manifestload.userdata = h;
+
+	error = SMTH_startmanifest(&h->manifestload, h->multi, h->url, h->params,
+		&r->manifest, &r->update);
+	if (error) schedule(r);
+
+	return error;
+}
+
+/**
+ * \brief Completes a refresh started by \c SMTH_refreshhandle, handing the new
+ *        chunks over to the streams, and schedules the next one.
+ *
+ * A failed refresh is reported, and tried again later: what is known of the
+ * presentation is still valid.
+ *
+ * \param h The handle whose Manifest was downloaded.
+ */
+void SMTH_refreshed(Handle *h)
+{
+	Refresher *r = &h->refresher;
+	bool live = true;
+
+	error_t error = SMTH_takemanifest(&h->manifestload);
+
+	if (!error)
+	{   live = handout(h, &r->manifest);
+		SMTH_disposemanifest(&r->manifest);
+		memset(&r->manifest, 0x00, sizeof (Manifest));
+	}
+	else if (error != FETCHER_NOT_MODIFIED) SMTH_error(error, stderr);
+
+	if (live) schedule(r);
+}
+
+/**
+ * \brief Appends to the timeline of a stream the chunks handed over by the
+ *        refresher.
+ *
+ * To be called by the reader of \c Stream::chunks only: the worker of a
+ * synchronous stream, holding \c StreamHandle::lock, or the thread driving
+ * \c Handle::multi for an asynchronous one.
+ *
+ * \param s The stream.
+ * \return  FETCHER_SUCCESS or MANIFEST_NO_MEMORY: the chunks are then kept,
+ *          to be taken later.
+ */
+error_t SMTH_takechunks(StreamHandle *s)
+{
+	Stream *stream = s->owner->manifest.streams[s->number];
+	error_t error;
+
+	Chunk **fresh = (Chunk**) s->fresh.list;
+	tick_t end = timelineend(stream);
+	count_t i, skip = 0;
+
+	if (!s->fresh.index) return FETCHER_SUCCESS;
+
+	/* chunks announced by the fragments themselves are known already */
+	while (skip < s->fresh.index && fresh[skip]->time < end) ++skip;
+
+	error = SMTH_appendchunks(stream, &fresh[skip], s->fresh.index - skip);
+	if (error) return error;
+
+	for (i = 0; i < skip; ++i) SMTH_disposechunk(fresh[i]);
+	s->fresh.index = 0; /* the list is reused by the next refresh */
+
+	return FETCHER_SUCCESS;
+}
+
+/**
+ * \brief Appends to the timeline of a live stream the chunks announced by the
+ *        TfrfBox of one of its fragments, so that they may be requested
+ *        without waiting for the Manifest to be refreshed.
+ *
+ * Once fragments are seen to announce those following them, the Manifest is
+ * refreshed at the slowest pace, only to learn when the presentation is over.
+ * Announced chunks are not duplicated by a later refresh \sa SMTH_takechunks
+ *
+ * To be called by the reader of \c Stream::chunks only, as \c SMTH_takechunks
+ *
+ * \param s The stream the fragment belongs to.
+ * \param f The fragment, whose metadata was parsed.
+ * \return  FETCHER_SUCCESS or SMTH_NO_MEMORY: the chunks are then left to
+ *          the refresher.
+ */
+error_t SMTH_lookahead(StreamHandle *s, const Fragment *f)
+{
+	Stream *stream = s->owner->manifest.streams[s->number];
+	tick_t end = timelineend(stream);
+	Chunk **announced;
+	count_t i, announcedno = 0;
+	error_t error;
+
+	if (!s->live || !f->lookaheadno) return FETCHER_SUCCESS;
+
+	announced = malloc(f->lookaheadno * sizeof (Chunk*));
+	if (!announced) return SMTH_NO_MEMORY;
+
+	for (i = 0; i < f->lookaheadno; ++i)
+	{
+		const Lookahead *next = &f->lookahead[i];
+		if (next->time < end || !next->duration) continue;
+
+		Chunk *chunk = calloc(1, sizeof (Chunk));
+		if (!chunk) break;
+		chunk->index = stream->chunksno + announcedno;
+		chunk->time = next->time;
+		chunk->duration = next->duration;
+		chunk->announced = true;
+
+		announced[announcedno++] = chunk;
+		end = next->time + next->duration;
+	}
+
+	error = i < f->lookaheadno? SMTH_NO_MEMORY:
+		SMTH_appendchunks(stream, announced, announcedno);
+	if (error)
+	{   for (i = 0; i < announcedno; ++i) SMTH_disposechunk(announced[i]);
+		announcedno = 0;
+	}
+	free(announced);
+
+	if (announcedno)
+		__atomic_store_n(&s->owner->refresher.lookahead, true, __ATOMIC_RELAXED);
+
+	return error == MANIFEST_NO_MEMORY? SMTH_NO_MEMORY: error;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief The refresher thread of a synchronous handle: downloads the Manifest
+ *        on schedule, until the presentation is over or the handle is closed.
+ *
+ * \param data The \c Handle to be refreshed.
+ */
+static void *refresh(void *data)
+{
+	Handle *h = data;
+	Refresher *r = &h->refresher;
+	Manifest m;
+	error_t error;
+	bool live = true;
+
+	pthread_mutex_lock(&r->lock);
+
+	while (!r->quit && live)
+	{
+		if (untildue(&r->due))
+		{   pthread_cond_timedwait(&r->wake, &r->lock, &r->due);
+			continue;
+		}
+
+		/* network and parsing happen out of the lock */
+		pthread_mutex_unlock(&r->lock);
+
+		error = SMTH_fetchmanifest(h->url, h->params, &m, &r->update);
+		if (!error)
+		{   live = handout(h, &m);
+			SMTH_disposemanifest(&m);
+		}
+		else if (error != FETCHER_NOT_MODIFIED && error != FETCHER_INTERRUPTED)
+			SMTH_error(error, stderr);
+
+		pthread_mutex_lock(&r->lock);
+		schedule(r);
+	}
+
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+/**
+ * \brief Hands the new chunks of a refreshed Manifest over to the streams,
+ *        and keeps track of the timeline known.
+ *
+ * Streams are matched by their order: a stream whose type changed is left
+ * alone. If the presentation is over, the streams are told that they will not
+ * grow anymore.
+ *
+ * \param h The handle.
+ * \param m The refreshed Manifest, holding only the new chunks. Those handed
+ *          over are taken out of it.
+ * \return  \c false if the presentation is over, \c true otherwise.
+ */
+static bool handout(Handle *h, Manifest *m)
+{
+	Refresher *r = &h->refresher;
+	long interval, shortest = 0;
+	count_t i, j;
+
+	for (i = 0; i < h->streamsno && m->streams && m->streams[i]; ++i)
+	{
+		Stream *known = h->manifest.streams[i];
+		Stream *update = m->streams[i];
+		StreamHandle *s = h->streams[i];
+
+		if (update->type != known->type || !known->urltokens) continue;
+		if (!update->chunksno) continue;
+
+		pthread_mutex_lock(&s->lock);
+		for (j = 0; j < update->chunksno; ++j)
+			if (!SMTH_addtolist(update->chunks[j], &s->fresh)) break;
+		/* once handed over, the chunks may be disposed of by the reader */
+		Chunk *last = j? update->chunks[j - 1]: NULL;
+		tick_t end = last? last->time + last->duration: 0;
+		interval = last? chunkinterval(h, i, last): 0;
+		s->starved = false;
+		pthread_cond_signal(&s->drained);
+		pthread_mutex_unlock(&s->lock);
+
+		if (!j) continue;
+
+		r->update.known[i] = end;
+		if (interval && (!shortest || interval < shortest)) shortest = interval;
+
+		/* what was not handed over is disposed of with the update */
+		memmove(update->chunks, &update->chunks[j],
+			(update->chunksno - j + 1) * sizeof (Chunk*));
+		update->chunksno -= j;
+	}
+
+	if (shortest) r->interval = shortest;
+
+	if (m->islive) return true;
+
+	/* the presentation is over: streams end with what they have */
+	for (i = 0; i < h->streamsno; ++i)
+	{
+		StreamHandle *s = h->streams[i];
+
+		pthread_mutex_lock(&s->lock);
+		s->live = false;
+		s->starved = false;
+		pthread_cond_signal(&s->drained);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return false;
+}
+
+/**
+ * \brief Tells how long a \c Chunk lasts, which is how often new ones appear.
+ *
+ * \param h      The handle.
+ * \param stream The index of the stream of the chunk.
+ * \param chunk  The chunk.
+ * \return       The duration in ms, or 0 if it is unknown.
+ */
+static long chunkinterval(Handle *h, count_t stream, const Chunk *chunk)
+{
+	tick_t timescale = h->manifest.streams[stream]->tick;
+
+	if (!timescale) timescale = h->manifest.tick;
+	if (!timescale) timescale = LIVE_DEFAULT_TIMESCALE;
+
+	return (long) (chunk->duration * 1000 / timescale);
+}
+
+/**
+ * \brief Schedules the next refresh, \c Refresher::interval from now.
+ *
+ * \param r The refresher.
+ */
+static void schedule(Refresher *r)
+{
+	long delay = r->interval? r->interval: LIVE_DEFAULT_INTERVAL;
+
+	if (delay < LIVE_MIN_INTERVAL) delay = LIVE_MIN_INTERVAL;
+	if (delay > LIVE_MAX_INTERVAL) delay = LIVE_MAX_INTERVAL;
+	/* the fragments tell the timeline: only the end is to be learnt */
+	if (__atomic_load_n(&r->lookahead, __ATOMIC_RELAXED))
+		delay = LIVE_MAX_INTERVAL;
+
+	clock_gettime(CLOCK_MONOTONIC, &r->due);
+	r->due.tv_sec += delay / 1000;
+	r->due.tv_nsec += (delay % 1000) * 1000000L;
+	if (r->due.tv_nsec >= 1000000000L)
+	{   r->due.tv_sec++;
+		r->due.tv_nsec -= 1000000000L;
+	}
+
+	r->scheduled = true;
+}
+
+/**
+ * \brief Tells how long until a given time.
+ *
+ * \param due The time, on \c CLOCK_MONOTONIC
+ * \return    The time left, in ms rounded up, or 0 if it has come.
+ */
+static long untildue(const struct timespec *due)
+{
+	struct timespec now;
+	long long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (due->tv_sec - now.tv_sec) * 1000000000LL +
+		(due->tv_nsec - now.tv_nsec);
+
+	return left > 0? (long) ((left + 999999) / 1000000): 0;
+}
+
+/**
+ * \brief Tells where the timeline of a stream ends.
+ *
+ * \param stream The stream.
+ * \return       The end of its last \c Chunk, in its ticks, or 0 if it has
+ *               none.
+ */
+static tick_t timelineend(const Stream *stream)
+{
+	if (!stream->chunksno) return 0;
+
+	const Chunk *last = stream->chunks[stream->chunksno - 1];
+
+	return last->time + last->duration;
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
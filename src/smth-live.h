@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-live.h : live manifest refresher (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_LIVE_H__
+#define __SMTH_LIVE_H__
+
+/**
+ * \internal
+ * \file   smth-live.h
+ * \brief  Live manifest refresher (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-common-defs.h>
+#include <smth-defs.h>
+#include <smth-fragment-parser.h>
+
+/** Could not start the refresher of a live handle */
+#define LIVE_NO_REFRESHER (-49)
+
+error_t SMTH_startrefresher(Handle *h);
+void SMTH_stoprefresher(Handle *h);
+long SMTH_refreshdelay(Handle *h);
+error_t SMTH_refreshhandle(Handle *h);
+void SMTH_refreshed(Handle *h);
+error_t SMTH_takechunks(StreamHandle *s);
+error_t SMTH_lookahead(StreamHandle *s, const Fragment *f);
+
+#endif /* __SMTH_LIVE_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
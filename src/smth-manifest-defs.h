@@ -34,7 +34,7 @@
 #include <smth-dynlist.h>
 
 /** \brief Holds data and metadata for the Manifest parser. */
-typedef struct
+typedef struct ManifestBox
 {	/** Handle of the active XML parser (for start/stop). */
 	XML_Parser parser;
 	/** The manifest to be filled with parsed data. */
@@ -48,6 +48,16 @@ typedef struct
 	tick_t previousduration;
 	/** The timestamp of the previous chunk in the active stream. */
 	tick_t previoustime;
+	/** The end of the timeline already known of each stream, in order: chunks
+	 *  starting before it are skipped \sa SMTH_initmanifestparser */
+	const tick_t *known;
+	/** The number of streams in \c known */
+	count_t knownno;
+	/** The end of the known timeline of the active stream, 0 if none is */
+	tick_t knownend;
+	/** Whether the active chunk is already known, and skipped with its
+	 *  children. */
+	bool skipping;
 	/** Pointer to the active \c Stream. */
 	Stream *activestream;
 	/** Pointer to the active \c Track. */
@@ -118,6 +128,15 @@ typedef struct
 	#define	MANIFEST_STREAM_DISPLAY_WIDTH   "DisplayWidth"
 	/**	The xml attribute name for StreamElement::DisplayHeight	*/
 	#define	MANIFEST_STREAM_DISPLAY_HEIGHT  "DisplayHeight"
+
+/** The placeholders of \c Stream::url, and what they stand for */
+#define MANIFEST_URL_PLACEHOLDERS { \
+	{ "{bitrate}",          URL_BITRATE           }, \
+	{ "{Bitrate}",          URL_BITRATE           }, \
+	{ "{start time}",       URL_START_TIME        }, \
+	{ "{start_time}",       URL_START_TIME        }, \
+	{ "{CustomAttributes}", URL_CUSTOM_ATTRIBUTES }, \
+	{ NULL,                 URL_END               }  }
 	/**	The xml attribute name for StreamElement::ParentStream	*/
 	#define	MANIFEST_STREAM_PARENT			"ParentStreamIndex"
 	/**	The xml attribute name for StreamElement::ManifestOutput */
@@ -188,7 +207,11 @@ typedef struct
 static bool stringissane(const char* s);
 
 static void disposevendorattrs(chardata **vendorattrs);
+static UrlToken *parseurl(const chardata *url);
+static void closeblocks(ManifestBox *mb);
+static void closeblock(ManifestBox *mb, const char *el);
 static bool addvendorattrs(DynList *vendordata, const char **attr);
+static error_t droptrack(Track *tmp, DynList *vendordata, error_t error);
  
 static void inline disposeembedded(EmbeddedData *ed);
 
@@ -30,6 +30,7 @@
 #include <expat.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <smth-manifest-defs.h>
 
 /** \brief Converts a string into a 32bit integer. */
@@ -72,42 +73,149 @@ static bool stringissane(const char* s)
 error_t SMTH_parsemanifest(Manifest *m, FILE *stream)
 {
 	chardata chunk[MANIFEST_XML_BUFFER_SIZE];
-	ManifestBox root;
+	ManifestParser p;
 	error_t result;
 
-	memset(&root, 0x00, sizeof(ManifestBox)); /* reset memory */
-	root.m = m;
-	root.state = MANIFEST_SUCCESS;
+	if (feof(stream))
+	{   memset(m, 0x00, sizeof (Manifest));
+		return MANIFEST_EMPTY;
+	}
+
+	result = SMTH_initmanifestparser(&p, m, NULL, 0);
+	if (result) return result;
 
-	bool done = false;
+	while (!result && !feof(stream))
+	{
+		length_t len;
+		len = (length_t) fread(chunk, sizeof(byte_t), sizeof(chunk), stream);
 
+		if (ferror(stream)) result = MANIFEST_IO_ERROR;
+		else result = SMTH_feedmanifest(&p, chunk, len);
+	}
+
+	if (!result) result = SMTH_endmanifest(&p);
+
+	SMTH_disposemanifestparser(&p);
+	return result;
+}
+
+/**
+ * \brief Prepares a parser to fill a Manifest struct, a piece at a time.
+ *
+ * When a live Manifest is refreshed, the chunks already known are skipped
+ * without being allocated, so that each \c Stream::chunks of \c m only holds
+ * the new ones, to be merged with \c SMTH_appendchunks.
+ *
+ * \param p       Pointer to the parser to be initialised.
+ * \param m       Pointer to the manifest struct to be filled.
+ * \param known   The end of the timeline already known of each stream, in
+ *                order and in its ticks, or \c NULL if nothing is known.
+ * \param knownno The number of streams in \c known
+ * \return        MANIFEST_SUCCESS or MANIFEST_NO_MEMORY.
+ */
+error_t SMTH_initmanifestparser(ManifestParser *p, Manifest *m,
+	const tick_t *known, count_t knownno)
+{
+	memset(p, 0x00, sizeof (ManifestParser));
 	memset(m, 0x00, sizeof (Manifest)); /* reset memory */
 
-	if (feof(stream)) return MANIFEST_EMPTY;
+	ManifestBox *root = calloc(1, sizeof (ManifestBox));
+	if (!root) return MANIFEST_NO_MEMORY;
+
+	root->m = m;
+	root->state = MANIFEST_SUCCESS;
+	root->known = known;
+	root->knownno = known? knownno: 0;
 
 	XML_Parser parser = XML_ParserCreate(NULL);
-	if (!parser) return MANIFEST_NO_MEMORY;
+	if (!parser)
+	{   free(root);
+		return MANIFEST_NO_MEMORY;
+	}
 	XML_SetElementHandler(parser, startblock, endblock);
 	XML_SetCharacterDataHandler(parser, textblock);
-	XML_SetUserData(parser, &root);
+	XML_SetUserData(parser, root);
 
-	root.parser = parser;
+	root->parser = parser;
+	p->box = root;
+	p->manifest = m;
 
-	while (!done)
-	{
-		length_t len;
-		len = (length_t) fread(chunk, sizeof(byte_t), sizeof(chunk), stream);
-		done = feof(stream);
+	return MANIFEST_SUCCESS;
+}
 
-		if (ferror(stdin))
-		{   result = MANIFEST_IO_ERROR;
-			done = true;
-		}
-		(void) XML_Parse(parser, chunk, len, done);
+/**
+ * \brief Parses the next piece of a Manifest.
+ *
+ * \param p    The parser.
+ * \param data The next bytes of the Manifest.
+ * \param size The number of bytes in \c data.
+ * \return     MANIFEST_SUCCESS, or an appropriate error code: the parse is
+ *             then over, and only \c SMTH_disposemanifestparser may be called.
+ */
+error_t SMTH_feedmanifest(ManifestParser *p, const char *data, length_t size)
+{
+	ManifestBox *root = p->box;
+
+	if (root->state) return root->state;
+	if (!size) return MANIFEST_SUCCESS;
+
+	p->fed = true;
+
+	if (XML_Parse(root->parser, data, size, false) == XML_STATUS_ERROR &&
+		!root->state)
+	{   root->state = MANIFEST_PARSE_ERROR;
+	}
+
+	return p->error = root->state;
+}
+
+/**
+ * \brief Tells the parser that the Manifest is over.
+ *
+ * \param p The parser.
+ * \return  MANIFEST_SUCCESS if the Manifest was filled, or an appropriate error
+ *          code.
+ */
+error_t SMTH_endmanifest(ManifestParser *p)
+{
+	ManifestBox *root = p->box;
+
+	if (root->state) return root->state;
+	if (!p->fed) return p->error = root->state = MANIFEST_EMPTY;
+
+	if (XML_Parse(root->parser, NULL, 0, true) == XML_STATUS_ERROR &&
+		!root->state)
+	{   root->state = MANIFEST_PARSE_ERROR;
 	}
 
-	XML_ParserFree(parser);
-	return root.state;
+	p->parsed = !root->state;
+	return p->error = root->state;
+}
+
+/**
+ * \brief Disposes of a Manifest parser.
+ *
+ * If the Manifest was not parsed up to its end, what was parsed so far is
+ * disposed of, and the Manifest struct is zeroed.
+ *
+ * \param p The parser to be disposed of. It may be disposed of twice.
+ */
+void SMTH_disposemanifestparser(ManifestParser *p)
+{
+	ManifestBox *root = p->box;
+
+	if (!root) return;
+
+	if (!p->parsed)
+	{   /* an aborted or failed parse leaves its blocks open */
+		closeblocks(root);
+		SMTH_disposemanifest(root->m);
+		memset(root->m, 0x00, sizeof (Manifest));
+	}
+
+	XML_ParserFree(root->parser);
+	free(root);
+	p->box = NULL;
 }
 
 /**
@@ -123,6 +231,17 @@ void SMTH_disposemanifest(Manifest* m)
 {   
 	if (!m) return;
 
+	if (m->image)
+	{   /* everything lies in the image */
+		munmap(m->image, m->imagesize);
+		m->image = NULL;
+		m->imagesize = 0;
+		m->armor = NULL;
+		m->streams = (Stream**) NULL;
+		m->vendorattrs = (chardata**) NULL;
+		return;
+	}
+
 	if (m->armor)
 	{   disposeembedded(m->armor);
 		free(m->armor);
@@ -156,24 +275,12 @@ void SMTH_disposemanifest(Manifest* m)
 			if (tmpstream->chunks)
 			{	count_t j;
 				for (j = 0; tmpstream->chunks[j]; j++)
-				{   Chunk *tmpchunk = tmpstream->chunks[j];
-					count_t n;
-					if (tmpchunk->fragments)
-					{	for (n = 0; tmpchunk->fragments[n]; n++)
-						{   ChunkIndex *tmpfragment = tmpchunk->fragments[n];
-							if (tmpfragment->embedded)
-								disposeembedded(tmpfragment->embedded);
-							disposevendorattrs(tmpfragment->vendorattrs);
-							free(tmpfragment);
-						}
-						free(tmpchunk->fragments);
-					}
-					free(tmpchunk);
-				}
+					SMTH_disposechunk(tmpstream->chunks[j]);
 				free(tmpstream->chunks);
 			}
 			disposevendorattrs(tmpstream->vendorattrs);
 			free(tmpstream->url);
+			free(tmpstream->urltokens);
 			free(tmpstream);
 		}
 		free(m->streams);
@@ -186,8 +293,140 @@ void SMTH_disposemanifest(Manifest* m)
 	m->vendorattrs = (chardata**) NULL;
 }
 
+/**
+ * \brief Appends new chunks to the timeline of a \c Stream, as parsed from a
+ *        refreshed live Manifest.
+ *
+ * The chunks already in the stream are left where they are, and the array of
+ * pointers grows geometrically, so that frequent refreshes of a long timeline
+ * cost no more than the chunks they add.
+ *
+ * \param s        The stream to be grown.
+ * \param chunks   The chunks to be appended, following the last one of the
+ *                 stream. They are owned by the stream afterwards.
+ * \param chunksno The number of \c chunks
+ * \return         MANIFEST_SUCCESS or MANIFEST_NO_MEMORY: the stream is then
+ *                 left untouched.
+ */
+error_t SMTH_appendchunks(Stream *s, Chunk **chunks, count_t chunksno)
+{
+	count_t needed = s->chunksno + chunksno + 1; /* including the NULL sigil */
+	count_t slots = s->chunksslots? s->chunksslots: s->chunksno + 1;
+
+	if (!chunksno) return MANIFEST_SUCCESS;
+
+	if (needed > slots)
+	{
+		slots = 2 * slots > needed? 2 * slots: needed;
+		Chunk **tmp = realloc(s->chunks, slots * sizeof (Chunk*));
+		if (!tmp) return MANIFEST_NO_MEMORY;
+		s->chunks = tmp;
+		s->chunksslots = slots;
+	}
+
+	memcpy(&s->chunks[s->chunksno], chunks, chunksno * sizeof (Chunk*));
+	s->chunksno += chunksno;
+	s->chunks[s->chunksno] = NULL;
+
+	return MANIFEST_SUCCESS;
+}
+
+/**
+ * \brief Disposes of a \c Chunk and of its fragment indexes.
+ *
+ * \param chunk The chunk to be destroyed.
+ */
+void SMTH_disposechunk(Chunk *chunk)
+{
+	count_t n;
+
+	if (chunk->fragments)
+	{	for (n = 0; chunk->fragments[n]; n++)
+		{   ChunkIndex *tmpfragment = chunk->fragments[n];
+			if (tmpfragment->embedded)
+				disposeembedded(tmpfragment->embedded);
+			disposevendorattrs(tmpfragment->vendorattrs);
+			free(tmpfragment);
+		}
+		free(chunk->fragments);
+	}
+	free(chunk);
+}
+
 /*--------------------- HIC QUOQUE SUNT LEONES (CODICIS) ---------------------*/
 
+/**
+ * \brief     Splits a \c Stream::url pattern at its placeholders, so that
+ *            fragment urls are built without searching it again.
+ *
+ * Unknown placeholders are left in the literal text.
+ *
+ * \param url The pattern. The tokens point into it.
+ * \return    A \c malloc'd array of tokens, terminated by an \c URL_END one,
+ *            or \c NULL if there was not memory enough.
+ */
+static UrlToken *parseurl(const chardata *url)
+{
+	static const struct { const char *text; UrlTokenType type; }
+		placeholders[] = MANIFEST_URL_PLACEHOLDERS;
+	const chardata *c, *literal = url;
+	count_t i, tokensno = 0;
+	UrlToken *tokens;
+
+	/* at most a literal before each placeholder, one after and the sigil */
+	for (c = url; *c; ++c) if (*c == '{') tokensno++;
+	tokens = malloc((2 * tokensno + 2) * sizeof (UrlToken));
+	if (!tokens) return NULL;
+
+	for (tokensno = 0, c = url; *c; ++c)
+	{
+		if (*c != '{') continue;
+
+		for (i = 0; placeholders[i].text; ++i)
+			if (!strncmp(c, placeholders[i].text, strlen(placeholders[i].text)))
+				break;
+		if (!placeholders[i].text) continue;
+
+		if (c > literal)
+		{   tokens[tokensno].type = URL_LITERAL;
+			tokens[tokensno].text = literal;
+			tokens[tokensno++].length = c - literal;
+		}
+		tokens[tokensno].type = placeholders[i].type;
+		tokens[tokensno].text = NULL;
+		tokens[tokensno++].length = 0;
+
+		c += strlen(placeholders[i].text) - 1;
+		literal = c + 1;
+	}
+
+	if (c > literal)
+	{   tokens[tokensno].type = URL_LITERAL;
+		tokens[tokensno].text = literal;
+		tokens[tokensno++].length = c - literal;
+	}
+	tokens[tokensno].type = URL_END;
+
+	return tokens;
+}
+
+/**
+ * \brief    Closes the blocks left open by an unfinished parse, so that what
+ *           was parsed so far is linked to the Manifest, and may be disposed
+ *           of with it.
+ *
+ * \param mb The state of the parser.
+ */
+static void closeblocks(ManifestBox *mb)
+{
+	if (mb->activefragment) closeblock(mb, MANIFEST_FRAGMENT_ELEMENT);
+	if (mb->activechunk) closeblock(mb, MANIFEST_CHUNK_ELEMENT);
+	if (mb->activetrack) closeblock(mb, MANIFEST_TRACK_ELEMENT);
+	if (mb->activestream) closeblock(mb, MANIFEST_STREAM_ELEMENT);
+	if (mb->tmpstreams.list && !mb->manifestparsed)
+		closeblock(mb, MANIFEST_ELEMENT);
+}
+
 /** \brief             Destroys a vendor data attrs sequence.
  *  \param vendorattrs The structure to be destroyed.
  */
@@ -212,6 +451,7 @@ static bool addvendorattrs(DynList *vendordata, const char **attr)
 	strcpy(value, attr[1]);
 	if (!SMTH_addtolist(key, vendordata) || !SMTH_addtolist(value, vendordata))
 	{   SMTH_disposelist(vendordata);
+		SMTH_preparelist(vendordata);
 		free(key);
 		free(value);
 		return false;
@@ -219,6 +459,22 @@ static bool addvendorattrs(DynList *vendordata, const char **attr)
 	return true;
 }
 
+/** \brief Frees a \c Track that could not be parsed.
+ *
+ *  \param tmp        The \c Track, not linked to the Manifest.
+ *  \param vendordata The vendor attributes gathered for it.
+ *  \param error      The parsing error.
+ *  \return           \c error
+ */
+static error_t droptrack(Track *tmp, DynList *vendordata, error_t error)
+{   count_t i;
+	for (i = 0; i < vendordata->index; i++) free((void*) vendordata->list[i]);
+	SMTH_disposelist(vendordata);
+	free(tmp->header);
+	free(tmp);
+	return error;
+}
+
 /** \brief Appropriately destroy an embedded content struct
  *
  *  \param ed Pointer to the \c EmbeddedData struct to free.
@@ -239,6 +495,7 @@ static void XMLCALL startblock(void *data, const char *el, const char **attr)
 
 	//fprintf(stderr, ">: %s\n", el); //DEBUG
 
+	if (mb->state != MANIFEST_SUCCESS) return; /* keep the first error */
 	if (mb->manifestparsed)
 	{   mb->state = MANIFEST_UNEXPECTED_TRAILING;
 		return;
@@ -256,6 +513,9 @@ static void XMLCALL startblock(void *data, const char *el, const char **attr)
 	{   SMTH_preparelist(&mb->tmpchunks);
 		SMTH_preparelist(&mb->tmptracks);
 		mb->previoustime = mb->previousduration = 0;
+		/* streams are matched by their order */
+		mb->knownend = mb->tmpstreams.index < mb->knownno?
+			mb->known[mb->tmpstreams.index]: 0;
 		mb->state = parsestream(mb, attr);
 		return;
 	}
@@ -274,7 +534,8 @@ static void XMLCALL startblock(void *data, const char *el, const char **attr)
 		return;
 	}
 	if (!strcmp(el, MANIFEST_FRAGMENT_ELEMENT))
-	{   mb->state = parsefragindex(mb, attr);
+	{   if (mb->skipping) return; /* it belongs to a known chunk */
+		mb->state = parsefragindex(mb, attr);
 		return;
 	}
 
@@ -288,11 +549,24 @@ static void XMLCALL endblock(void *data, const char *el)
 
 	//fprintf(stderr, "<: %s\n", el); //DEBUG
 
+	/* what was parsed is disposed of with the parser */
 	if (mb->state != MANIFEST_SUCCESS)
-	{   SMTH_disposemanifest(mb->m);
-		XML_StopParser(mb->parser, XML_FALSE);
+	{   XML_StopParser(mb->parser, XML_FALSE);
+		return;
 	}
 
+	closeblock(mb, el);
+}
+
+/**
+ * \brief    Links what was collected for a block to its parent, once the
+ *           block is over.
+ *
+ * \param mb The state of the parser.
+ * \param el The name of the block.
+ */
+static void closeblock(ManifestBox *mb, const char *el)
+{
 	if (!strcmp(el, MANIFEST_ELEMENT))
 	{	if(!SMTH_finalizelist(&mb->tmpstreams)) mb->state = MANIFEST_NO_MEMORY;
 		mb->m->streams = (Stream**) mb->tmpstreams.list;
@@ -306,8 +580,8 @@ static void XMLCALL endblock(void *data, const char *el)
 	{
 		if (!mb->activestream->tracksno)
 			mb->activestream->tracksno = mb->tmptracks.index;
-		if (!mb->activestream->chunksno)
-			mb->activestream->chunksno = mb->tmpchunks.index;
+		/* Chunks attribute is just a hint: the list must be authoritative */
+		mb->activestream->chunksno = mb->tmpchunks.index;
 		if (!SMTH_finalizelist(&mb->tmptracks)) mb->state = MANIFEST_NO_MEMORY;
 		if (!SMTH_finalizelist(&mb->tmpchunks)) mb->state = MANIFEST_NO_MEMORY;
 		mb->activestream->tracks = (Track**) mb->tmptracks.list;
@@ -323,13 +597,18 @@ static void XMLCALL endblock(void *data, const char *el)
 	}
 	//if (!strcmp(el, MANIFEST_ATTRS_ELEMENT)) not used.
 	if (!strcmp(el, MANIFEST_CHUNK_ELEMENT))
-	{   if(!SMTH_finalizelist(&mb->tmpfragments)) mb->state = MANIFEST_NO_MEMORY;
+	{   if (mb->skipping)
+		{   mb->skipping = false;
+			return;
+		}
+		if(!SMTH_finalizelist(&mb->tmpfragments)) mb->state = MANIFEST_NO_MEMORY;
 		mb->activechunk->fragments = (ChunkIndex**) mb->tmpfragments.list;
 		mb->activechunk = NULL;
 		return;
 	}
 	if (!strcmp(el, MANIFEST_FRAGMENT_ELEMENT))
-	{   if (mb->embedded)
+	{   if (mb->skipping) return;
+		if (mb->embedded)
 		{   mb->activefragment->embedded = mb->embedded;
 			mb->embedded = NULL;
 			mb->activefragment = NULL;
@@ -356,6 +635,8 @@ static void XMLCALL textblock(void *data, const char *text, int length)
 
 	//fwrite(sanetext, 1, sanelength, stderr); //DEBUG
 
+	if (mb->skipping) return; /* embedded data of a known chunk */
+
 	if (mb->activearmor)
 	{   mb->state = parsepayload(mb->activearmor, sanetext, sanelength);
 		return;
@@ -592,7 +873,15 @@ static error_t parsestream(ManifestBox *mb, const char **attr)
 				return MANIFEST_NO_MEMORY;
 			}
 			strcpy(tmppattern, attr[i+1]);
+			free(tmp->url);
+			free(tmp->urltokens);
 			tmp->url = tmppattern;
+			tmp->urltokens = parseurl(tmppattern);
+			if (!tmp->urltokens)
+			{   free(tmp->url);
+				free(tmp);
+				return MANIFEST_NO_MEMORY;
+			}
 		}
 		//TODO SubtypeControlEvents: Control events for applications on the client.
 		/* else */
@@ -637,7 +926,7 @@ static error_t parsetrack(ManifestBox *mb, const char **attr)
 
 	for (i = 0; attr[i]; i += 2)
 	{
-		if (!attr[i+1]) return MANIFEST_PARSER_ERROR;
+		if (!attr[i+1]) return droptrack(tmp, &vendordata, MANIFEST_PARSER_ERROR);
 
 		if (!strcmp(attr[i], MANIFEST_TRACK_INDEX))
 		{   tmp->index = (count_t) atoint32(attr[i+1]);
@@ -674,13 +963,14 @@ static error_t parsetrack(ManifestBox *mb, const char **attr)
 				continue;
 			}
 
-			if (strlen(attr[i+1]) != 0) return MANIFEST_MALFORMED_FOURCC;
+			if (strlen(attr[i+1]) != 0)
+				return droptrack(tmp, &vendordata, MANIFEST_MALFORMED_FOURCC);
 			/* else (not null, not 4 letters) keep it NULL */
 		}
 		if (!strcmp(attr[i], MANIFEST_TRACK_HEADER))
 		{	
 			tmp->header = malloc(strlen(attr[i+1]) + sizeof (chardata));
-			if(!tmp->header) return MANIFEST_NO_MEMORY;
+			if(!tmp->header) return droptrack(tmp, &vendordata, MANIFEST_NO_MEMORY);
 			/* data is not unhexlified because vendor extensions could put
 			 * here anything, even text. */
 			strcpy(tmp->header, attr[i+1]);
@@ -700,14 +990,20 @@ static error_t parsetrack(ManifestBox *mb, const char **attr)
 			continue;
 		}
 		/* else */
-		if(!addvendorattrs(&vendordata, &attr[i])) return MANIFEST_NO_MEMORY;
+		if(!addvendorattrs(&vendordata, &attr[i]))
+			return droptrack(tmp, &vendordata, MANIFEST_NO_MEMORY);
 	}
 
-	if (!SMTH_finalizelist(&vendordata)) return MANIFEST_NO_MEMORY;
+	if (!SMTH_finalizelist(&vendordata))
+		return droptrack(tmp, &vendordata, MANIFEST_NO_MEMORY);
 	tmp->vendorattrs = (chardata**) vendordata.list;
 
 	mb->activetrack = tmp;
-	if (!SMTH_addtolist(tmp, &mb->tmptracks)) return MANIFEST_NO_MEMORY;
+	if (!SMTH_addtolist(tmp, &mb->tmptracks))
+	{   mb->activetrack = NULL;
+		tmp->vendorattrs = NULL;
+		return droptrack(tmp, &vendordata, MANIFEST_NO_MEMORY);
+	}
 
 	return MANIFEST_SUCCESS;
 }
@@ -771,35 +1067,45 @@ static error_t parseattr(ManifestBox* mb, const char **attr)
 static error_t parsechunk(ManifestBox *mb, const char **attr)
 {
 	count_t i;
+	Chunk chunk;
 
-	Chunk *tmp = calloc(1, sizeof (Chunk));
-	if (!tmp) return MANIFEST_NO_MEMORY;
+	memset(&chunk, 0x00, sizeof (Chunk));
 
 	for (i = 0; attr[i]; i += 2)
 	{
 		if (!attr[i+1]) return MANIFEST_PARSER_ERROR;
 
 		if (!strcmp(attr[i], MANIFEST_CHUNK_INDEX))
-		{   tmp->index = (count_t) atoint32(attr[i+1]);
+		{   chunk.index = (count_t) atoint32(attr[i+1]);
 			continue;
 		}
 		if (!strcmp(attr[i], MANIFEST_CHUNK_DURATION))
-		{   tmp->duration = (tick_t) atoint64(attr[i+1]);
+		{   chunk.duration = (tick_t) atoint64(attr[i+1]);
 			continue;
 		}
 		if (!strcmp(attr[i], MANIFEST_CHUNK_TIME))
-		{   tmp->time = (tick_t) atoint64(attr[i+1]);
+		{   chunk.time = (tick_t) atoint64(attr[i+1]);
 			continue;
 		}
 	}
 
-	if (!tmp->duration)
-		tmp->duration = mb->previoustime? tmp->time - mb->previoustime: 0;
-	if (!tmp->time)
-		tmp->time = mb->previousduration? mb->previoustime + mb->previousduration: 0;
+	if (!chunk.duration)
+		chunk.duration = mb->previoustime? chunk.time - mb->previoustime: 0;
+	if (!chunk.time)
+		chunk.time = mb->previousduration? mb->previoustime + mb->previousduration: 0;
 
-	mb->previousduration = tmp->duration;
-	mb->previoustime = tmp->time;
+	mb->previousduration = chunk.duration;
+	mb->previoustime = chunk.time;
+
+	/* a refresh allocates only what is new */
+	if (chunk.time < mb->knownend)
+	{   mb->skipping = true;
+		return MANIFEST_SUCCESS;
+	}
+
+	Chunk *tmp = malloc(sizeof (Chunk));
+	if (!tmp) return MANIFEST_NO_MEMORY;
+	*tmp = chunk;
 
 	if (!SMTH_addtolist(tmp, &mb->tmpchunks))
 	{   free(tmp);
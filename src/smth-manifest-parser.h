@@ -84,6 +84,9 @@ typedef struct
 	tick_t time;
 	/** The subfragments of a \c Chunk. */
 	ChunkIndex **fragments;
+	/** Whether the chunk was announced by the TfrfBox of a live fragment,
+	 *  and may not be published yet [synthetic] */
+	bool announced;
 } Chunk;
 
 /** \brief Track specific metadata. */
@@ -147,6 +150,26 @@ typedef struct
 /** The Stream content type. */
 typedef enum {VIDEO, AUDIO, TEXT} StreamType;
 
+/** The kind of a piece of a \c Stream::url pattern. */
+typedef enum { URL_END,              /**< the sigil closing the pattern      */
+               URL_LITERAL,          /**< text to be copied as is            */
+               URL_BITRATE,          /**< the \c Track::bitrate              */
+               URL_START_TIME,       /**< the \c Chunk::time                 */
+               URL_CUSTOM_ATTRIBUTES /**< the \c Track::attributes, as
+                                          comma separated key=value pairs   */
+             } UrlTokenType;
+
+/** \brief A piece of a \c Stream::url pattern, parsed with the Manifest. */
+typedef struct
+{
+	/** What the piece stands for */
+	UrlTokenType type;
+	/** The text of an \c URL_LITERAL, inside \c Stream::url */
+	const chardata *text;
+	/** The length of \c text, in bytes */
+	length_t length;
+} UrlToken;
+
 /** \brief Holds stream metadata. */
 typedef struct
 {	/** The type of the stream: video, audio, or text. */
@@ -166,6 +189,9 @@ typedef struct
 	ScreenMetrics bestsize;
 	/** A pattern used by the client to generate Fragment Request messages. */
 	chardata* url;
+	/** \c Stream::url split at its placeholders, terminated by an \c URL_END
+	 *  token, or \c NULL if there is no url. */
+	UrlToken *urltokens;
 	/** Whether sample data for this stream are embedded in the Manifest as
 	 *  part of the ManifestOutputSample field.
 	 *  Otherwise, the ManifestOutputSample field for fragments that are part
@@ -189,6 +215,9 @@ typedef struct
 	Track **tracks;
 	/** Pointer to a NULL terminated array of child chunks. */
 	Chunk **chunks;
+	/** The allocated slots of \c chunks, once it was grown by
+	 *  \c SMTH_appendchunks, 0 otherwise. */
+	count_t chunksslots;
 	/** A set of vendor specific attrs, as a sequence of key/name,
 	 *  NULL terminated. */
 	chardata **vendorattrs;
@@ -228,6 +257,12 @@ typedef struct
 	/** A set of vendor specific attrs, as a sequence of key/name,
 	 *  NULL terminated. */
 	chardata **vendorattrs;
+	/** The image the whole Manifest lies in, if it was mapped back with
+	 *  \c SMTH_loadmanifest, or \c NULL. Such a Manifest must not be
+	 *  modified. */
+	void *image;
+	/** The size of \c image, in bytes */
+	length_t imagesize;
 } Manifest;
 
 /** The manifest was successfully parsed. */
@@ -265,7 +300,29 @@ typedef struct
 /** A malformed request URI was encountered */
 #define MANIFEST_MALFORMED_URL           (-24)
 
+/** \brief Parses a \c Manifest a piece at a time, as it is received. */
+typedef struct
+{
+	/** The state of the parser, \c NULL if it was disposed of */
+	struct ManifestBox *box;
+	/** The Manifest being filled */
+	Manifest *manifest;
+	/** Whether something was fed to the parser */
+	bool fed;
+	/** Whether \c SMTH_endmanifest succeeded */
+	bool parsed;
+	/** The first error met, or \c MANIFEST_SUCCESS */
+	error_t error;
+} ManifestParser;
+
 error_t SMTH_parsemanifest(Manifest *m, FILE *stream);
+error_t SMTH_initmanifestparser(ManifestParser *p, Manifest *m,
+	const tick_t *known, count_t knownno);
+error_t SMTH_feedmanifest(ManifestParser *p, const char *data, length_t size);
+error_t SMTH_endmanifest(ManifestParser *p);
+void SMTH_disposemanifestparser(ManifestParser *p);
+error_t SMTH_appendchunks(Stream *s, Chunk **chunks, count_t chunksno);
+void SMTH_disposechunk(Chunk *chunk);
 void  SMTH_disposemanifest(Manifest *m);
 
 #endif /* __SMTH_MANIFEST_PARSER_H__ */
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-memcache-defs.h : in-memory cache of parsed fragments (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_MEMCACHE_DEFS_H__
+#define __SMTH_MEMCACHE_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-memcache-defs.h
+ * \brief  In-memory cache of parsed fragments (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-memcache.h>
+
+/** The least number of slots of the cache table */
+#define MEMORY_MIN_SLOTS       64
+
+static MemoryEntry *findslot(cachekey_t key);
+static bool growslots(void);
+static void placeslot(const MemoryEntry *e);
+static void dropslot(MemoryEntry *e);
+static void sweep(length_t room);
+
+#endif /* __SMTH_MEMCACHE_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
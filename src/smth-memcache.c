@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-memcache.c : in-memory cache of parsed fragments
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-memcache.c
+ * \brief  In-memory cache of parsed fragments.
+ * \author Stefano Sanfilippo
+ *
+ * Fragments are shared by all the handles of the process: a chunk parsed by
+ * one of them is handed to the others as it is, payload included. Once the
+ * cache is over its budget, fragments are evicted in \e clock order: the hand
+ * sweeps the table, sparing once those used since it last passed.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <smth-memcache-defs.h>
+
+/** Protects the cache */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/** The fragments kept, as an open addressing table */
+static MemoryEntry *entries = NULL;
+/** The slots of \c entries, a power of 2 */
+static count_t slots = 0;
+/** The fragments in \c entries */
+static count_t entriesno = 0;
+/** The slot the clock hand is over */
+static count_t hand = 0;
+/** The payload bytes kept */
+static length_t bytes = 0;
+/** The payload bytes that may be kept, 0 = no cache. It is written under
+ *  \c lock, but it may be read atomically without. */
+static length_t budget = 0;
+
+/**
+ * \brief Sets how many payload bytes the fragments kept in memory may take,
+ *        for the whole process.
+ *
+ * Fragments are evicted right away, if they take more.
+ *
+ * \param newbudget The budget in bytes, 0 = no cache.
+ */
+void SMTH_setmemorybudget(length_t newbudget)
+{
+	count_t i;
+
+	pthread_mutex_lock(&lock);
+
+	__atomic_store_n(&budget, newbudget, __ATOMIC_RELAXED);
+	sweep(0);
+
+	if (!newbudget)
+	{   /* even empty fragments go */
+		for (i = 0; i < slots; ++i)
+			if (entries[i].key) SMTH_releasefragment(entries[i].fragment);
+		free(entries);
+		entries = NULL;
+		slots = entriesno = hand = 0;
+		bytes = 0;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * \brief Looks for a parsed chunk, and marks it as used.
+ *
+ * \param key The key of the chunk \sa SMTH_cachekey
+ * \return    The fragment, to be given back with \c SMTH_releasefragment, or
+ *            \c NULL if it is not kept.
+ */
+const SMTH_fragment *SMTH_memorylookup(cachekey_t key)
+{
+	const SMTH_fragment *fragment = NULL;
+	MemoryEntry *e;
+
+	if (!__atomic_load_n(&budget, __ATOMIC_RELAXED)) return NULL;
+
+	pthread_mutex_lock(&lock);
+
+	e = findslot(key);
+	if (e)
+	{   e->used = true;
+		fragment = e->fragment;
+		SMTH_retainfragment(fragment);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return fragment;
+}
+
+/**
+ * \brief Keeps a parsed chunk, so that other handles may take it, unless it is
+ *        already kept or larger than the budget.
+ *
+ * \warning The fragment must not be changed anymore, by anyone.
+ *
+ * \param key      The key of the chunk \sa SMTH_cachekey
+ * \param fragment The fragment, which is retained by the cache.
+ */
+void SMTH_memorystore(cachekey_t key, const SMTH_fragment *fragment)
+{
+	MemoryEntry e = { key, fragment, fragment->size, false };
+
+	if (!key || !__atomic_load_n(&budget, __ATOMIC_RELAXED)) return;
+
+	pthread_mutex_lock(&lock);
+
+	if (e.size <= budget && !findslot(key))
+	{
+		sweep(e.size);
+
+		/* at most 3/4 full, so that probes stay short */
+		if (4 * (entriesno + 1) <= 3 * slots || growslots())
+		{   SMTH_retainfragment(fragment);
+			placeslot(&e);
+			entriesno++;
+			bytes += e.size;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Looks for a chunk in the cache table.
+ *
+ * \warning \c lock must be held.
+ *
+ * \param key The key of the chunk.
+ * \return    Its slot, or \c NULL if it is not kept.
+ */
+static MemoryEntry *findslot(cachekey_t key)
+{
+	count_t i, mask = slots - 1;
+
+	if (!slots) return NULL;
+
+	for (i = key & mask; entries[i].key; i = (i + 1) & mask)
+		if (entries[i].key == key) return &entries[i];
+
+	return NULL;
+}
+
+/**
+ * \brief Doubles the slots of the cache table.
+ *
+ * \warning \c lock must be held.
+ *
+ * \return \c false if there was not memory enough, \c true otherwise.
+ */
+static bool growslots(void)
+{
+	MemoryEntry *old = entries;
+	count_t i, oldslots = slots;
+
+	count_t newslots = oldslots? 2 * oldslots: MEMORY_MIN_SLOTS;
+	MemoryEntry *table = calloc(newslots, sizeof (MemoryEntry));
+	if (!table) return false;
+
+	entries = table;
+	slots = newslots;
+	hand = 0;
+
+	for (i = 0; i < oldslots; ++i)
+		if (old[i].key) placeslot(&old[i]);
+
+	free(old);
+
+	return true;
+}
+
+/**
+ * \brief Puts a chunk in the first free slot of its probe sequence.
+ *
+ * \warning \c lock must be held, and a free slot must be there.
+ *
+ * \param e The chunk, which is copied.
+ */
+static void placeslot(const MemoryEntry *e)
+{
+	count_t i, mask = slots - 1;
+
+	for (i = e->key & mask; entries[i].key; i = (i + 1) & mask);
+
+	entries[i] = *e;
+}
+
+/**
+ * \brief Releases the fragment of a slot and empties it, moving back the
+ *        chunks probed after it, so that they may still be found.
+ *
+ * \warning \c lock must be held.
+ *
+ * \param e The slot.
+ */
+static void dropslot(MemoryEntry *e)
+{
+	count_t mask = slots - 1;
+	count_t hole = e - entries, i = hole;
+
+	SMTH_releasefragment(e->fragment);
+	bytes -= e->size;
+	entriesno--;
+
+	for (i = (i + 1) & mask; entries[i].key; i = (i + 1) & mask)
+	{
+		count_t home = entries[i].key & mask;
+
+		/* it stays if its home lies cyclically in (hole, i] */
+		if (hole <= i? (hole < home && home <= i): (hole < home || home <= i))
+			continue;
+
+		entries[hole] = entries[i];
+		hole = i;
+	}
+
+	entries[hole].key = 0;
+}
+
+/**
+ * \brief Moves the clock hand, evicting the fragments not used since it last
+ *        passed, until there is room enough within the budget.
+ *
+ * \warning \c lock must be held.
+ *
+ * \param room The payload bytes to be made room for.
+ */
+static void sweep(length_t room)
+{
+	while (entriesno && bytes + room > budget)
+	{
+		MemoryEntry *e = &entries[hand];
+
+		if (e->key && !e->used)
+		{   dropslot(e);
+			continue; /* a following chunk may have been moved here */
+		}
+
+		e->used = false;
+		hand = (hand + 1) & (slots - 1);
+	}
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
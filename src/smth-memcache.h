@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-memcache.h : in-memory cache of parsed fragments (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_MEMCACHE_H__
+#define __SMTH_MEMCACHE_H__
+
+/**
+ * \internal
+ * \file   smth-memcache.h
+ * \brief  In-memory cache of parsed fragments (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-common-defs.h>
+#include <smth-cache.h>
+#include <smth.h>
+
+/** \brief A fragment kept in memory, as a slot of the cache table. */
+typedef struct
+{
+	/** Which chunk it is, as in \c SMTH_cachekey: 0 marks a free slot */
+	cachekey_t key;
+	/** The fragment, whose reference is held by the cache */
+	const SMTH_fragment *fragment;
+	/** The payload bytes of the fragment */
+	length_t size;
+	/** Whether it was used since the clock hand last passed over it */
+	bool used;
+} MemoryEntry;
+
+void SMTH_setmemorybudget(length_t budget);
+const SMTH_fragment *SMTH_memorylookup(cachekey_t key);
+void SMTH_memorystore(cachekey_t key, const SMTH_fragment *fragment);
+
+#endif /* __SMTH_MEMCACHE_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-poller-defs.h : event loop glue for curl multi handles (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_POLLER_DEFS_H__
+#define __SMTH_POLLER_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-poller-defs.h
+ * \brief  Event loop glue for curl multi handles (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-poller.h>
+
+/** The number of socket slots allocated at once */
+#define POLLER_SLOTS_STEP 4
+/** The most events collected by a single \c SMTH_waitpoller */
+#define POLLER_MAX_EVENTS 16
+
+static int socketchanged(CURL *easy, curl_socket_t fd, int what, void *userp,
+	void *socketp);
+static int timerchanged(CURLM *multi, long timeout, void *userp);
+static void watchsocket(Poller *p, curl_socket_t fd, int what, bool known);
+static int curlevents(uint32_t events);
+
+#endif /* __SMTH_POLLER_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
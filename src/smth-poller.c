@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-poller.c : event loop glue for curl multi handles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-poller.c
+ * \brief  Event loop glue for curl multi handles.
+ * \author Stefano Sanfilippo
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <smth-poller-defs.h>
+
+/**
+ * \brief Creates a multi handle whose sockets and timeout are tracked by the
+ *        given \c Poller.
+ *
+ * \param p        The poller to be initialised.
+ * \param waitable Whether the poller will be driven by \c SMTH_waitpoller,
+ *                 which needs an epoll instance, or by an external loop.
+ * \return         \c POLLER_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_initpoller(Poller *p, bool waitable)
+{
+	struct epoll_event wake = { .events = EPOLLIN };
+
+	memset(p, 0, sizeof (Poller));
+	p->epollfd = p->wakefd = -1;
+
+	p->multi = curl_multi_init();
+	if (!p->multi) return POLLER_NO_MULTI;
+
+	curl_multi_setopt(p->multi, CURLMOPT_SOCKETFUNCTION, socketchanged);
+	curl_multi_setopt(p->multi, CURLMOPT_SOCKETDATA, p);
+	curl_multi_setopt(p->multi, CURLMOPT_TIMERFUNCTION, timerchanged);
+	curl_multi_setopt(p->multi, CURLMOPT_TIMERDATA, p);
+
+	if (!waitable) return POLLER_SUCCESS;
+
+	p->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	p->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	wake.data.fd = p->wakefd;
+
+	if (p->epollfd < 0 || p->wakefd < 0 ||
+		epoll_ctl(p->epollfd, EPOLL_CTL_ADD, p->wakefd, &wake))
+	{   SMTH_disposepoller(p);
+		return POLLER_NO_EPOLL;
+	}
+
+	return POLLER_SUCCESS;
+}
+
+/**
+ * \brief Frees a \c Poller and its multi handle, which must have no easy
+ *        handle attached anymore. A zeroed poller is left alone.
+ *
+ * \param p The poller to be disposed.
+ */
+void SMTH_disposepoller(Poller *p)
+{
+	if (!p->multi) return; /* never initialised */
+
+	curl_multi_cleanup(p->multi);
+	if (p->epollfd >= 0) close(p->epollfd);
+	if (p->wakefd >= 0) close(p->wakefd);
+	free(p->sockets);
+	memset(p, 0, sizeof (Poller));
+	p->epollfd = p->wakefd = -1;
+}
+
+/**
+ * \brief Tells when \c SMTH_polleraction must be called with
+ *        \c CURL_SOCKET_TIMEOUT, even if no socket is ready.
+ *
+ * \param p The poller.
+ * \return  The time left, in ms (\c 0 if already expired), or \c -1 if curl
+ *          needs no timeout.
+ */
+long SMTH_pollertimeout(Poller *p)
+{
+	struct timespec now;
+	long left;
+
+	if (!p->timed) return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	left = (p->deadline.tv_sec - now.tv_sec) * 1000 +
+		(p->deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+	return left > 0? left: 0;
+}
+
+/**
+ * \brief Lets curl act on a ready socket, or on the expired timeout.
+ *
+ * Finished transfers may then be collected with \c curl_multi_info_read.
+ *
+ * \param p    The poller.
+ * \param fd   The ready socket, or \c CURL_SOCKET_TIMEOUT
+ * \param what What the socket is ready for, as \c CURL_CSELECT_* flags
+ *             (\c 0 lets curl find out).
+ * \return     The number of transfers still running.
+ */
+int SMTH_polleraction(Poller *p, curl_socket_t fd, int what)
+{
+	/* a timeout is consumed as soon as it is acted upon */
+	if (fd == CURL_SOCKET_TIMEOUT) p->timed = false;
+
+	curl_multi_socket_action(p->multi, fd, what, &p->running);
+
+	return p->running;
+}
+
+/**
+ * \brief Waits until a socket is ready or the timeout expires, then lets curl
+ *        act on them. The poller must be waitable \sa SMTH_initpoller
+ *
+ * The cost of a call depends on the number of ready sockets only, and the wait
+ * ends as soon as curl has something to do, or \c SMTH_wakepoller is called.
+ *
+ * \param p       The poller.
+ * \param maxwait The longest time to wait, in ms.
+ * \return        \c POLLER_SUCCESS or \c POLLER_NO_WAIT
+ */
+error_t SMTH_waitpoller(Poller *p, long maxwait)
+{
+	struct epoll_event events[POLLER_MAX_EVENTS];
+	long timeout = SMTH_pollertimeout(p);
+	uint64_t wakes;
+	int i, ready;
+
+	if (timeout < 0 || timeout > maxwait) timeout = maxwait;
+
+	ready = epoll_wait(p->epollfd, events, POLLER_MAX_EVENTS, timeout);
+	if (ready < 0)
+		return errno == EINTR? POLLER_SUCCESS: POLLER_NO_WAIT;
+
+	for (i = 0; i < ready; ++i)
+	{
+		if (events[i].data.fd == p->wakefd)
+			read(p->wakefd, &wakes, sizeof (wakes)); /* resets the counter */
+		else SMTH_polleraction(p, events[i].data.fd,
+			curlevents(events[i].events));
+	}
+
+	if (SMTH_pollertimeout(p) == 0)
+		SMTH_polleraction(p, CURL_SOCKET_TIMEOUT, 0);
+
+	return POLLER_SUCCESS;
+}
+
+/**
+ * \brief Cuts short a pending or following \c SMTH_waitpoller.
+ *
+ * It may be called from any thread.
+ *
+ * \param p The poller to be woken up.
+ */
+void SMTH_wakepoller(Poller *p)
+{
+	uint64_t wake = 1;
+
+	if (p->wakefd >= 0 && write(p->wakefd, &wake, sizeof (wake)) < 0)
+		return; /* the counter is full: a wake up is pending anyway */
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief \c CURLMOPT_SOCKETFUNCTION callback: keeps the socket table of a
+ *        \c Poller in sync with what curl wants to be watched.
+ *
+ * \param easy    The easy handle using the socket (unused).
+ * \param fd      The socket.
+ * \param what    What to watch for, or \c CURL_POLL_REMOVE
+ * \param userp   The poller.
+ * \param socketp Unused.
+ * \return        Always \c 0, even if the socket could not be tracked: its
+ *                transfer will then be ended by the curl timeouts.
+ */
+static int socketchanged(CURL *easy, curl_socket_t fd, int what, void *userp,
+	void *socketp)
+{
+	Poller *p = userp;
+	count_t i;
+
+	(void) easy;
+	(void) socketp;
+
+	for (i = 0; i < p->socketsno; ++i)
+		if (p->sockets[i].fd == fd) break;
+
+	if (p->epollfd >= 0) watchsocket(p, fd, what, i < p->socketsno);
+
+	if (what == CURL_POLL_REMOVE)
+	{
+		if (i < p->socketsno) p->sockets[i] = p->sockets[--p->socketsno];
+		return 0;
+	}
+
+	if (i == p->socketsno)
+	{
+		if (p->socketsno == p->slots)
+		{
+			PolledSocket *more = realloc(p->sockets,
+				(p->slots + POLLER_SLOTS_STEP) * sizeof (PolledSocket));
+			if (!more) return 0;
+			p->sockets = more;
+			p->slots += POLLER_SLOTS_STEP;
+		}
+		p->sockets[p->socketsno++].fd = fd;
+	}
+
+	p->sockets[i].what = what;
+
+	return 0;
+}
+
+/**
+ * \brief \c CURLMOPT_TIMERFUNCTION callback: records when curl wants to be
+ *        called back, whatever happens on the sockets.
+ *
+ * \param multi   The multi handle (unused).
+ * \param timeout The time left, in ms, or \c -1 to delete the timer.
+ * \param userp   The poller.
+ * \return        Always \c 0
+ */
+static int timerchanged(CURLM *multi, long timeout, void *userp)
+{
+	Poller *p = userp;
+
+	(void) multi;
+
+	if (timeout < 0)
+	{
+		p->timed = false;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &p->deadline);
+	p->deadline.tv_sec += timeout / 1000;
+	p->deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (p->deadline.tv_nsec >= 1000000000)
+	{   p->deadline.tv_sec++;
+		p->deadline.tv_nsec -= 1000000000;
+	}
+	p->timed = true;
+
+	return 0;
+}
+
+/**
+ * \brief Mirrors a change of the socket table into the epoll instance.
+ *
+ * \param p     The poller.
+ * \param fd    The socket.
+ * \param what  What to watch for, or \c CURL_POLL_REMOVE
+ * \param known Whether the socket is already watched.
+ */
+static void watchsocket(Poller *p, curl_socket_t fd, int what, bool known)
+{
+	struct epoll_event ev = { .data.fd = fd };
+
+	if (what == CURL_POLL_REMOVE)
+	{   /* it fails harmlessly if curl already closed the socket */
+		epoll_ctl(p->epollfd, EPOLL_CTL_DEL, fd, &ev);
+		return;
+	}
+
+	if (what & CURL_POLL_IN) ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+
+	if (epoll_ctl(p->epollfd, known? EPOLL_CTL_MOD: EPOLL_CTL_ADD, fd, &ev))
+		epoll_ctl(p->epollfd, known? EPOLL_CTL_ADD: EPOLL_CTL_MOD, fd, &ev);
+}
+
+/**
+ * \brief Translates epoll events into \c CURL_CSELECT_* flags.
+ *
+ * \param events The epoll events.
+ * \return       The curl flags.
+ */
+static int curlevents(uint32_t events)
+{
+	int what = 0;
+
+	if (events & EPOLLIN) what |= CURL_CSELECT_IN;
+	if (events & EPOLLOUT) what |= CURL_CSELECT_OUT;
+	if (events & (EPOLLERR | EPOLLHUP)) what |= CURL_CSELECT_ERR;
+
+	return what;
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
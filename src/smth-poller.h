@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-poller.h : event loop glue for curl multi handles (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_POLLER_H__
+#define __SMTH_POLLER_H__
+
+/**
+ * \internal
+ * \file   smth-poller.h
+ * \brief  Event loop glue for curl multi handles (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <time.h>
+#include <curl/multi.h>
+#include <smth-common-defs.h>
+
+/** Everything is ok. */
+#define POLLER_SUCCESS  (0)
+/** Could not create the multi handle of a \c Poller */
+#define POLLER_NO_MULTI (-45)
+/** Could not create the epoll instance of a \c Poller */
+#define POLLER_NO_EPOLL (-46)
+/** Waiting for the sockets of a \c Poller failed */
+#define POLLER_NO_WAIT  (-47)
+
+/** \brief A socket curl wants to be watched. */
+typedef struct
+{
+	/** The socket */
+	curl_socket_t fd;
+	/** What to watch for: \c CURL_POLL_IN, \c CURL_POLL_OUT or both */
+	int what;
+} PolledSocket;
+
+/** \brief Tracks the sockets and the timeout of a curl multi handle, so that
+ *         it can be driven by any event loop through \c curl_multi_socket_action
+ */
+typedef struct
+{
+	/** The multi handle */
+	CURLM *multi;
+	/** The sockets to be watched */
+	PolledSocket *sockets;
+	/** The number of sockets to be watched */
+	count_t socketsno;
+	/** The number of allocated slots in \c sockets */
+	count_t slots;
+	/** Whether curl asked for a timeout */
+	bool timed;
+	/** When the timeout expires, on the monotonic clock */
+	struct timespec deadline;
+	/** Number of transfers still running after the last action */
+	int running;
+	/** The epoll instance watching \c sockets, or \c -1 if the poller is
+	 *  driven by someone else \sa SMTH_waitpoller */
+	int epollfd;
+	/** An eventfd cutting short \c SMTH_waitpoller, or \c -1 */
+	int wakefd;
+} Poller;
+
+error_t SMTH_initpoller(Poller *p, bool waitable);
+void SMTH_disposepoller(Poller *p);
+long SMTH_pollertimeout(Poller *p);
+int SMTH_polleraction(Poller *p, curl_socket_t fd, int what);
+error_t SMTH_waitpoller(Poller *p, long maxwait);
+void SMTH_wakepoller(Poller *p);
+
+#endif /* __SMTH_POLLER_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
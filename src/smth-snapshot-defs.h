@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-snapshot-defs.h : binary images of parsed Manifests (private header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_SNAPSHOT_DEFS_H__
+#define __SMTH_SNAPSHOT_DEFS_H__
+
+/**
+ * \internal
+ * \file   smth-snapshot-defs.h
+ * \brief  Binary images of parsed Manifests (private header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <smth-snapshot.h>
+
+/** The first bytes of an image, changed with its format */
+#define SNAPSHOT_MAGIC          "SMTHMAN1"
+/** Every piece of an image starts at a multiple of this many bytes */
+#define SNAPSHOT_ALIGNMENT      8
+/** The least number of bytes allocated for an image */
+#define SNAPSHOT_MIN_SIZE       4096
+/** The least number of relocations allocated for an image */
+#define SNAPSHOT_MIN_RELOCS     256
+
+static void setlayout(uint16_t *layout);
+static offset_t reserve(SnapshotImage *i, const void *data, length_t size);
+static void pointto(SnapshotImage *i, offset_t field, offset_t target);
+static offset_t savepointers(SnapshotImage *i, count_t count);
+static offset_t savestring(SnapshotImage *i, const chardata *s);
+static offset_t savestrings(SnapshotImage *i, chardata **list);
+static offset_t saveembedded(SnapshotImage *i, const EmbeddedData *e);
+static offset_t savestreams(SnapshotImage *i, Stream **streams);
+static offset_t savetracks(SnapshotImage *i, Track **tracks);
+static offset_t savechunks(SnapshotImage *i, Chunk **chunks);
+static offset_t savechunkindexes(SnapshotImage *i, ChunkIndex **fragments);
+static offset_t saveurltokens(SnapshotImage *i, const Stream *s,
+	offset_t url);
+static bool checkheader(const SnapshotHeader *h, offset_t size);
+static bool checkstring(const byte_t *base, offset_t size, offset_t at);
+static bool relocate(byte_t *base, const SnapshotHeader *h);
+
+#endif /* __SMTH_SNAPSHOT_DEFS_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -0,0 +1,558 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-snapshot.c : binary images of parsed Manifests
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/**
+ * \internal
+ * \file   smth-snapshot.c
+ * \brief  Binary images of parsed Manifests.
+ * \author Stefano Sanfilippo
+ *
+ * An image holds a parsed Manifest as it lies in memory, so that it can be
+ * mapped back without parsing any XML: loading it only adds the address it
+ * was mapped at to each pointer, on private copies of the pages holding them.
+ * Thus, images are bound to the build writing them, which is checked.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <smth-snapshot-defs.h>
+
+/**
+ * \brief Writes the image of an on-demand Manifest.
+ *
+ * \param m      The Manifest, which is not modified.
+ * \param url    The url the Manifest was downloaded from, checked on load.
+ * \param etag   The \c ETag of the Manifest, or \c NULL
+ * \param output The file to write the image to.
+ * \return       SNAPSHOT_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_savemanifest(const Manifest *m, const char *url, const char *etag,
+	FILE *output)
+{
+	SnapshotImage image;
+	SnapshotHeader header;
+	Manifest copy = *m;
+	error_t error = SNAPSHOT_SUCCESS;
+	offset_t at;
+
+	if (m->islive) return SNAPSHOT_IS_LIVE;
+
+	memset(&image, 0x00, sizeof (SnapshotImage));
+	memset(&header, 0x00, sizeof (SnapshotHeader));
+
+	/* the header is filled last, when all offsets are known */
+	reserve(&image, NULL, sizeof (SnapshotHeader));
+
+	copy.image = NULL;
+	copy.imagesize = 0;
+	at = reserve(&image, &copy, sizeof (Manifest));
+	pointto(&image, at + offsetof(Manifest, armor),
+		saveembedded(&image, m->armor));
+	pointto(&image, at + offsetof(Manifest, streams),
+		savestreams(&image, m->streams));
+	pointto(&image, at + offsetof(Manifest, vendorattrs),
+		savestrings(&image, m->vendorattrs));
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+	setlayout(header.layout);
+	header.manifest = at;
+	header.url = savestring(&image, url);
+	header.etag = savestring(&image, etag);
+	header.relocsno = image.relocsno;
+	header.relocs = reserve(&image, image.relocs,
+		image.relocsno * sizeof (offset_t));
+	header.size = image.size;
+
+	if (image.failed) error = SNAPSHOT_NO_MEMORY;
+	else
+	{   memcpy(image.data, &header, sizeof (SnapshotHeader));
+		if (fwrite(image.data, 1, image.size, output) != image.size)
+			error = SNAPSHOT_IO_ERROR;
+	}
+
+	free(image.data);
+	free(image.relocs);
+
+	return error;
+}
+
+/**
+ * \brief Maps the image of a Manifest written by \c SMTH_savemanifest.
+ *
+ * The Manifest lives in the mapping, which is given back by
+ * \c SMTH_disposemanifest. It must not be modified.
+ *
+ * \param m     The Manifest to be filled. It is zeroed on failure.
+ * \param url   The url the Manifest is wanted for: images of other urls are
+ *              refused.
+ * \param etag  Set to the \c ETag of the Manifest, inside the image, or to
+ *              \c NULL if it had none.
+ * \param input The file holding the image. It may be closed afterwards.
+ * \return      SNAPSHOT_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_loadmanifest(Manifest *m, const char *url, const char **etag,
+	FILE *input)
+{
+	SnapshotHeader header;
+	struct stat info;
+	byte_t *base;
+	offset_t size;
+
+	memset(m, 0x00, sizeof (Manifest));
+	*etag = NULL;
+
+	if (fstat(fileno(input), &info)) return SNAPSHOT_IO_ERROR;
+	if (info.st_size < (off_t) sizeof (SnapshotHeader))
+		return SNAPSHOT_BAD_IMAGE;
+
+	size = info.st_size;
+	/* pointers are relocated in place, on private copies of the pages */
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		fileno(input), 0);
+	if (base == MAP_FAILED) return SNAPSHOT_IO_ERROR;
+
+	memcpy(&header, base, sizeof (SnapshotHeader));
+
+	if (!checkheader(&header, size) || !checkstring(base, size, header.url) ||
+		(header.etag && !checkstring(base, size, header.etag)) ||
+		strcmp(&base[header.url], url) || !relocate(base, &header))
+	{   munmap(base, size);
+		return SNAPSHOT_BAD_IMAGE;
+	}
+
+	memcpy(m, &base[header.manifest], sizeof (Manifest));
+	m->image = base;
+	m->imagesize = size;
+
+	if (header.etag) *etag = &base[header.etag];
+
+	return SNAPSHOT_SUCCESS;
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Records the sizes the image layout depends on.
+ *
+ * \param layout The \c SnapshotHeader::layout to be filled.
+ */
+static void setlayout(uint16_t *layout)
+{
+	layout[0] = sizeof (void*);
+	layout[1] = sizeof (Manifest);
+	layout[2] = sizeof (Stream);
+	layout[3] = sizeof (Track);
+	layout[4] = sizeof (Chunk);
+	layout[5] = sizeof (ChunkIndex);
+	layout[6] = sizeof (EmbeddedData);
+	layout[7] = sizeof (UrlToken);
+}
+
+/**
+ * \brief Appends a piece to an image, aligned.
+ *
+ * Offsets are returned rather than pointers, as the image moves when it grows.
+ *
+ * \param i    The image.
+ * \param data What is to be copied, or \c NULL to append zeroes.
+ * \param size The size of \c data.
+ * \return     The offset of the piece, which is never 0, or 0 if there was no
+ *             memory: \c SnapshotImage::failed is then set.
+ */
+static offset_t reserve(SnapshotImage *i, const void *data, length_t size)
+{
+	offset_t at = i->size;
+	length_t padded = size?
+		(size + SNAPSHOT_ALIGNMENT - 1) & ~(SNAPSHOT_ALIGNMENT - 1):
+		SNAPSHOT_ALIGNMENT;
+
+	if (i->failed) return 0;
+
+	if (at + padded > i->slots)
+	{   offset_t slots = i->slots? 2 * i->slots: SNAPSHOT_MIN_SIZE;
+		while (slots < at + padded) slots *= 2;
+
+		byte_t *tmp = realloc(i->data, slots);
+		if (!tmp)
+		{   i->failed = true;
+			return 0;
+		}
+		i->data = tmp;
+		i->slots = slots;
+	}
+
+	memset(&i->data[at], 0x00, padded);
+	if (data) memcpy(&i->data[at], data, size);
+	i->size += padded;
+
+	return at;
+}
+
+/**
+ * \brief Makes a pointer of an image point to another piece of it.
+ *
+ * \param i      The image.
+ * \param field  The offset of the pointer.
+ * \param target The offset of what it points to, 0 for \c NULL.
+ */
+static void pointto(SnapshotImage *i, offset_t field, offset_t target)
+{
+	uintptr_t value = target;
+
+	if (i->failed) return;
+
+	memcpy(&i->data[field], &value, sizeof (uintptr_t));
+	if (!target) return;
+
+	if (i->relocsno == i->relocsslots)
+	{   offset_t slots = i->relocsslots?
+			2 * i->relocsslots: SNAPSHOT_MIN_RELOCS;
+
+		offset_t *tmp = realloc(i->relocs, slots * sizeof (offset_t));
+		if (!tmp)
+		{   i->failed = true;
+			return;
+		}
+		i->relocs = tmp;
+		i->relocsslots = slots;
+	}
+
+	i->relocs[i->relocsno++] = field;
+}
+
+/**
+ * \brief Appends a \c NULL terminated array of pointers, all \c NULL.
+ *
+ * \param i     The image.
+ * \param count The pointers before the terminator.
+ * \return      The offset of the array.
+ */
+static offset_t savepointers(SnapshotImage *i, count_t count)
+{
+	return reserve(i, NULL, (count + 1) * sizeof (void*));
+}
+
+/**
+ * \brief Appends a string.
+ *
+ * \param i The image.
+ * \param s The string, or \c NULL
+ * \return  Its offset, 0 if \c s is \c NULL
+ */
+static offset_t savestring(SnapshotImage *i, const chardata *s)
+{
+	if (!s) return 0;
+
+	return reserve(i, s, strlen(s) + 1);
+}
+
+/**
+ * \brief Appends a \c NULL terminated array of strings, as attributes are.
+ *
+ * \param i    The image.
+ * \param list The array, or \c NULL
+ * \return     Its offset, 0 if \c list is \c NULL
+ */
+static offset_t savestrings(SnapshotImage *i, chardata **list)
+{
+	count_t n, count;
+	offset_t at;
+
+	if (!list) return 0;
+
+	for (count = 0; list[count]; count++);
+
+	at = savepointers(i, count);
+	for (n = 0; n < count; n++)
+		pointto(i, at + n * sizeof (void*), savestring(i, list[n]));
+
+	return at;
+}
+
+/**
+ * \brief Appends embedded data.
+ *
+ * \param i The image.
+ * \param e The data, or \c NULL
+ * \return  Its offset, 0 if \c e is \c NULL
+ */
+static offset_t saveembedded(SnapshotImage *i, const EmbeddedData *e)
+{
+	offset_t at;
+
+	if (!e) return 0;
+
+	at = reserve(i, e, sizeof (EmbeddedData));
+	pointto(i, at + offsetof(EmbeddedData, content),
+		e->content? reserve(i, e->content, e->length): 0);
+
+	return at;
+}
+
+/**
+ * \brief Appends the streams of a Manifest.
+ *
+ * \param i       The image.
+ * \param streams The \c NULL terminated array of streams, or \c NULL
+ * \return        Its offset, 0 if \c streams is \c NULL
+ */
+static offset_t savestreams(SnapshotImage *i, Stream **streams)
+{
+	count_t n, count;
+	offset_t at, stream, url;
+
+	if (!streams) return 0;
+
+	for (count = 0; streams[count]; count++);
+
+	at = savepointers(i, count);
+	for (n = 0; n < count; n++)
+	{
+		Stream copy = *streams[n];
+
+		/* the chunks array of the image is exactly as long as needed */
+		copy.chunksslots = 0;
+		stream = reserve(i, &copy, sizeof (Stream));
+		pointto(i, at + n * sizeof (void*), stream);
+
+		pointto(i, stream + offsetof(Stream, name),
+			savestring(i, copy.name));
+		url = savestring(i, copy.url);
+		pointto(i, stream + offsetof(Stream, url), url);
+		pointto(i, stream + offsetof(Stream, urltokens),
+			saveurltokens(i, &copy, url));
+		pointto(i, stream + offsetof(Stream, parent),
+			savestring(i, copy.parent));
+		pointto(i, stream + offsetof(Stream, tracks),
+			savetracks(i, copy.tracks));
+		pointto(i, stream + offsetof(Stream, chunks),
+			savechunks(i, copy.chunks));
+		pointto(i, stream + offsetof(Stream, vendorattrs),
+			savestrings(i, copy.vendorattrs));
+	}
+
+	return at;
+}
+
+/**
+ * \brief Appends the tracks of a stream.
+ *
+ * \param i      The image.
+ * \param tracks The \c NULL terminated array of tracks, or \c NULL
+ * \return       Its offset, 0 if \c tracks is \c NULL
+ */
+static offset_t savetracks(SnapshotImage *i, Track **tracks)
+{
+	count_t n, count;
+	offset_t at, track;
+
+	if (!tracks) return 0;
+
+	for (count = 0; tracks[count]; count++);
+
+	at = savepointers(i, count);
+	for (n = 0; n < count; n++)
+	{
+		track = reserve(i, tracks[n], sizeof (Track));
+		pointto(i, at + n * sizeof (void*), track);
+
+		pointto(i, track + offsetof(Track, header),
+			savestring(i, tracks[n]->header));
+		pointto(i, track + offsetof(Track, attributes),
+			savestrings(i, tracks[n]->attributes));
+		pointto(i, track + offsetof(Track, vendorattrs),
+			savestrings(i, tracks[n]->vendorattrs));
+	}
+
+	return at;
+}
+
+/**
+ * \brief Appends the chunks of a stream.
+ *
+ * \param i      The image.
+ * \param chunks The \c NULL terminated array of chunks, or \c NULL
+ * \return       Its offset, 0 if \c chunks is \c NULL
+ */
+static offset_t savechunks(SnapshotImage *i, Chunk **chunks)
+{
+	count_t n, count;
+	offset_t at, chunk;
+
+	if (!chunks) return 0;
+
+	for (count = 0; chunks[count]; count++);
+
+	at = savepointers(i, count);
+	for (n = 0; n < count; n++)
+	{
+		chunk = reserve(i, chunks[n], sizeof (Chunk));
+		pointto(i, at + n * sizeof (void*), chunk);
+
+		pointto(i, chunk + offsetof(Chunk, fragments),
+			savechunkindexes(i, chunks[n]->fragments));
+	}
+
+	return at;
+}
+
+/**
+ * \brief Appends the subfragments of a chunk.
+ *
+ * \param i         The image.
+ * \param fragments The \c NULL terminated array of subfragments, or \c NULL
+ * \return          Its offset, 0 if \c fragments is \c NULL
+ */
+static offset_t savechunkindexes(SnapshotImage *i, ChunkIndex **fragments)
+{
+	count_t n, count;
+	offset_t at, fragment;
+
+	if (!fragments) return 0;
+
+	for (count = 0; fragments[count]; count++);
+
+	at = savepointers(i, count);
+	for (n = 0; n < count; n++)
+	{
+		fragment = reserve(i, fragments[n], sizeof (ChunkIndex));
+		pointto(i, at + n * sizeof (void*), fragment);
+
+		pointto(i, fragment + offsetof(ChunkIndex, embedded),
+			saveembedded(i, fragments[n]->embedded));
+		pointto(i, fragment + offsetof(ChunkIndex, vendorattrs),
+			savestrings(i, fragments[n]->vendorattrs));
+	}
+
+	return at;
+}
+
+/**
+ * \brief Appends the url pattern of a stream, split at its placeholders.
+ *
+ * The text of the literals points into the copy of \c Stream::url.
+ *
+ * \param i   The image.
+ * \param s   The stream.
+ * \param url The offset of the copy of \c Stream::url
+ * \return    Its offset, 0 if the stream has no tokens.
+ */
+static offset_t saveurltokens(SnapshotImage *i, const Stream *s, offset_t url)
+{
+	count_t n, count;
+	offset_t at;
+
+	if (!s->urltokens || !url) return 0;
+
+	for (count = 0; s->urltokens[count].type != URL_END; count++);
+
+	at = reserve(i, s->urltokens, (count + 1) * sizeof (UrlToken));
+	for (n = 0; n < count; n++)
+	{
+		const UrlToken *token = &s->urltokens[n];
+
+		pointto(i, at + n * sizeof (UrlToken) + offsetof(UrlToken, text),
+			token->text? url + (token->text - s->url): 0);
+	}
+
+	return at;
+}
+
+/**
+ * \brief Tells whether the header of an image may be trusted.
+ *
+ * \param h    The header.
+ * \param size The size of the image file.
+ * \return     Whether the image was written by a build with the same layout,
+ *             and all the pieces the header points to lie inside it.
+ */
+static bool checkheader(const SnapshotHeader *h, offset_t size)
+{
+	uint16_t layout[SNAPSHOT_LAYOUT_SIZES];
+
+	setlayout(layout);
+
+	if (memcmp(h->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH)) return false;
+	if (memcmp(h->layout, layout, sizeof (layout))) return false;
+	if (h->size != size) return false;
+
+	if (h->manifest < sizeof (SnapshotHeader) ||
+		h->manifest > size - sizeof (Manifest))
+	{   return false;
+	}
+	if (h->relocs > size ||
+		h->relocsno > (size - h->relocs) / sizeof (offset_t))
+	{   return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief Tells whether a string of an image ends inside it.
+ *
+ * \param base The image.
+ * \param size The size of the image.
+ * \param at   The offset of the string.
+ * \return     Whether it lies inside the image.
+ */
+static bool checkstring(const byte_t *base, offset_t size, offset_t at)
+{
+	return at >= sizeof (SnapshotHeader) && at < size &&
+		memchr(&base[at], '\0', size - at);
+}
+
+/**
+ * \brief Turns the offsets held by the pointers of a mapped image into
+ *        addresses.
+ *
+ * \param base The address the image is mapped at.
+ * \param h    Its header, already checked.
+ * \return     Whether all pointers pointed inside the image.
+ */
+static bool relocate(byte_t *base, const SnapshotHeader *h)
+{
+	offset_t n, field;
+	uintptr_t value;
+
+	for (n = 0; n < h->relocsno; n++)
+	{
+		memcpy(&field, &base[h->relocs + n * sizeof (offset_t)],
+			sizeof (offset_t));
+		if (field < sizeof (SnapshotHeader) ||
+			field > h->size - sizeof (uintptr_t))
+		{   return false;
+		}
+
+		memcpy(&value, &base[field], sizeof (uintptr_t));
+		if (value < sizeof (SnapshotHeader) || value >= h->size) return false;
+
+		value += (uintptr_t) base;
+		memcpy(&base[field], &value, sizeof (uintptr_t));
+	}
+
+	return true;
+}
+
+/* vim: set ts=4 sw=4 tw=0: */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2010 Stefano Sanfilippo
+ *
+ * smth-snapshot.h : binary images of parsed Manifests (public header)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Library General Public License as published
+ * by the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __SMTH_SNAPSHOT_H__
+#define __SMTH_SNAPSHOT_H__
+
+/**
+ * \internal
+ * \file   smth-snapshot.h
+ * \brief  Binary images of parsed Manifests (public header).
+ * \author Stefano Sanfilippo
+ */
+
+#include <stdio.h>
+#include <smth-common-defs.h>
+#include <smth-manifest-parser.h>
+
+/** Successful operation */
+#define SNAPSHOT_SUCCESS    ( 0)
+/** No memory left to build the image */
+#define SNAPSHOT_NO_MEMORY  (-53)
+/** The image could not be written, or mapped */
+#define SNAPSHOT_IO_ERROR   (-54)
+/** The image is malformed, was written by an incompatible build, or belongs
+ *  to another url */
+#define SNAPSHOT_BAD_IMAGE  (-55)
+/** A live Manifest changes as it is refreshed: it has no image */
+#define SNAPSHOT_IS_LIVE    (-56)
+
+/** The length of \c SnapshotHeader::magic */
+#define SNAPSHOT_MAGIC_LENGTH   8
+/** The structures whose size is recorded in \c SnapshotHeader::layout */
+#define SNAPSHOT_LAYOUT_SIZES   8
+
+/** \brief The first bytes of a Manifest image, telling where its pieces are.
+ *
+ *  The image holds the structures of the Manifest as they are laid out in
+ *  memory, with each pointer replaced by the offset of what it points to, 0
+ *  for \c NULL. The offsets of those pointers are listed in \c relocs.
+ */
+typedef struct
+{
+	/** Identifies the format of the image */
+	char magic[SNAPSHOT_MAGIC_LENGTH];
+	/** The size of a pointer and of each structure of the Manifest, which
+	 *  must match those of the build loading the image */
+	uint16_t layout[SNAPSHOT_LAYOUT_SIZES];
+	/** The size of the whole image, in bytes */
+	offset_t size;
+	/** Where the \c Manifest is */
+	offset_t manifest;
+	/** Where the url of the Manifest is */
+	offset_t url;
+	/** Where the \c ETag of the Manifest is, 0 if there is none */
+	offset_t etag;
+	/** Where the offsets of the pointers to be relocated are */
+	offset_t relocs;
+	/** The number of pointers to be relocated */
+	offset_t relocsno;
+} SnapshotHeader;
+
+/** \brief A Manifest image being built. */
+typedef struct
+{
+	/** The image built so far */
+	byte_t *data;
+	/** The bytes used of \c data */
+	offset_t size;
+	/** The bytes allocated of \c data */
+	offset_t slots;
+	/** The offsets of the pointers written so far */
+	offset_t *relocs;
+	/** The entries used of \c relocs */
+	offset_t relocsno;
+	/** The entries allocated of \c relocs */
+	offset_t relocsslots;
+	/** Whether some memory could not be allocated */
+	bool failed;
+} SnapshotImage;
+
+error_t SMTH_savemanifest(const Manifest *m, const char *url, const char *etag,
+	FILE *output);
+error_t SMTH_loadmanifest(Manifest *m, const char *url, const char **etag,
+	FILE *input);
+
+#endif /* __SMTH_SNAPSHOT_H__ */
+
+/* vim: set ts=4 sw=4 tw=0: */
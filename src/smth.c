@@ -33,12 +33,45 @@
 #define __COMPILING_LIBSMTH__
 
 #include <smth-http.h>
+#include <smth-cache.h>
 #include <smth-manifest-parser.h>
 #include <smth-common-defs.h>
 #include <smth-dynlist.h>
 #include <smth-defs.h>
+#include <smth-async.h>
+#include <smth-live.h>
 #include <smth.h>
 
+void SMTH_releasefragment(const SMTH_fragment *fragment);
+
+static void *readahead(void *data);
+static bool windowisfull(StreamHandle *s);
+static error_t follow(StreamHandle *s, SharedFragment *f);
+static length_t waitpayload(StreamHandle *s, SharedFragment *f,
+	length_t until);
+static length_t sampleend(SharedFragment *f, count_t sample);
+static void stopworker(StreamHandle *s);
+static SharedFragment *dequeue(StreamHandle *s);
+static SharedFragment *unqueue(StreamHandle *s);
+static void resume(StreamHandle *s);
+static bool activate(StreamHandle *s);
+static bool enqueue(StreamHandle *s, SharedFragment *f);
+static bool sharefragment(SharedFragment *f, Chunk *chunk);
+static void flushqueue(StreamHandle *s, count_t until);
+static void keepfragment(SharedFragment *f);
+static count_t findchunk(Stream *stream, tick_t time);
+
+/** Read-ahead window of the handles to be opened, in fragments */
+static count_t defaultfragments = SMTH_DEFAULT_READAHEAD_FRAGMENTS;
+/** Read-ahead window of the handles to be opened, in bytes */
+static length_t defaultbytes = SMTH_DEFAULT_READAHEAD_BYTES;
+/** Simultaneous transfers per stream of the handles to be opened */
+static count_t defaulttransfers = FETCHER_DEFAULT_TRANSFERS;
+/** Whether the handles to be opened spill fragments to disk */
+static bool defaultspill = false;
+/** Bitrate strategy of the handles to be opened, \c NULL for the default */
+static const SMTH_abr *defaultabr = NULL;
+
 /**
 
 \mainpage libsmth internals documentation
@@ -112,15 +145,58 @@ Document subject to the following constraints:
 
 \subsection abba Public API
 
-The main API exposed by libsmth is composed of five functions:
+The main API exposed by libsmth is composed of nine functions:
 \li \c SMTH_open : Opens a stream with the given url and params
+\li \c SMTH_open_async : Opens a stream without blocking: its fragments will be
+    delivered to the given callbacks, and acknowledged with
+    \c SMTH_ackfragment as they are consumed
+\li \c SMTH_open_external : As \c SMTH_open_async, but driven by the caller's
+    event loop through \c SMTH_getfds, \c SMTH_gettimeout and \c SMTH_process
 \li \c SMTH_getinfo: Get various metadata about the playing stream
+\li \c SMTH_setopt: Tunes the behaviour of an handle (e.g. read-ahead)
 \li \c SMTH_EOS: signals whether the end of the selected stream has been reached
 \li \c SMTH_read : Performs a read on the pseudofile object returned by SMTH_open
+\li \c SMTH_readsample : Reads a single sample (access unit) at a time
+\li \c SMTH_seek : Moves the read cursor of a stream to a given time
 \li \c SMTH_close : Closes the handle.
 Note that SMTHh is \e not a \c FILE like object: it \e must be destroyed with a
 call to SMTH_close.
 
+Demuxers may avoid the copy performed by \c SMTH_read taking parsed fragments
+straight from the read-ahead queue with \c SMTH_getfragment. Each fragment is
+reference counted: it \e must be given back with \c SMTH_releasefragment
+(\c SMTH_retainfragment adds a reference, e.g. to share it between threads).
+
+Handles are thread safe, as long as \c SMTH_close is not called while other
+calls are in progress. Streams share no lock: audio and video may be read by
+different threads without slowing each other, while concurrent calls on the
+same stream are serialised.
+
+The bitrate of each fragment is chosen by a strategy, set with the \c SMTH_ABR
+option: \c SMTH_throughputabr (the default) follows the network throughput,
+\c SMTH_bufferabr the read-ahead buffer level, as BOLA does, and
+\c SMTH_hybridabr both, trading some quality for fewer rebuffers on congested
+networks. They may be tuned with a \c SMTH_abrparams, or replaced altogether.
+
+The Manifest of a live presentation is downloaded again once per fragment
+duration, with a conditional request: only the new chunks are parsed and
+appended to each stream, whose readers wait for them at the live edge. If the
+fragments announce those following them, as servers with a lookahead do, the
+announced chunks are requested right away, and the Manifest is only polled
+now and then to learn when the presentation is over. Live streams reach their
+\c EOS once it is.
+
+Fragments may be kept on disk, setting a directory with the \c SMTH_CACHE_DIR
+option: a presentation played again, by the same process or by any other using
+that directory, is then read from there rather than downloaded. The least
+recently used fragments are evicted once the directory holds more than
+\c SMTH_CACHE_BYTES. Setting \c SMTH_MEMORY_BYTES, parsed fragments are also
+kept in memory, and handed as they are to any handle of the process asking
+for the same chunk, as viewers of a live presentation do. The Manifest of an
+on-demand presentation is kept there too, as a binary image: when it is opened
+again, the server is only asked whether the image is still current, and if it
+is, the image is mapped back in place of parsing the \c XML.
+
 \subsection dadda Example
 
 Here is a tiny example of how the lib may be used to read a single chunk from
@@ -136,6 +212,12 @@ internal API, as documented in this paper.
  * \brief Opens an url for a Smooth Stream and registers a handle, which will
  *        be used to fetch data with subsequent calls to \c SMTH_read
  *
+ * Only the Manifest is downloaded here: the call returns as soon as it has been
+ * parsed. Each stream is then fed by a background worker, which keeps a window
+ * of fragments (\sa SMTH_READAHEAD_FRAGMENTS) downloaded and parsed ahead of
+ * \c SMTH_read. Hence, the time needed to open a stream does not depend on its
+ * length.
+ *
  * \param url    The url from which to retrieve the Smooth Stream
  * \param params Optional \c GET params to make the request (e.g. authentication
  *               codes, pages, etc...), as an urlencoded string.
@@ -143,19 +225,57 @@ internal API, as documented in this paper.
  */
 Handle *SMTH_open(const char *url, const char *params)
 {
-	DynList cachelist;
-	count_t i;
 	error_t error;
 
-	FILE *mfile = SMTH_fetchmanifest(url, params);
+	Handle *handle = calloc(1, sizeof (Handle));
+
+	if (!handle)
+	{
+		SMTH_error(SMTH_NO_MEMORY, stderr);
+		return NULL;
+	}
+
+	error = SMTH_fetchmanifest(url, params, &handle->manifest,
+		&handle->refresher.update);
+	if (!error) error = SMTH_openstreams(handle, url, params, NULL);
 
-	if (!mfile)
+	if (error)
 	{
-		SMTH_error(SMTH_NO_FILE_HANDLE, stderr);
+		SMTH_error(error, stderr);
+		SMTH_disposeupdate(&handle->refresher.update);
+		free(handle);
 		return NULL;
 	}
 
-	Handle *handle = malloc(sizeof (Handle));
+	return handle;
+}
+
+/**
+ * \brief Opens an url for a Smooth Stream without blocking, and registers a
+ *        handle whose data will be delivered through \c callbacks.
+ *
+ * All asynchronous handles are served by a single library thread, which
+ * downloads the Manifest and then the fragments of every stream, in order.
+ * Thus, many handles may be open at once without a thread each. Each stream
+ * keeps a read-ahead window, as \c SMTH_open does: fragments are delivered
+ * until it is full, and then as they are acknowledged with
+ * \c SMTH_ackfragment.
+ * Until \c SMTH_callbacks::on_manifest is called, the handle may only be passed
+ * to \c SMTH_close. \c SMTH_read and the like do not apply to it.
+ *
+ * \param url       The url from which to retrieve the Smooth Stream
+ * \param params    Optional \c GET params to make the request, as an
+ *                  urlencoded string.
+ * \param callbacks The event handlers. They are copied.
+ * \param userdata  Opaque pointer passed to the handlers.
+ * \return          A pseudofile handle, or \c NULL
+ */
+Handle *SMTH_open_async(const char *url, const char *params,
+	const SMTH_callbacks *callbacks, void *userdata)
+{
+	error_t error;
+
+	Handle *handle = calloc(1, sizeof (Handle));
 
 	if (!handle)
 	{
@@ -163,71 +283,182 @@ Handle *SMTH_open(const char *url, const char *params)
 		return NULL;
 	}
 
-	error = SMTH_parsemanifest(&handle->manifest, mfile);
-	fclose(mfile);
+	handle->async = true;
+	handle->callbacks = *callbacks;
+	handle->userdata = userdata;
+	handle->url = strdup(url);
+	handle->params = params? strdup(params): NULL;
+
+	if (!handle->url || (params && !handle->params))
+		error = SMTH_NO_MEMORY;
+	else error = SMTH_submithandle(handle);
 
 	if (error)
 	{
 		SMTH_error(error, stderr);
+		free(handle->url);
+		free(handle->params);
+		SMTH_disposeupdate(&handle->refresher.update);
+		free(handle);
 		return NULL;
 	}
 
-	if (!handle->manifest.streams)
+	return handle;
+}
+
+/**
+ * \brief Opens an url for a Smooth Stream without blocking, and registers a
+ *        handle to be driven by the caller's own event loop.
+ *
+ * The handle behaves as one opened by \c SMTH_open_async, but no library thread
+ * is involved: the loop watches the sockets listed by \c SMTH_getfds, and calls
+ * \c SMTH_process whenever one of them is ready, or the time given by
+ * \c SMTH_gettimeout has elapsed. Callbacks are issued from \c SMTH_process.
+ * Each handle has its own multi handle and sockets, so that a single thread may
+ * drive any number of them, while connections, DNS lookups and TLS sessions
+ * are shared across the process.
+ *
+ * \param url       The url from which to retrieve the Smooth Stream
+ * \param params    Optional \c GET params to make the request, as an
+ *                  urlencoded string.
+ * \param callbacks The event handlers. They are copied.
+ * \param userdata  Opaque pointer passed to the handlers.
+ * \return          A pseudofile handle, or \c NULL
+ */
+Handle *SMTH_open_external(const char *url, const char *params,
+	const SMTH_callbacks *callbacks, void *userdata)
+{
+	error_t error;
+
+	Handle *handle = calloc(1, sizeof (Handle));
+
+	if (!handle)
 	{
+		SMTH_error(SMTH_NO_MEMORY, stderr);
 		return NULL;
 	}
 
-	SMTH_preparelist(&cachelist);
-
-	for (i = 0; handle->manifest.streams[i]; ++i) /* if possible find something more efficient */ // thread
-	{
-		StreamHandle *streamh = malloc(sizeof (StreamHandle));
-		if (!streamh)
-		{
-			SMTH_error(SMTH_NO_MEMORY, stderr); //will leak
-			return NULL;
-		}
+	handle->async = true;
+	handle->external = true;
+	handle->callbacks = *callbacks;
+	handle->userdata = userdata;
+	handle->url = strdup(url);
+	handle->params = params? strdup(params): NULL;
 
-		streamh->cachedir = SMTH_fetch(url, handle->manifest.streams[i], 0);
-		if (!streamh->cachedir)
-		{
-			SMTH_error(SMTH_NO_MEMORY, stderr); //will leak
-			return NULL;
-		}
-			
-		streamh->index = 0;
-		streamh->parsed = false;
-		streamh->EOS = false;
+	if (!handle->url || (params && !handle->params))
+		error = SMTH_NO_MEMORY;
+	else if (!SMTH_startcurl())
+		error = FECTHER_FAILED_INIT;
+	else error = SMTH_initpoller(&handle->poller, false);
 
-		if (!SMTH_addtolist(streamh, &cachelist))
-		{
-			SMTH_error(SMTH_NO_MEMORY, stderr);
-			return NULL;
-		}
+	if (!error)
+	{
+		handle->multi = handle->poller.multi;
+		error = SMTH_starthandle(handle);
 	}
 
-	handle->streamsno =  cachelist.index;
-
-	if (!SMTH_finalizelist(&cachelist))
+	if (error)
 	{
-		SMTH_error(SMTH_NO_MEMORY, stderr);
+		SMTH_error(error, stderr);
+		SMTH_disposehandle(handle);
 		return NULL;
 	}
 
-	handle->streams = (StreamHandle**)cachelist.list;
+	return handle;
+}
+
+/**
+ * \brief Lists the sockets an external handle needs to be watched.
+ *
+ * The list changes as connections come and go: it should be fetched again
+ * after each call to \c SMTH_process.
+ *
+ * \param handle The handle, opened with \c SMTH_open_external
+ * \param fds    Where to store the sockets.
+ * \param size   The number of slots in \c fds
+ * \return       The number of sockets to be watched, which may be greater than
+ *               \c size: only the first \c size are stored then.
+ */
+size_t SMTH_getfds(Handle *handle, SMTH_pollfd *fds, size_t size)
+{
+	count_t i;
+
+	if (!handle->external) return 0;
 
-	if (handle->manifest.islive)
+	Poller *p = &handle->poller;
+
+	for (i = 0; i < p->socketsno && i < size; ++i)
 	{
-		handle->url = strdup(url);
-		handle->params = params? strdup(params): NULL;
+		fds[i].fd = p->sockets[i].fd;
+		fds[i].events = 0;
+		if (p->sockets[i].what & CURL_POLL_IN) fds[i].events |= SMTH_POLLIN;
+		if (p->sockets[i].what & CURL_POLL_OUT) fds[i].events |= SMTH_POLLOUT;
 	}
-	else
+
+	return p->socketsno;
+}
+
+/**
+ * \brief Tells when an external handle must be processed, even if none of its
+ *        sockets is ready.
+ *
+ * \param handle The handle, opened with \c SMTH_open_external
+ * \return       The time left, in ms (\c 0 means now), or \c -1 for no timeout.
+ */
+long SMTH_gettimeout(Handle *handle)
+{
+	if (!handle->external) return -1;
+
+	long timeout = SMTH_pollertimeout(&handle->poller);
+	long retry = SMTH_retrydelay(handle);
+
+	/* a failed transfer may have to be retried before anything happens */
+	if (retry >= 0 && (timeout < 0 || retry < timeout)) timeout = retry;
+
+	return timeout;
+}
+
+/**
+ * \brief Lets an external handle act on a ready socket, or on the expired
+ *        timeout, issuing the callbacks of whatever was completed.
+ *
+ * The handle may be closed from a callback: it is disposed of as soon as the
+ * call returns.
+ *
+ * \param handle The handle, opened with \c SMTH_open_external
+ * \param fd     The ready socket, or \c SMTH_NOFD when the timeout expired.
+ * \param events What the socket is ready for, as \c SMTH_POLLIN,
+ *               \c SMTH_POLLOUT and \c SMTH_POLLERR flags.
+ * \return       \c 0 if the handle has nothing left to do (all of its streams
+ *               are over, or it failed), nonzero otherwise (e.g. while a
+ *               stream waits for its fragments to be acknowledged).
+ */
+int SMTH_process(Handle *handle, int fd, int events)
+{
+	int what = 0;
+
+	if (!handle->external || handle->closing) return 0;
+
+	if (events & SMTH_POLLIN) what |= CURL_CSELECT_IN;
+	if (events & SMTH_POLLOUT) what |= CURL_CSELECT_OUT;
+	if (events & SMTH_POLLERR) what |= CURL_CSELECT_ERR;
+
+	handle->processing = true;
+	SMTH_polleraction(&handle->poller,
+		fd == SMTH_NOFD? CURL_SOCKET_TIMEOUT: fd, what);
+	SMTH_dispatchmessages(handle->multi);
+	if (!handle->closing) SMTH_retryhandle(handle);
+	handle->processing = false;
+
+	if (handle->orphan)
 	{
-		handle->url = NULL;
-		handle->params = NULL;
+		SMTH_stophandle(handle);
+		SMTH_disposehandle(handle);
+		return 0;
 	}
 
-	return handle;
+	return handle->poller.socketsno || handle->poller.timed ||
+		SMTH_retrydelay(handle) >= 0 || SMTH_pausedhandle(handle);
 }
 
 /**
@@ -238,59 +469,265 @@ Handle *SMTH_open(const char *url, const char *params)
  * will return the next chunk. The input stream is empty when two or more subsequent
  * calls return a \c 0 value.
  *
+ * Fragments are taken from the read-ahead queue, so that the call waits
+ * only if the worker has fallen behind (e.g. right after \c SMTH_open).
+ *
  * \return the number of bytes effectively read (0, in case of error or \c EOS)
  */
 size_t SMTH_read(void *buffer, size_t size, int stream, Handle *handle)
 {
 	size_t writtens = 0;
 
-	if (stream >= handle->streamsno) return 0;
+	if (handle->async || stream < 0 ||
+		(count_t) stream >= handle->streamsno) return 0;
 	
 	StreamHandle *s = handle->streams[stream];
 
-	/* If this is over... */
-	if (!s->remaining && s->parsed)
+	pthread_mutex_lock(&s->readlock);
+
+	if (s->active || activate(s))
 	{
-		SMTH_disposefragment(&s->active);
-		s->parsed = false;
-		return 0;
+		SharedFragment *f = s->active;
+		length_t offset = (byte_t*) s->cursor - f->fragment.data;
+
+		/* the payload may still be arriving */
+		s->remaining = waitpayload(s, f, offset + 1) - offset;
+
+		/* If this is over... */
+		if (!s->remaining)
+		{   SMTH_releasefragment(&f->view);
+			s->active = NULL;
+		}
+		else
+		{   writtens = size < s->remaining? size: s->remaining;
+			memcpy(buffer, s->cursor, writtens);
+			s->cursor = &s->cursor[writtens]; /* seek the stream */
+			s->remaining -= writtens;
+		}
 	}
 
-	if (!s->parsed)
+	pthread_mutex_unlock(&s->readlock);
+
+	return writtens;
+}
+
+/**
+ * \brief Reads the next sample of \c Stream \c stream, as described by the
+ *        \c TrunBox of its fragment.
+ *
+ * Unlike \c SMTH_read, samples are not copied: \c SMTH_sample::data points
+ * into the fragment payload, and it stays valid until the next call on the same
+ * stream. Fragment boundaries are crossed transparently, and if some bytes were
+ * already consumed with \c SMTH_read, the next whole sample is returned.
+ * A sample is returned as soon as its bytes arrived, even if the rest of its
+ * fragment is still being downloaded.
+ *
+ * \param sample Where to store the sample metadata.
+ * \param stream The index of the stream.
+ * \param handle The handle to read from.
+ * \return       \c 1 if a sample was read, \c 0 in case of error or \c EOS
+ */
+int SMTH_readsample(SMTH_sample *sample, int stream, Handle *handle)
+{
+	if (handle->async || stream < 0 ||
+		(count_t) stream >= handle->streamsno) return 0;
+
+	StreamHandle *s = handle->streams[stream];
+	int found = 0;
+
+	pthread_mutex_lock(&s->readlock);
+
+	while (!found && (s->active || activate(s)))
 	{
-		/* If everything is over... */
-		if (!handle->manifest.streams[stream]->chunks[s->index])
+		SharedFragment *f = s->active;
+		const unsigned char *cursor = (unsigned char*) s->cursor;
+
+		/* skip whatever was consumed by SMTH_read */
+		while (s->sample < f->view.samplesno &&
+			f->samples[s->sample].data < cursor) s->sample++;
+
+		/* the payload may still be arriving */
+		length_t end = 0, available = 0;
+		if (s->sample < f->view.samplesno)
+		{   end = sampleend(f, s->sample);
+			available = waitpayload(s, f, end);
+		}
+
+		if (s->sample < f->view.samplesno && available >= end)
 		{
-			s->EOS = true;
-			return 0;
+			*sample = f->samples[s->sample++];
+			cursor = &sample->data[sample->size];
+			s->remaining = available - end;
+			s->cursor = (byte_t*) cursor;
+			found = 1;
+		}
+		else
+		{   SMTH_releasefragment(&f->view);
+			s->active = NULL;
 		}
+	}
+
+	pthread_mutex_unlock(&s->readlock);
 
-		char filename[SMTH_MAX_FILENAME_LENGHT];
-		snprintf(filename, SMTH_MAX_FILENAME_LENGHT, "%s/%lu", s->cachedir,
-			handle->manifest.streams[stream]->chunks[s->index]->time);
+	return found;
+}
 
-		fcloseall(); /* XXX workaround... stupid CURLOPT_PRIVATE */
+/**
+ * \brief Moves the read cursor of \c Stream \c stream to the fragment
+ *        holding \c time.
+ *
+ * The fragment is looked up by binary search on \c Chunk::time. If it was
+ * already read ahead, only the fragments before it are dropped; otherwise, the
+ * queue is emptied, transfers in flight are cancelled and the worker restarts
+ * from the target, so that the seek costs a single download. Seeking also
+ * rewinds a stream that reached its \c EOS.
+ *
+ * \param handle The handle to be moved.
+ * \param stream The index of the stream.
+ * \param time   The target time, in ticks \sa SMTH_TIMESCALE
+ * \return       \c 1 on success, \c 0 if the stream can't be seeked.
+ */
+int SMTH_seek(Handle *handle, int stream, tick_t time)
+{
+	if (stream < 0 || (count_t) stream >= handle->streamsno) return 0;
 
-		FILE* input = fopen(filename, "rx"); /* FIXME ifdefined GLIBC */
-		unlink(filename); /* will be removed after fclose() */
-		if (!input) return 0;
+	StreamHandle *s = handle->streams[stream];
+	if (!s->running) return 0;
 
-		if (SMTH_parsefragment(&s->active, input) != FRAGMENT_SUCCESS)
-			return 0;
+	pthread_mutex_lock(&s->readlock);
 
-		fclose(input);
-		s->remaining = s->active.size;
-		s->cursor = s->active.data;
-		s->parsed = true;
-		s->index++;
+	if (s->active)
+	{   SMTH_releasefragment(&s->active->view);
+		s->active = NULL;
 	}
 
-	writtens = size < s->remaining? size: s->remaining;
-	memcpy(buffer, s->cursor, writtens);
-	s->cursor = &s->cursor[writtens]; /* seek the stream */
-	s->remaining -= writtens;
+	pthread_mutex_lock(&s->lock);
 
-	return writtens;
+	/* a live timeline may be growing: the worker holds the lock then */
+	count_t index = findchunk(handle->manifest.streams[stream], time);
+
+	flushqueue(s, index);
+
+	if (!s->queued)
+	{
+		s->index = index;
+		s->seeks++;
+		s->over = false;
+		s->starved = false;
+		SMTH_interruptfetcher(&s->fetcher);
+		pthread_cond_signal(&s->drained);
+	}
+	s->EOS = false;
+
+	pthread_mutex_unlock(&s->lock);
+	pthread_mutex_unlock(&s->readlock);
+
+	return 1;
+}
+
+/**
+ * \brief Takes the next parsed fragment of \c Stream \c stream, without
+ *        copying its payload.
+ *
+ * If the fragment was partially read with \c SMTH_read, it is handed out as a
+ * whole, and the next \c SMTH_read will start from the following one. Like
+ * \c SMTH_read, the call waits only if the read-ahead worker has fallen behind.
+ *
+ * \param handle The handle to read from.
+ * \param stream The index of the stream.
+ * \return       A read-only view of the fragment, to be given back with
+ *               \c SMTH_releasefragment, or \c NULL in case of \c EOS
+ */
+const SMTH_fragment *SMTH_getfragment(Handle *handle, int stream)
+{
+	if (handle->async || stream < 0 ||
+		(count_t) stream >= handle->streamsno) return NULL;
+
+	StreamHandle *s = handle->streams[stream];
+
+	pthread_mutex_lock(&s->readlock);
+
+	SharedFragment *f = s->active;
+
+	if (f) s->active = NULL; /* the reference goes to the caller */
+	else f = dequeue(s);
+
+	/* the caller expects the whole payload */
+	if (f) waitpayload(s, f, f->view.size);
+
+	pthread_mutex_unlock(&s->readlock);
+
+	return f? &f->view: NULL;
+}
+
+/**
+ * \brief Adds a reference to a fragment returned by \c SMTH_getfragment.
+ *
+ * Each call must be matched by a call to \c SMTH_releasefragment.
+ *
+ * \param fragment The fragment to be retained.
+ */
+void SMTH_retainfragment(const SMTH_fragment *fragment)
+{
+	SharedFragment *f = (SharedFragment*) fragment;
+
+	__sync_add_and_fetch(&f->refs, 1);
+}
+
+/**
+ * \brief Gives back a fragment returned by \c SMTH_getfragment, and disposes
+ *        of it when no more references are held.
+ *
+ * \param fragment The fragment to be released.
+ */
+void SMTH_releasefragment(const SMTH_fragment *fragment)
+{
+	SharedFragment *f = (SharedFragment*) fragment;
+
+	if (!f || __sync_sub_and_fetch(&f->refs, 1)) return;
+
+	if (f->origin) SMTH_releasefragment(f->origin);
+	else SMTH_disposefragment(&f->fragment);
+	free(f->samples);
+	free(f);
+}
+
+/**
+ * \brief Tells an asynchronous handle that the oldest fragment of a stream
+ *        not acknowledged yet was consumed (e.g. played), giving its room in
+ *        the read-ahead window back.
+ *
+ * Fragments delivered to \c SMTH_callbacks::on_fragment fill the window of
+ * their stream (\sa SMTH_READAHEAD_FRAGMENTS): once it is full, nothing else
+ * is downloaded until some of them are acknowledged. Acknowledged as they are
+ * played, they tell the bitrate strategy how much media is buffered.
+ * It may be called from any thread, handlers included.
+ *
+ * \param handle The handle, opened with \c SMTH_open_async or
+ *               \c SMTH_open_external
+ * \param stream The index of the stream.
+ * \return       Nonzero if a fragment was acknowledged, \c 0 if none was
+ *               waiting.
+ */
+int SMTH_ackfragment(Handle *handle, int stream)
+{
+	SharedFragment *f = NULL;
+
+	if (!handle->async || stream < 0 ||
+		(count_t) stream >= handle->streamsno) return 0;
+
+	StreamHandle *s = handle->streams[stream];
+
+	pthread_mutex_lock(&s->lock);
+	if (s->queued) f = unqueue(s);
+	resume(s);
+	pthread_mutex_unlock(&s->lock);
+
+	if (!f) return 0;
+
+	SMTH_releasefragment(&f->view);
+
+	return 1;
 }
 
 /**
@@ -300,31 +737,114 @@ size_t SMTH_read(void *buffer, size_t size, int stream, Handle *handle)
  */
 void SMTH_close(Handle *handle)
 {
-	int i;
+	if (handle->external)
+	{
+		/* closed from a callback: SMTH_process will dispose of it */
+		if (handle->processing)
+		{   handle->closing = true;
+			handle->orphan = true;
+			return;
+		}
+		SMTH_stophandle(handle);
+	}
+	/* if the dispatcher takes care of it, we are done */
+	else if (handle->async && !SMTH_withdrawhandle(handle)) return;
 
-	SMTH_disposemanifest(&handle->manifest);
+	SMTH_disposehandle(handle);
+}
 
-	for (i = 0; i < handle->streamsno; ++i)
-	{
-		rmdir(handle->streams[i]->cachedir); /* will delete empty cache dirs */
-		free(handle->streams[i]->cachedir);
-		free(handle->streams[i]);
+/**
+ * \brief Sets an option for a handle.
+ *
+ * \warning The value must be passed exactly with the type specified in
+ *          \c SMTH_option, e.g. casting constants to \c size_t.
+ *
+ * \param what   The option to be set.
+ * \param handle The handle to be modified, or \c NULL to change the default
+ *               value for the handles that will be opened afterwards.
+ * \param value  The new value of the option.
+ */
+void SMTH_setopt(SMTH_option what, Handle *handle, ...)
+{
+	va_list args;
+	count_t i;
+	size_t value = 0;
+	const SMTH_abr *abr = NULL;
+	const char *dir = NULL;
+
+	va_start(args, handle);
+	if (what == SMTH_ABR) abr = va_arg(args, const SMTH_abr*);
+	else if (what == SMTH_CACHE_DIR) dir = va_arg(args, const char*);
+	else value = va_arg(args, size_t);
+	va_end(args);
+
+	/* the caches are shared by the whole process */
+	if (what == SMTH_CACHE_DIR)
+	{   error_t error = SMTH_setcachedir(dir);
+		if (error) SMTH_error(error, stderr);
+		return;
+	}
+	if (what == SMTH_CACHE_BYTES)
+	{   SMTH_setcachebudget(value);
+		return;
+	}
+	if (what == SMTH_MEMORY_BYTES)
+	{   SMTH_setmemorybudget(value);
+		return;
 	}
 
-	if (handle->manifest.islive)
+	if (!handle)
 	{
-		free(handle->url);
-		if (handle->params) free(handle->params);
+		switch (what)
+		{
+			case SMTH_READAHEAD_FRAGMENTS:
+				__atomic_store_n(&defaultfragments, value, __ATOMIC_RELAXED);
+				break;
+			case SMTH_READAHEAD_BYTES:
+				__atomic_store_n(&defaultbytes, value, __ATOMIC_RELAXED);
+				break;
+			case SMTH_TRANSFERS:
+				__atomic_store_n(&defaulttransfers, value, __ATOMIC_RELAXED);
+				break;
+			case SMTH_SPILL:
+				__atomic_store_n(&defaultspill, value != 0, __ATOMIC_RELAXED);
+				break;
+			case SMTH_ABR:
+				__atomic_store_n(&defaultabr, abr, __ATOMIC_RELAXED);
+				break;
+			default: break;
+		}
+		return;
 	}
 
-	free(handle->streams);
-	free(handle);
+	for (i = 0; i < handle->streamsno; ++i)
+	{
+		StreamHandle *s = handle->streams[i];
+
+		pthread_mutex_lock(&s->lock);
+		switch (what)
+		{
+			case SMTH_READAHEAD_FRAGMENTS:
+				s->maxfragments = value;
+				SMTH_setbuffer(&s->fetcher, s->queuedticks, value);
+				break;
+			case SMTH_READAHEAD_BYTES: s->maxbytes = value; break;
+			case SMTH_TRANSFERS: SMTH_settransfers(&s->fetcher, value); break;
+			case SMTH_SPILL: SMTH_setspill(&s->fetcher, value != 0); break;
+			case SMTH_ABR: SMTH_setabr(&s->fetcher, abr); break;
+			default: break;
+		}
+		pthread_cond_signal(&s->drained); /* the window may be larger */
+		if (handle->async) resume(s);
+		pthread_mutex_unlock(&s->lock);
+	}
 }
 
 /**
  * \brief Signals whether a stream is over.
  *
- * \warning Note that a live stream will never reach this state!
+ * \warning Note that a live stream reaches this state only once the
+ *          presentation is over.
  *
  * \param handle The handle to be tested
  * \param stream The index of the stream to be tested
@@ -333,7 +853,15 @@ void SMTH_close(Handle *handle)
 int SMTH_EOS(Handle *handle, count_t stream)
 {
 	if (stream >= handle->streamsno) return 1;
-	return handle->streams[stream]->EOS;
+
+	StreamHandle *s = handle->streams[stream];
+	int EOS;
+
+	pthread_mutex_lock(&s->readlock);
+	EOS = s->EOS;
+	pthread_mutex_unlock(&s->readlock);
+
+	return EOS;
 }
 
 /**
@@ -364,6 +892,7 @@ void SMTH_getinfo(SMTH_setting what, Handle *handle, ...)
 	hexdata **dest_hex;
 	metric_t **dest_metrics;
 	flags_t *dest_flags;
+	tick_t *dest_ticks;
 	SMTH_type *dest_type;
 
 	va_start(args, stream);
@@ -457,6 +986,11 @@ void SMTH_getinfo(SMTH_setting what, Handle *handle, ...)
 			*dest_size = handle->manifest.islive;
 			break;
 
+		case SMTH_TIMESCALE:
+			dest_ticks = va_arg(args, tick_t*);
+			*dest_ticks = astream->tick? astream->tick: handle->manifest.tick;
+			break;
+
 		default:
 			dest_char = va_arg(args, chardata**);
 			*dest_char = NULL;
@@ -479,4 +1013,773 @@ end:
 
 }
 
+/**
+ * \brief Prepares the streams of a handle, once its Manifest was parsed.
+ *
+ * \param handle The handle, whose \c Manifest was filled.
+ * \param url    The url of the Smooth Stream
+ * \param params The \c GET params of the request, or \c NULL
+ * \param multi  For asynchronous handles, the multi handle of the dispatcher,
+ *               which will feed the streams. Otherwise, \c NULL: a read-ahead
+ *               worker is started for each stream.
+ * \return       \c FETCHER_SUCCESS or an appropriate error code. On failure,
+ *               the contents of \c handle are disposed of, but not the handle.
+ */
+error_t SMTH_openstreams(Handle *handle, const char *url, const char *params,
+	CURLM *multi)
+{
+	DynList cachelist;
+	count_t i;
+	error_t error;
+
+	if (!handle->manifest.streams)
+	{   SMTH_disposemanifest(&handle->manifest);
+		memset(&handle->manifest, 0x00, sizeof (Manifest));
+		return SMTH_NO_FILE_HANDLE;
+	}
+
+	SMTH_preparelist(&cachelist);
+
+	for (i = 0; handle->manifest.streams[i]; ++i)
+	{
+		StreamHandle *streamh = calloc(1, sizeof (StreamHandle));
+		if (!streamh || !SMTH_addtolist(streamh, &cachelist))
+		{
+			error = SMTH_NO_MEMORY;
+			free(streamh);
+			goto failed;
+		}
+
+		streamh->owner = handle;
+		streamh->number = i;
+
+		pthread_mutex_init(&streamh->readlock, NULL);
+		pthread_mutex_init(&streamh->lock, NULL);
+		pthread_cond_init(&streamh->filled, NULL);
+		pthread_cond_init(&streamh->drained, NULL);
+		streamh->maxfragments = __atomic_load_n(&defaultfragments,
+			__ATOMIC_RELAXED);
+		streamh->maxbytes = __atomic_load_n(&defaultbytes, __ATOMIC_RELAXED);
+		streamh->live = handle->manifest.islive;
+
+		error = SMTH_initfetcher(&streamh->fetcher, url,
+			handle->manifest.streams[i], 0, multi);
+		streamh->fetcher.userdata = streamh;
+		SMTH_settransfers(&streamh->fetcher,
+			__atomic_load_n(&defaulttransfers, __ATOMIC_RELAXED));
+		SMTH_setspill(&streamh->fetcher,
+			__atomic_load_n(&defaultspill, __ATOMIC_RELAXED));
+		SMTH_setabr(&streamh->fetcher,
+			__atomic_load_n(&defaultabr, __ATOMIC_RELAXED));
+		if (!error) SMTH_setcache(&streamh->fetcher, SMTH_defaultcache());
+		streamh->fetcher.timescale = handle->manifest.streams[i]->tick?
+			handle->manifest.streams[i]->tick: handle->manifest.tick;
+		SMTH_setbuffer(&streamh->fetcher, 0, streamh->maxfragments);
+		if (error == FECTHER_NO_URL)
+		{	streamh->over = true; /* nothing to download (e.g. embedded data) */
+			continue;
+		}
+		else if (error) goto failed;
+
+		if (multi) continue; /* the dispatcher will feed it */
+
+		if (pthread_create(&streamh->worker, NULL, readahead, streamh))
+		{
+			error = SMTH_NO_WORKER;
+			goto failed;
+		}
+		streamh->running = true;
+	}
+
+	if (!SMTH_finalizelist(&cachelist))
+	{
+		error = SMTH_NO_MEMORY;
+		goto failed;
+	}
+
+	handle->streams = (StreamHandle**)cachelist.list;
+	handle->streamsno = i;
+
+	if (handle->manifest.islive && !handle->url)
+	{
+		handle->url = strdup(url);
+		handle->params = params? strdup(params): NULL;
+	}
+
+	/* without refreshes, a live stream still plays what is known */
+	error = SMTH_startrefresher(handle);
+	if (error) SMTH_error(error, stderr);
+
+	return FETCHER_SUCCESS;
+
+failed:
+	for (i = 0; i < cachelist.index; ++i)
+	{
+		StreamHandle *streamh = (StreamHandle*) cachelist.list[i];
+		stopworker(streamh);
+		free(streamh);
+	}
+	SMTH_disposelist(&cachelist);
+	SMTH_disposemanifest(&handle->manifest);
+	memset(&handle->manifest, 0x00, sizeof (Manifest));
+	return error;
+}
+
+/**
+ * \brief Takes a downloaded \c Chunk and parses it into a shared fragment.
+ *
+ * A chunk downloaded to memory was parsed while it arrived. If the download
+ * is \c progressive, the fragment may be taken as soon as its metadata was
+ * parsed: it is then returned with \c SharedFragment::partial set, and its
+ * slot is held until the payload is settled \sa follow
+ *
+ * \param f           The fetcher the chunk was downloaded with.
+ * \param index       The index of the \c Chunk in \c Stream::chunks
+ * \param progressive Whether the chunk may still be downloading.
+ * \param out         Where to store the fragment, whose reference goes to the
+ *                    caller. If the chunk is broken, it is set to \c NULL, so
+ *                    that it may be skipped.
+ * \return            \c FRAGMENT_SUCCESS or an appropriate error code.
+ */
+error_t SMTH_loadfragment(Fetcher *f, count_t index, bool progressive,
+	SharedFragment **out)
+{
+	SharedFragment *fragment;
+	FragmentParser *parser = NULL;
+	FILE *input = NULL;
+	error_t error = FRAGMENT_SUCCESS;
+
+	*out = NULL;
+
+	/* the slot, hence the bitrate, is gone once the chunk is taken */
+	cachekey_t key = SMTH_chunkkey(f, index);
+	const SMTH_fragment *origin = SMTH_sharedchunk(f, index);
+
+	if (!origin) parser = SMTH_chunkparser(f, index);
+	if (!origin && !parser)
+	{   input = SMTH_openchunk(f, index);
+		if (!input) return FETCHER_NO_FILE;
+	}
+	else if (parser && parser->state != PARSER_DONE &&
+		(!progressive || parser->state != PARSER_PAYLOAD))
+	{   /* a broken chunk will be skipped */
+		SMTH_error(parser->state == PARSER_FAILED? parser->error:
+			FRAGMENT_IO_ERROR, stderr);
+		SMTH_closechunk(f, index);
+		return FRAGMENT_SUCCESS;
+	}
+
+	fragment = calloc(1, sizeof (SharedFragment));
+	if (!fragment)
+	{   if (origin) SMTH_releasefragment(origin);
+		else if (input)
+		{   fclose(input);
+			SMTH_keepchunk(f, false);
+		}
+		else SMTH_closechunk(f, index);
+		return SMTH_NO_MEMORY;
+	}
+
+	if (origin)
+	{   /* parsed by another handle: only the view is our own */
+		fragment->origin = origin;
+		fragment->fragment = ((SharedFragment*) origin)->fragment;
+		fragment->received = fragment->fragment.size;
+	}
+	else if (input)
+	{   error = SMTH_mapfragment(&fragment->fragment, input);
+		fclose(input);
+		SMTH_keepchunk(f, !error); /* only a sound copy is cached */
+		if (error)
+		{   SMTH_error(error, stderr);
+			free(fragment); /* a broken chunk will be skipped */
+			return FRAGMENT_SUCCESS;
+		}
+		fragment->received = fragment->fragment.size;
+	}
+	else
+	{   SMTH_adoptfragment(parser, &fragment->fragment);
+		fragment->received = parser->received;
+		fragment->partial = parser->state != PARSER_DONE;
+		if (!fragment->partial) SMTH_closechunk(f, index);
+	}
+
+	fragment->chunk = index;
+	if (!origin) fragment->key = key;
+
+	if (!sharefragment(fragment, f->stream->chunks[index]))
+	{   /* the parser must not write anymore to the payload */
+		if (fragment->partial) SMTH_closechunk(f, index);
+		SMTH_releasefragment(&fragment->view);
+		return SMTH_NO_MEMORY;
+	}
+
+	if (!fragment->partial) keepfragment(fragment);
+
+	*out = fragment;
+
+	return FRAGMENT_SUCCESS;
+}
+
+/**
+ * \brief Counts a fragment delivered by an asynchronous handle in the
+ *        read-ahead window of its stream, until it is acknowledged
+ *        \sa SMTH_ackfragment
+ *
+ * \param s The stream the fragment belongs to.
+ * \param f The fragment. A reference to it is taken.
+ * \return  \c false if the window could not be grown, \c true otherwise.
+ */
+bool SMTH_holdfragment(StreamHandle *s, SharedFragment *f)
+{
+	bool held;
+
+	pthread_mutex_lock(&s->lock);
+	held = enqueue(s, f);
+	if (held) SMTH_retainfragment(&f->view);
+	pthread_mutex_unlock(&s->lock);
+
+	return held;
+}
+
+/**
+ * \brief Pauses an asynchronous stream if its read-ahead window is full. It
+ *        is resumed as soon as fragments are acknowledged.
+ *
+ * \param s The stream to be fed.
+ * \return  Whether the stream is paused.
+ */
+bool SMTH_pausestream(StreamHandle *s)
+{
+	bool paused;
+
+	pthread_mutex_lock(&s->lock);
+	paused = s->paused = windowisfull(s);
+	pthread_mutex_unlock(&s->lock);
+
+	return paused;
+}
+
+/**
+ * \brief Disposes of a handle and everything it holds.
+ *
+ * \param handle The handle to be disposed of.
+ */
+void SMTH_disposehandle(Handle *handle)
+{
+	count_t i;
+
+	/* the refresher hands chunks over to the streams */
+	SMTH_stoprefresher(handle);
+
+	for (i = 0; i < handle->streamsno; ++i)
+	{
+		stopworker(handle->streams[i]);
+		free(handle->streams[i]);
+	}
+
+	SMTH_disposemanifest(&handle->manifest);
+	if (handle->external) SMTH_disposepoller(&handle->poller);
+
+	free(handle->url);
+	free(handle->params);
+	free(handle->streams);
+	free(handle);
+}
+
+/*------------------------- HIC SUNT LEONES (CODICIS) ------------------------*/
+
+/**
+ * \brief Read-ahead worker: downloads and parses the chunks of a stream,
+ *        and queues them for \c SMTH_read, until the window is full.
+ *
+ * \param data The \c StreamHandle to be fed.
+ */
+static void *readahead(void *data)
+{
+	StreamHandle *s = data;
+	error_t error;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (!s->quit)
+	{
+		if (s->over || s->starved || windowisfull(s))
+		{   pthread_cond_wait(&s->drained, &s->lock);
+			continue;
+		}
+
+		/* the timeline grows only here, while nobody else reads it */
+		error = SMTH_takechunks(s);
+		if (error)
+		{   SMTH_error(error, stderr);
+			s->over = true;
+			pthread_cond_broadcast(&s->filled);
+			continue;
+		}
+
+		count_t index = s->index;
+		count_t seeks = s->seeks;
+
+		SMTH_resumefetcher(&s->fetcher);
+
+		/* network and parsing happen out of the lock */
+		pthread_mutex_unlock(&s->lock);
+
+		SharedFragment *f = NULL;
+
+		/* take the fragment as soon as its metadata is available */
+		error = SMTH_fetchprogress(&s->fetcher, index, -1);
+		if (!error || error == FETCHER_PENDING)
+			error = SMTH_loadfragment(&s->fetcher, index, true, &f);
+
+		pthread_mutex_lock(&s->lock);
+
+		if (seeks != s->seeks || s->quit)
+		{   /* the fragment is not needed anymore */
+			if (f && f->partial) SMTH_closechunk(&s->fetcher, index);
+			if (f) SMTH_releasefragment(&f->view);
+			continue;
+		}
+
+		/* the next chunks may be requested without refreshing the Manifest */
+		if (f)
+		{   error_t announced = SMTH_lookahead(s, &f->fragment);
+			if (announced) SMTH_error(announced, stderr);
+		}
+
+		if (f && !enqueue(s, f))
+		{   if (f->partial) SMTH_closechunk(&s->fetcher, index);
+			SMTH_releasefragment(&f->view);
+			error = SMTH_NO_MEMORY;
+		}
+		else if (f && f->partial)
+		{   /* the worker keeps writing the payload, out of the lock */
+			SMTH_retainfragment(&f->view);
+			pthread_mutex_unlock(&s->lock);
+
+			error = follow(s, f);
+			SMTH_releasefragment(&f->view);
+
+			pthread_mutex_lock(&s->lock);
+			if (seeks != s->seeks || s->quit) continue;
+		}
+
+		/* a live stream waits for the refresher */
+		if (error == FETCHER_NO_CHUNK && s->live)
+		{   s->starved = true;
+			continue;
+		}
+
+		/* we can't go on, unless the stream is seeked */
+		if (error) 
+		{   if (error != FETCHER_NO_CHUNK && error != FETCHER_INTERRUPTED)
+				SMTH_error(error, stderr);
+			s->over = true;
+			pthread_cond_broadcast(&s->filled);
+			continue;
+		}
+
+		s->index++;
+	}
+
+	s->over = true;
+	pthread_cond_broadcast(&s->filled);
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+/**
+ * \brief Keeps a partial fragment up to date with its download, waking up its
+ *        readers, until the payload is settled.
+ *
+ * If the download is cut short (by an error, a seek or \c SMTH_close), the
+ * missing tail of the payload is zeroed and \c SharedFragment::received is
+ * left where it was, so that readers will stop there.
+ *
+ * \param s The stream the fragment belongs to.
+ * \param f The fragment, whose slot is released when it is settled.
+ * \return  FETCHER_SUCCESS or an appropriate error code.
+ */
+static error_t follow(StreamHandle *s, SharedFragment *f)
+{
+	FragmentParser *parser;
+	length_t received = f->received;
+	error_t error;
+	bool settled;
+
+	do
+	{
+		error = SMTH_fetchprogress(&s->fetcher, f->chunk, received);
+		parser = SMTH_chunkparser(&s->fetcher, f->chunk);
+		if (parser) received = parser->received;
+		settled = error != FETCHER_PENDING || !parser ||
+			parser->state == PARSER_DONE;
+
+		pthread_mutex_lock(&s->lock);
+		f->received = received;
+		if (settled)
+		{   memset(&f->fragment.data[received], 0x00, f->view.size - received);
+			__atomic_store_n(&f->partial, false, __ATOMIC_RELEASE);
+		}
+		pthread_cond_broadcast(&s->filled);
+		pthread_mutex_unlock(&s->lock);
+	}
+	while (!settled);
+
+	SMTH_closechunk(&s->fetcher, f->chunk);
+	keepfragment(f);
+
+	return error == FETCHER_PENDING? FETCHER_SUCCESS: error;
+}
+
+/**
+ * \brief Waits until the first \c until payload bytes of a fragment may be
+ *        read, or its payload is settled.
+ *
+ * \param s     The stream the fragment belongs to.
+ * \param f     The fragment.
+ * \param until The payload bytes needed.
+ * \return      The payload bytes that may be read.
+ */
+static length_t waitpayload(StreamHandle *s, SharedFragment *f, length_t until)
+{
+	length_t received;
+
+	if (!__atomic_load_n(&f->partial, __ATOMIC_ACQUIRE)) return f->received;
+
+	pthread_mutex_lock(&s->lock);
+	while (__atomic_load_n(&f->partial, __ATOMIC_RELAXED) &&
+		f->received < until) pthread_cond_wait(&s->filled, &s->lock);
+	received = f->received;
+	pthread_mutex_unlock(&s->lock);
+
+	return received;
+}
+
+/**
+ * \brief Tells where a sample ends into the payload of its fragment.
+ *
+ * \param f      The fragment.
+ * \param sample The index of the sample in \c SMTH_fragment::samples
+ * \return       The payload bytes up to the end of the sample.
+ */
+static length_t sampleend(SharedFragment *f, count_t sample)
+{
+	const SMTH_sample *s = &f->samples[sample];
+
+	return &s->data[s->size] - f->view.data;
+}
+
+/**
+ * \brief Tells whether the read-ahead window of a stream is full.
+ *
+ * \warning \c StreamHandle::lock must be held.
+ */
+static bool windowisfull(StreamHandle *s)
+{
+	return (s->maxfragments && s->queued >= s->maxfragments) ||
+		(s->maxbytes && s->queuedbytes >= s->maxbytes);
+}
+
+/**
+ * \brief Stops the worker of a stream, if any, and disposes of everything
+ *        it downloaded.
+ *
+ * \param s The stream to be stopped.
+ */
+static void stopworker(StreamHandle *s)
+{
+	count_t i;
+
+	if (s->running)
+	{
+		pthread_mutex_lock(&s->lock);
+		s->quit = true;
+		pthread_cond_signal(&s->drained);
+		pthread_mutex_unlock(&s->lock);
+
+		SMTH_interruptfetcher(&s->fetcher);
+		pthread_join(s->worker, NULL);
+		s->running = false;
+	}
+
+	flushqueue(s, (count_t) -1);
+	free(s->queue);
+	s->queue = NULL;
+
+	if (s->active) SMTH_releasefragment(&s->active->view);
+	s->active = NULL;
+
+	if (s->fetcher.handle) SMTH_disposefetcher(&s->fetcher);
+
+	/* chunks of a refresh which were never appended to the timeline */
+	for (i = 0; i < s->fresh.index; ++i)
+		SMTH_disposechunk((Chunk*) s->fresh.list[i]);
+	SMTH_disposelist(&s->fresh);
+
+	pthread_cond_destroy(&s->drained);
+	pthread_cond_destroy(&s->filled);
+	pthread_mutex_destroy(&s->lock);
+	pthread_mutex_destroy(&s->readlock);
+}
+
+/**
+ * \brief Takes the next fragment from the read-ahead queue of a stream,
+ *        waiting for the worker if it is empty.
+ *
+ * \param s The stream to read from.
+ * \return  The fragment, whose reference goes to the caller, or \c NULL if
+ *          the stream is over (\c StreamHandle::EOS is then set).
+ */
+static SharedFragment *dequeue(StreamHandle *s)
+{
+	SharedFragment *f = NULL;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (!s->queued && !s->over)
+		pthread_cond_wait(&s->filled, &s->lock);
+
+	if (s->queued) f = unqueue(s);
+	else s->EOS = true; /* If everything is over... */
+
+	pthread_mutex_unlock(&s->lock);
+
+	return f;
+}
+
+/**
+ * \brief Takes the first fragment out of the read-ahead queue of a stream,
+ *        which must not be empty, and wakes up the worker.
+ *
+ * \warning \c StreamHandle::lock must be held.
+ *
+ * \param s The stream.
+ * \return  The fragment, whose reference goes to the caller.
+ */
+static SharedFragment *unqueue(StreamHandle *s)
+{
+	SharedFragment *f = s->queue[s->queuefirst];
+
+	s->queuefirst = (s->queuefirst + 1) % s->queueslots;
+	s->queued--;
+	s->queuedbytes -= f->view.size;
+	s->queuedticks -= f->view.duration;
+	SMTH_setbuffer(&s->fetcher, s->queuedticks, s->maxfragments);
+	pthread_cond_signal(&s->drained);
+
+	return f;
+}
+
+/**
+ * \brief Lets the thread driving an asynchronous handle feed a stream it
+ *        paused again, once its window is no longer full.
+ *
+ * \warning \c StreamHandle::lock must be held.
+ *
+ * \param s The stream.
+ */
+static void resume(StreamHandle *s)
+{
+	if (!s->paused || windowisfull(s)) return;
+
+	s->paused = false;
+	__atomic_store_n(&s->resumed, true, __ATOMIC_RELEASE);
+	SMTH_wakehandle(s->owner);
+}
+
+/**
+ * \brief Makes the next queued fragment the one being read by \c SMTH_read
+ *        and \c SMTH_readsample.
+ *
+ * \param s The stream to read from.
+ * \return  \c false if the stream is over, \c true otherwise.
+ */
+static bool activate(StreamHandle *s)
+{
+	SharedFragment *f = dequeue(s);
+
+	if (!f) return false;
+
+	s->active = f;
+	s->remaining = f->view.size;
+	s->cursor = (byte_t*) f->view.data;
+	s->sample = 0;
+
+	return true;
+}
+
+/**
+ * \brief Appends a fragment to the read-ahead queue of a stream, growing the
+ *        queue if needed, and wakes up the reader.
+ *
+ * \warning \c StreamHandle::lock must be held.
+ *
+ * \param s The stream to be fed.
+ * \param f The fragment. Its reference goes to the queue.
+ * \return  \c false if the queue could not be grown, \c true otherwise.
+ */
+static bool enqueue(StreamHandle *s, SharedFragment *f)
+{
+	if (s->queued == s->queueslots)
+	{
+		count_t i, slots = s->queueslots? 2 * s->queueslots: 4;
+		SharedFragment **queue = malloc(slots * sizeof (SharedFragment*));
+
+		if (!queue) return false;
+
+		/* unroll the ring */
+		for (i = 0; i < s->queued; ++i)
+			queue[i] = s->queue[(s->queuefirst + i) % s->queueslots];
+
+		free(s->queue);
+		s->queue = queue;
+		s->queueslots = slots;
+		s->queuefirst = 0;
+	}
+
+	s->queue[(s->queuefirst + s->queued) % s->queueslots] = f;
+	s->queued++;
+	s->queuedbytes += f->view.size;
+	s->queuedticks += f->view.duration;
+	SMTH_setbuffer(&s->fetcher, s->queuedticks, s->maxfragments);
+	pthread_cond_signal(&s->filled);
+
+	return true;
+}
+
+/**
+ * \brief Drops the queued fragments preceding a given \c Chunk.
+ *
+ * \warning \c StreamHandle::lock must be held, if the worker is running.
+ *
+ * \param s     The stream to be flushed.
+ * \param until The index of the first \c Chunk to be kept. If it was not
+ *              queued, the whole queue is emptied.
+ */
+static void flushqueue(StreamHandle *s, count_t until)
+{
+	count_t i;
+
+	for (i = 0; i < s->queued; ++i)
+		if (s->queue[(s->queuefirst + i) % s->queueslots]->chunk == until)
+			break;
+
+	/* the queue is sorted: what is before the target is dropped */
+	for (; i; --i, s->queued--)
+	{   SharedFragment *f = s->queue[s->queuefirst];
+		s->queuedbytes -= f->view.size;
+		s->queuedticks -= f->view.duration;
+		SMTH_releasefragment(&f->view);
+		s->queuefirst = (s->queuefirst + 1) % s->queueslots;
+	}
+
+	SMTH_setbuffer(&s->fetcher, s->queuedticks, s->maxfragments);
+
+	pthread_cond_signal(&s->drained);
+}
+
+/**
+ * \brief Looks for the \c Chunk holding a given time, by binary search.
+ *
+ * \param stream The stream to be searched.
+ * \param time   The time, in ticks.
+ * \return       The index of the last \c Chunk starting not after \c time, or
+ *               the first one if \c time precedes the stream.
+ */
+static count_t findchunk(Stream *stream, tick_t time)
+{
+	count_t low = 0, high = stream->chunksno;
+
+	/* invariant: chunks[low]->time <= time < chunks[high]->time */
+	while (high - low > 1)
+	{
+		count_t middle = low + (high - low) / 2;
+
+		if (stream->chunks[middle]->time <= time) low = middle;
+		else high = middle;
+	}
+
+	return low;
+}
+
+/**
+ * \brief Fills in the public view of a freshly parsed fragment, resolving
+ *        the metadata of each sample against the defaults of the fragment.
+ *
+ * Samples not fitting in the payload, as with broken fragments, are dropped.
+ * The reference count is set to one.
+ *
+ * \param f     The fragment to be shared.
+ * \param chunk The \c Chunk the fragment was downloaded from.
+ * \return      \c false if there was no memory left, \c true otherwise.
+ */
+static bool sharefragment(SharedFragment *f, Chunk *chunk)
+{
+	Fragment *fragment = &f->fragment;
+	SMTH_fragment *view = &f->view;
+	length_t offset = 0;
+	tick_t time;
+	count_t i;
+
+	f->refs = 1;
+
+	time = fragment->timestamp? fragment->timestamp: chunk->time;
+
+	view->data = (unsigned char*) fragment->data;
+	view->size = fragment->size;
+	view->index = fragment->index;
+	view->timestamp = time;
+
+	if (fragment->sampleno)
+	{
+		f->samples = calloc(fragment->sampleno, sizeof (SMTH_sample));
+		if (!f->samples) return false;
+	}
+
+	for (i = 0; i < fragment->sampleno; ++i)
+	{
+		Sample *sample = &fragment->samples[i];
+		SMTH_sample *out = &f->samples[i];
+
+		out->size = sample->size? sample->size: fragment->defaults.size;
+		if (offset + out->size > fragment->size) break;
+
+		out->data = &view->data[offset];
+		out->duration = sample->duration? sample->duration:
+			fragment->defaults.duration;
+		if (!i && fragment->settings) out->flags = fragment->settings;
+		else out->flags = sample->settings? sample->settings:
+			fragment->defaults.settings;
+		out->issync = !SAMPLE_IS_DIFFERENCE(out->flags);
+		out->isdisposable = SAMPLE_IS_DEPENDED_ON(out->flags) == NO;
+		out->dts = time;
+		out->pts = time + (int32_t) sample->timeoffset;
+
+		offset += out->size;
+		time += out->duration;
+	}
+
+	view->samplesno = i;
+	view->samples = f->samples;
+	view->duration = time - view->timestamp;
+	if (!view->duration) view->duration = chunk->duration;
+
+	return true;
+}
+
+/**
+ * \brief Keeps a downloaded fragment in memory, so that other handles may
+ *        take it, unless its payload was cut short.
+ *
+ * \param f The fragment, whose payload is settled.
+ */
+static void keepfragment(SharedFragment *f)
+{
+	if (f->key && f->received == f->view.size)
+		SMTH_memorystore(f->key, &f->view);
+}
+
 /* vim: set ts=4 sw=4 tw=0: */
@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 /** The Stream content type. \sa StreamType */
 typedef enum {SMTH_VIDEO, SMTH_AUDIO, SMTH_TEXT} SMTH_type;
@@ -77,18 +78,233 @@ typedef enum
 	SMTH_SUBTYPE,
 	/** Whether the active video is live or not, as a size_t */
 	SMTH_ISLIVE,
+	/** Number of ticks per second of the stream timestamps, as \c uint64_t */
+	SMTH_TIMESCALE,
 
 } SMTH_setting;
 
+/** \brief Enumerates the options that can be changed with \c SMTH_setopt
+ *
+ *  Unless otherwise stated, all values are passed as \c size_t
+ */
+typedef enum
+{
+	/** Max number of fragments downloaded and parsed ahead of the read
+	 *  cursor of each stream. For asynchronous handles, the fragments
+	 *  delivered and not yet acknowledged \sa SMTH_ackfragment.
+	 *  0 = unlimited */
+	SMTH_READAHEAD_FRAGMENTS,
+	/** Max number of payload bytes downloaded and parsed ahead of the read
+	 *  cursor of each stream, counted as \c SMTH_READAHEAD_FRAGMENTS.
+	 *  0 = unlimited */
+	SMTH_READAHEAD_BYTES,
+	/** Number of fragments of each stream downloaded at once, at most 16.
+	 *  0 = adaptive: raised while downloads are dominated by the round trip
+	 *  time, lowered once they are dominated by the bandwidth. Default: 2 */
+	SMTH_TRANSFERS,
+	/** If nonzero, fragments are downloaded to temporary files, instead of
+	 *  memory. Slower, but it bounds the memory taken by transfers in flight.
+	 *  Default: 0 */
+	SMTH_SPILL,
+	/** The strategy choosing the bitrate of each fragment, as a
+	 *  <tt>const SMTH_abr*</tt> which must stay valid while it is in use.
+	 *  \c NULL restores the default, \c SMTH_throughputabr with default
+	 *  parameters. \sa SMTH_abr */
+	SMTH_ABR,
+	/** A directory keeping the fragments downloaded, as a <tt>const char*</tt>,
+	 *  so that they are read from disk when the same presentation is played
+	 *  again, by any process using the same directory. It is shared by the
+	 *  whole process: \c handle is ignored, and handles already open keep
+	 *  the directory they had. \c NULL = no cache. Default: \c NULL */
+	SMTH_CACHE_DIR,
+	/** The bytes the cache directory may hold: the least recently used
+	 *  fragments are evicted beyond. Shared by the whole process, like
+	 *  \c SMTH_CACHE_DIR. 0 = unlimited. Default: 256MiB */
+	SMTH_CACHE_BYTES,
+	/** The payload bytes of the parsed fragments kept in memory, as a
+	 *  \c size_t, so that handles playing the same presentation share them
+	 *  instead of downloading and parsing each its own. Shared by the whole
+	 *  process, like \c SMTH_CACHE_DIR. 0 = none. Default: 0 */
+	SMTH_MEMORY_BYTES,
+
+} SMTH_option;
+
+/** \brief What an adaptive bitrate strategy knows when it is asked for the
+ *         bitrate of the next fragment of a stream \sa SMTH_abr
+ */
+typedef struct
+{
+	/** The bitrates the fragment may be downloaded at, in ascending order.
+	 *  Those above the bitrate cap of the stream, if any, are left out */
+	const uint32_t *bitrates;
+	/** The number of \c bitrates, at least one */
+	size_t bitratesno;
+	/** The bitrate chosen for the previous fragment, or 0 if none was */
+	uint32_t previous;
+	/** The smoothed throughput of the network, in bit/s, or 0 if nothing was
+	 *  downloaded yet */
+	uint32_t throughput;
+	/** A pessimistic throughput, exceeded by most of the last downloads, in
+	 *  bit/s, or 0 if nothing was downloaded yet */
+	uint32_t safethroughput;
+	/** The seconds of media downloaded ahead of the reader, or a negative
+	 *  value if unknown */
+	double buffer;
+	/** The most seconds of media the read-ahead window holds, or 0 if it is
+	 *  unbounded \sa SMTH_READAHEAD_FRAGMENTS */
+	double capacity;
+	/** The duration of the fragment, in seconds */
+	double duration;
+} SMTH_abrstate;
+
+/** \brief An adaptive bitrate strategy \sa SMTH_ABR
+ *
+ *  The strategy is called by the thread downloading the stream, once for each
+ *  fragment: it must be fast, and must not block. A bitrate not in the list
+ *  is rounded down to the nearest one (or up to the lowest).
+ */
+typedef struct
+{
+	/** Picks the bitrate of the next fragment among \c state->bitrates */
+	uint32_t (*choose)(const SMTH_abrstate *state, void *userdata);
+	/** Opaque data passed to \c choose */
+	void *userdata;
+} SMTH_abr;
+
+/** \brief Tunes the built-in strategies, passed as their \c userdata
+ *
+ *  A \c NULL pointer, as well as zeroed fields, selects default values.
+ */
+typedef struct
+{
+	/** The throughput needed to pick a bitrate, as a multiple of it.
+	 *  Default: 1.25 */
+	double headroom;
+	/** Below this buffer level, in seconds, buffer based strategies pick the
+	 *  lowest bitrate. Default: 35% of \c target */
+	double reservoir;
+	/** At this buffer level, in seconds, buffer based strategies pick the
+	 *  highest bitrate. Default: the read-ahead capacity less a fragment,
+	 *  or 30 s if it is unbounded */
+	double target;
+} SMTH_abrparams;
+
+/** \brief Metadata of a single sample (access unit) of a fragment */
+typedef struct
+{
+	/** Pointer to the sample data, inside \c SMTH_fragment::data */
+	const unsigned char *data;
+	/** Size of the sample, in bytes */
+	size_t size;
+	/** Decoding timestamp, in ticks \sa SMTH_TIMESCALE */
+	uint64_t dts;
+	/** Presentation timestamp, in ticks */
+	uint64_t pts;
+	/** Duration of the sample, in ticks */
+	uint32_t duration;
+	/** Sample flags, as defined by [ISOFF] */
+	uint32_t flags;
+	/** Whether the sample is a sync sample (e.g. a video keyframe) */
+	int issync;
+	/** Whether no other sample depends on this one, so that it may be
+	 *  skipped without decoding it */
+	int isdisposable;
+} SMTH_sample;
+
+/** \brief A parsed fragment, as handed out by \c SMTH_getfragment
+ *
+ *  The structure, as well as the memory it points to, is read only and stays
+ *  valid until \c SMTH_releasefragment is called.
+ */
+typedef struct
+{
+	/** The fragment payload */
+	const unsigned char *data;
+	/** The size of the payload, in bytes */
+	size_t size;
+	/** Ordinal number of the fragment in the stream */
+	unsigned int index;
+	/** Timestamp of the first sample, in ticks \sa SMTH_TIMESCALE */
+	uint64_t timestamp;
+	/** Total duration of the samples, in ticks */
+	uint64_t duration;
+	/** Number of samples in the fragment */
+	size_t samplesno;
+	/** Per-sample metadata, repeated exactly \c samplesno times */
+	const SMTH_sample *samples;
+} SMTH_fragment;
+
+/** \brief Event handlers of an asynchronous handle \sa SMTH_open_async
+ *
+ *  Each handler receives the handle it refers to, and the opaque pointer given
+ *  to \c SMTH_open_async. Handlers are called from a library thread, one at a
+ *  time: they must not block. Any of them may be \c NULL. Handlers of an
+ *  external handle are called from \c SMTH_process instead.
+ */
+typedef struct
+{
+	/** The Manifest was parsed: \c SMTH_getinfo may be used from now on */
+	void (*on_manifest)(void *handle, void *userdata);
+	/** A fragment of \c stream arrived. Fragments of each stream come in
+	 *  order. The fragment is released when the handler returns, unless it
+	 *  is kept with \c SMTH_retainfragment. It fills the read-ahead window
+	 *  of the stream until it is acknowledged with \c SMTH_ackfragment:
+	 *  nothing else is delivered while the window is full */
+	void (*on_fragment)(void *handle, int stream,
+		const SMTH_fragment *fragment, void *userdata);
+	/** Nothing else will come from \c stream */
+	void (*on_eos)(void *handle, int stream, void *userdata);
+	/** \c stream was stopped by \c error (a negative code). If the Manifest
+	 *  could not be loaded, \c stream is \c -1 and nothing else will come */
+	void (*on_error)(void *handle, int stream, int error, void *userdata);
+} SMTH_callbacks;
+
+/** The socket is to be watched for reading, or is readable */
+#define SMTH_POLLIN  0x01
+/** The socket is to be watched for writing, or is writable */
+#define SMTH_POLLOUT 0x02
+/** The socket is in error (\c SMTH_process only) */
+#define SMTH_POLLERR 0x04
+/** Passed to \c SMTH_process in place of a socket when the timeout expired */
+#define SMTH_NOFD    (-1)
+
+/** \brief A socket an external handle needs to be watched
+ *         \sa SMTH_open_external */
+typedef struct
+{
+	/** The socket */
+	int fd;
+	/** What to watch for, as \c SMTH_POLLIN and \c SMTH_POLLOUT flags */
+	int events;
+} SMTH_pollfd;
+
+uint32_t SMTH_throughputabr(const SMTH_abrstate *state, void *params);
+uint32_t SMTH_bufferabr(const SMTH_abrstate *state, void *params);
+uint32_t SMTH_hybridabr(const SMTH_abrstate *state, void *params);
+
 #ifndef __COMPILING_LIBSMTH__
 
 /** \brief Pseudofile handle, declared as an opaque pointer */
 typedef void *SMTHh;
 
 SMTHh SMTH_open(const char *url, const char *params);
+SMTHh SMTH_open_async(const char *url, const char *params,
+	const SMTH_callbacks *callbacks, void *userdata);
+SMTHh SMTH_open_external(const char *url, const char *params,
+	const SMTH_callbacks *callbacks, void *userdata);
+size_t SMTH_getfds(SMTHh handle, SMTH_pollfd *fds, size_t size);
+long SMTH_gettimeout(SMTHh handle);
+int SMTH_process(SMTHh handle, int fd, int events);
 size_t SMTH_read(void *buffer, size_t size, int stream, SMTHh handle);
+int SMTH_readsample(SMTH_sample *sample, int stream, SMTHh handle);
+int SMTH_seek(SMTHh handle, int stream, uint64_t time);
 int SMTH_EOS(SMTHh handle, int stream);
 void SMTH_getinfo(SMTH_setting what, SMTHh handle, ...);
+void SMTH_setopt(SMTH_option what, SMTHh handle, ...);
+const SMTH_fragment *SMTH_getfragment(SMTHh handle, int stream);
+void SMTH_retainfragment(const SMTH_fragment *fragment);
+void SMTH_releasefragment(const SMTH_fragment *fragment);
+int SMTH_ackfragment(SMTHh handle, int stream);
 void SMTH_close(SMTHh handle);
 
 #endif /* __COMPILING_LIBSMTH___ */
@@ -48,7 +48,7 @@ int main(int argc, char **argv)
 
 		Fragment vc;
 
-		error_t exitcode = SMTH_parsefragment(&vc, input);
+		error_t exitcode = SMTH_mapfragment(&vc, input);
 		if (exitcode != FRAGMENT_SUCCESS)
 		{
 			SMTH_error(exitcode, stderr);
@@ -43,7 +43,9 @@ int usage(const char *name)
 
 int main(int argc, char **argv)
 {
-	FILE *f;
+	FILE *f = NULL;
+	char *params = NULL;
+	bool download = true;
 
 	if ((argc == 2) && (!strcmp(argv[1], "-v")))
 	{	printf("SMTH downloader v0.1\n");
@@ -72,11 +74,10 @@ int main(int argc, char **argv)
 			if (argc < 4) return usage(argv[0]);
 
 			f = fopen(filename, "r");
+			download = false;
 		}
 		else if (!strcmp(option, "-d"))
 		{
-			char *params;
-
 			switch (argc)
 			{
 				case 3:
@@ -86,23 +87,19 @@ int main(int argc, char **argv)
 				default:
 					usage(argv[0]);
 			}
-	
-			f = SMTH_fetchmanifest(urlname, params);
 		}
 		else return usage(argv[0]);
 	}
-	else
-	{	f = SMTH_fetchmanifest(urlname, NULL);
-	}
 
-	if (!f)
+	if (!download && !f)
 	{
-		fprintf(stderr, "Could not retrieve the stream manifest from the Internet.\n");
+		fprintf(stderr, "Could not open the stream manifest.\n");
 		return -1;
 	}
 
 	Manifest m;
-	error_t r = SMTH_parsemanifest(&m, f);
+	error_t r = download? SMTH_fetchmanifest(urlname, params, &m, NULL):
+		SMTH_parsemanifest(&m, f);
 
 	if (r != MANIFEST_SUCCESS)
 	{